@@ -0,0 +1,144 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_state.h"
+#include "ngx_dynamic_upstream_backoff.h"
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_backoff_pending(ngx_dynamic_upstream_srv_conf_t *dus, ngx_http_upstream_rr_peer_t *peer);
+static ngx_uint_t
+ngx_dynamic_upstream_backoff_peer(ngx_dynamic_upstream_srv_conf_t *dus, ngx_http_upstream_rr_peer_t *peer);
+
+
+/* tests whether the peer starts or ends a failure window, as ngx_dynamic_upstream_backoff_peer() without the changes */
+static ngx_uint_t
+ngx_dynamic_upstream_backoff_pending(ngx_dynamic_upstream_srv_conf_t *dus, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    ps = ngx_dynamic_upstream_state_lookup(dus->sh, peer);
+    if (ps == NULL || peer->max_fails == 0) {
+        return 0;
+    }
+
+    if (peer->fails == 0) {
+        return ps->backoff != 0;
+    }
+
+    return peer->fails >= peer->max_fails && peer->accessed != ps->backoff_accessed;
+}
+
+
+/*
+ * a failure window starts when the fails of the peer reach max_fails.
+ * the round robin tries the peer again after fail_timeout and a failure
+ * there starts the next window with the new accessed time.
+ */
+static ngx_uint_t
+ngx_dynamic_upstream_backoff_peer(ngx_dynamic_upstream_srv_conf_t *dus, ngx_http_upstream_rr_peer_t *peer)
+{
+    time_t                              fail_timeout;
+    ngx_uint_t                          i;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    ps = ngx_dynamic_upstream_state_lookup(dus->sh, peer);
+    if (ps == NULL || peer->max_fails == 0) {
+        return 0;
+    }
+
+    /* succeeded after the failures */
+    if (peer->fails == 0) {
+        if (ps->backoff == 0) {
+            return 0;
+        }
+
+        ps->backoff = 0;
+        peer->fail_timeout = ps->fail_timeout;
+
+        return 1;
+    }
+
+    if (peer->fails < peer->max_fails || peer->accessed == ps->backoff_accessed) {
+        return 0;
+    }
+
+    ps->backoff_accessed = peer->accessed;
+    ps->backoff++;
+
+    fail_timeout = ps->fail_timeout;
+
+    for (i = 1; i < ps->backoff && fail_timeout < dus->backoff; i++) {
+        fail_timeout *= 2;
+    }
+
+    peer->fail_timeout = ngx_min(fail_timeout, ngx_max(dus->backoff, ps->fail_timeout));
+
+    return 1;
+}
+
+
+/*
+ * the peers are scanned with the read lock, and the locks of the zone are taken
+ * only when a failure window of a peer starts or ends.
+ */
+void
+ngx_dynamic_upstream_backoff_tick(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                        changed, pending;
+    ngx_slab_pool_t                  *shpool;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers, *list;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    if (dus->backoff == 0) {
+        return;
+    }
+
+    peers = uscf->peer.data;
+    pending = 0;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (list = peers; list && !pending; list = list->next) {
+        for (peer = list->peer; peer && !pending; peer = peer->next) {
+            pending = ngx_dynamic_upstream_backoff_pending(dus, peer);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (!pending) {
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    /* any worker can do it, the windows are identified in the shared state */
+    if (!ngx_shmtx_trylock(&shpool->mutex)) {
+        return;
+    }
+
+    changed = 0;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    for (list = peers; list; list = list->next) {
+        for (peer = list->peer; peer; peer = peer->next) {
+            changed += ngx_dynamic_upstream_backoff_peer(dus, peer);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (changed) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "dynamic upstream backoff changed %ui servers", changed);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_BACKOFF_H
+#define NGX_DYNAMIC_UPSTREAM_BACKOFF_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+void ngx_dynamic_upstream_backoff_tick(ngx_http_upstream_srv_conf_t *uscf);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_BACKOFF_H */
@@ -0,0 +1,339 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_balancer.h"
+#include "ngx_dynamic_upstream_keepalive.h"
+
+
+#define NGX_DYNAMIC_UPSTREAM_TRIED_BITS (8 * sizeof(uintptr_t))
+
+/* the peers added between the check of a get and its lock of the peers */
+#define NGX_DYNAMIC_UPSTREAM_TRIED_HEADROOM NGX_DYNAMIC_UPSTREAM_TRIED_BITS
+
+
+/*
+ * the random balancer of nginx before 1.27.3 builds the ranges of the peers once in a worker,
+ * and indexes them by peers->number. the peers added or removed are beyond the ranges or freed.
+ */
+#if (nginx_version >= 1015001 && nginx_version < 1027003)
+#define NGX_DYNAMIC_UPSTREAM_RANDOM_FIXED 1
+#endif
+
+
+/* the tried bitmap of a request, grown by the get of the peer */
+typedef struct {
+    ngx_pool_t                    *pool;
+    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_event_get_peer_pt          original_get_peer;
+    ngx_uint_t                     words;
+    ngx_uint_t                     max;
+    uintptr_t                      bitmap[1];
+} ngx_dynamic_upstream_tried_t;
+
+
+static ngx_int_t
+ngx_dynamic_upstream_balancer_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t
+ngx_dynamic_upstream_balancer_get_peer(ngx_peer_connection_t *pc, void *data);
+static ngx_dynamic_upstream_tried_t *
+ngx_dynamic_upstream_balancer_tried(ngx_pool_t *pool, ngx_http_upstream_rr_peers_t *peers, ngx_uint_t max);
+#if (NGX_DYNAMIC_UPSTREAM_RANDOM_FIXED)
+static char *
+ngx_dynamic_upstream_balancer_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void
+ngx_dynamic_upstream_balancer_random_restore(void *data);
+
+
+static char *(*ngx_dynamic_upstream_balancer_random_set)(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+#endif
+
+
+/*
+ * the random directive is wrapped to know the upstreams of random.
+ * the directive is restored with the cycle, so that a reload without this module
+ * or with the module loaded from another address does not reach the wrapper.
+ */
+ngx_int_t
+ngx_dynamic_upstream_balancer_preconfiguration(ngx_conf_t *cf)
+{
+#if (NGX_DYNAMIC_UPSTREAM_RANDOM_FIXED)
+    ngx_uint_t           i;
+    ngx_command_t       *cmd;
+    ngx_pool_cleanup_t  *cln;
+
+    for (i = 0; cf->cycle->modules[i]; i++) {
+        if (ngx_strcmp(cf->cycle->modules[i]->name, "ngx_http_upstream_random_module") == 0) {
+            break;
+        }
+    }
+
+    if (cf->cycle->modules[i] == NULL) {
+        return NGX_OK;
+    }
+
+    for (cmd = cf->cycle->modules[i]->commands; cmd->name.len; cmd++) {
+        if (ngx_strcmp(cmd->name.data, "random") != 0 || cmd->set == ngx_dynamic_upstream_balancer_random) {
+            continue;
+        }
+
+        cln = ngx_pool_cleanup_add(cf->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_dynamic_upstream_balancer_random_restore;
+        cln->data = cmd;
+
+        ngx_dynamic_upstream_balancer_random_set = cmd->set;
+        cmd->set = ngx_dynamic_upstream_balancer_random;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
+#if (NGX_DYNAMIC_UPSTREAM_RANDOM_FIXED)
+
+static char *
+ngx_dynamic_upstream_balancer_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char                             *rv;
+    ngx_uint_t                        index;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    rv = ngx_dynamic_upstream_balancer_random_set(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    /* the cycle being parsed may be without this module */
+    index = ngx_dynamic_upstream_module.index;
+
+    if (index >= cf->cycle->modules_n || cf->cycle->modules[index] != &ngx_dynamic_upstream_module) {
+        return NGX_CONF_OK;
+    }
+
+    dus = ngx_http_conf_get_module_srv_conf(cf, ngx_dynamic_upstream_module);
+    dus->random = 1;
+
+    return NGX_CONF_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_balancer_random_restore(void *data)
+{
+    ngx_command_t  *cmd = data;
+
+    if (cmd->set == ngx_dynamic_upstream_balancer_random) {
+        cmd->set = ngx_dynamic_upstream_balancer_random_set;
+    }
+}
+
+#endif
+
+
+/* the servers of the upstream can not be added or removed with this version of nginx */
+ngx_uint_t
+ngx_dynamic_upstream_balancer_fixed(ngx_http_upstream_srv_conf_t *uscf)
+{
+#if (NGX_DYNAMIC_UPSTREAM_RANDOM_FIXED)
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    return dus->random;
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * the balancers of nginx size the tried bitmap of a request by peers->number
+ * at the start of the request, and index it by the position of the peer in the
+ * list. the peers added in the meantime are beyond the bitmap. the bitmap is
+ * replaced with the one sized by the peers at the start, and grown at the get
+ * of a peer when peers were added. the zone bounds the size.
+ */
+void
+ngx_dynamic_upstream_balancer_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i, n;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_init_peer_pt   *init;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL || uscf->srv_conf == NULL || uscf->peer.init == NULL) {
+            continue;
+        }
+
+        dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+        if (dus->sh == NULL) {
+            continue;
+        }
+
+        n = uscf->shm_zone->shm.size / sizeof(ngx_http_upstream_rr_peer_t);
+
+        for (peers = uscf->peer.data; peers; peers = peers->next) {
+            n += peers->number;
+        }
+
+        dus->tried = (n + NGX_DYNAMIC_UPSTREAM_TRIED_BITS - 1) / NGX_DYNAMIC_UPSTREAM_TRIED_BITS;
+
+        /* the bitmap of a word is in the peer data */
+        if (dus->tried < 2) {
+            dus->tried = 0;
+            continue;
+        }
+
+        /* the keepalive module wraps the balancer, and the data of the balancer is needed */
+        init = ngx_dynamic_upstream_keepalive_init_peer(uscf);
+
+        if (init == NULL && ngx_dynamic_upstream_keepalive_enabled(uscf)) {
+            if (ngx_worker == 0) {
+                ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                              "the requests of upstream \"%V\" with keepalive may skip the servers added "
+                              "with this version of nginx", &uscf->host);
+            }
+
+            dus->tried = 0;
+            continue;
+        }
+
+        if (init == NULL) {
+            init = &uscf->peer.init;
+        }
+
+        dus->original_init_peer = *init;
+        *init = ngx_dynamic_upstream_balancer_init_peer;
+    }
+}
+
+
+/*
+ * the random balancer rebuilds its ranges when the configuration of the peers is changed.
+ * peers->config is in nginx-1.27.3, the other balancers read the peers at every request.
+ */
+void
+ngx_dynamic_upstream_balancer_changed(ngx_http_upstream_rr_peers_t *peers)
+{
+#if (nginx_version >= 1027003)
+    if (peers->config) {
+        (*peers->config)++;
+    }
+#endif
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_balancer_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+    ngx_dynamic_upstream_tried_t      *tried;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(us, ngx_dynamic_upstream_module);
+
+    if (dus->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    tried = ngx_dynamic_upstream_balancer_tried(r->pool, us->peer.data, dus->tried);
+    if (tried == NULL) {
+        return NGX_ERROR;
+    }
+
+    tried->original_get_peer = r->upstream->peer.get;
+
+    /* round robin, least_conn, random, hash and ip_hash keep the data of round robin first */
+    rrp = r->upstream->peer.data;
+    rrp->tried = tried->bitmap;
+
+    /* the keepalive module keeps this get as the get of the balancer */
+    r->upstream->peer.get = ngx_dynamic_upstream_balancer_get_peer;
+
+    return NGX_OK;
+}
+
+
+/* the bitmap is grown when the peers were added after the bitmap was sized */
+static ngx_int_t
+ngx_dynamic_upstream_balancer_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_rr_peer_data_t  *rrp = data;
+
+    ngx_uint_t                     n;
+    ngx_dynamic_upstream_tried_t  *tried, *grown;
+
+    tried = (ngx_dynamic_upstream_tried_t *) ((u_char *) rrp->tried - offsetof(ngx_dynamic_upstream_tried_t, bitmap));
+
+    n = tried->peers->number;
+
+    if (tried->peers->next && tried->peers->next->number > n) {
+        n = tried->peers->next->number;
+    }
+
+    if (n + NGX_DYNAMIC_UPSTREAM_TRIED_HEADROOM > tried->words * NGX_DYNAMIC_UPSTREAM_TRIED_BITS
+        && tried->words < tried->max)
+    {
+        grown = ngx_dynamic_upstream_balancer_tried(tried->pool, tried->peers, tried->max);
+        if (grown == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(grown->bitmap, tried->bitmap, tried->words * sizeof(uintptr_t));
+        grown->original_get_peer = tried->original_get_peer;
+
+        rrp->tried = grown->bitmap;
+        tried = grown;
+    }
+
+    return tried->original_get_peer(pc, data);
+}
+
+
+/* for the peers and the headroom, up to max words of the peers the zone can hold */
+static ngx_dynamic_upstream_tried_t *
+ngx_dynamic_upstream_balancer_tried(ngx_pool_t *pool, ngx_http_upstream_rr_peers_t *peers, ngx_uint_t max)
+{
+    ngx_uint_t                     n, words;
+    ngx_dynamic_upstream_tried_t  *tried;
+
+    n = peers->number;
+
+    if (peers->next && peers->next->number > n) {
+        n = peers->next->number;
+    }
+
+    words = (n + NGX_DYNAMIC_UPSTREAM_TRIED_HEADROOM + NGX_DYNAMIC_UPSTREAM_TRIED_BITS - 1)
+            / NGX_DYNAMIC_UPSTREAM_TRIED_BITS;
+
+    if (words > max) {
+        words = max;
+    }
+
+    tried = ngx_pcalloc(pool, offsetof(ngx_dynamic_upstream_tried_t, bitmap) + words * sizeof(uintptr_t));
+    if (tried == NULL) {
+        return NULL;
+    }
+
+    tried->pool = pool;
+    tried->peers = peers;
+    tried->words = words;
+    tried->max = max;
+
+    return tried;
+}
@@ -0,0 +1,17 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_BALANCER_H
+#define NGX_DYNAMIC_UPSTREAM_BALANCER_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+ngx_int_t ngx_dynamic_upstream_balancer_preconfiguration(ngx_conf_t *cf);
+ngx_uint_t ngx_dynamic_upstream_balancer_fixed(ngx_http_upstream_srv_conf_t *uscf);
+void ngx_dynamic_upstream_balancer_init_process(ngx_cycle_t *cycle);
+void ngx_dynamic_upstream_balancer_changed(ngx_http_upstream_rr_peers_t *peers);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_BALANCER_H */
@@ -0,0 +1,334 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_chash.h"
+
+
+/* the points of a server of the weight 1 */
+#define NGX_DYNAMIC_UPSTREAM_CHASH_POINTS 160
+
+
+/*
+ * the configuration of ngx_http_upstream_hash_module, which is not exported.
+ * this must be same as ngx_http_upstream_hash_module.c.
+ */
+typedef struct {
+    ngx_http_complex_value_t              key;
+    ngx_dynamic_upstream_chash_points_t  *points;
+} ngx_dynamic_upstream_hash_srv_conf_t;
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_chash_points(ngx_str_t *server, ngx_uint_t weight, ngx_dynamic_upstream_chash_point_t *point);
+static ngx_uint_t
+ngx_dynamic_upstream_chash_exists(ngx_dynamic_upstream_chash_points_t *points, uint32_t hash);
+static int ngx_libc_cdecl
+ngx_dynamic_upstream_chash_cmp_points(const void *one, const void *two);
+
+
+/*
+ * moves the points built by ngx_http_upstream_init_chash() to the zone,
+ * so that the points added by a worker are seen by all the workers.
+ */
+ngx_int_t
+ngx_dynamic_upstream_chash_init_zone(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *uscf)
+{
+    size_t                                 size;
+    ngx_uint_t                             i, n;
+    ngx_module_t                          *module;
+    ngx_slab_pool_t                       *shpool;
+    ngx_dynamic_upstream_srv_conf_t       *dus;
+    ngx_dynamic_upstream_chash_points_t   *points;
+    ngx_dynamic_upstream_hash_srv_conf_t  *hcf;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    if (dus->sh == NULL) {
+        return NGX_OK;
+    }
+
+    module = NULL;
+
+    for (i = 0; cycle->modules[i]; i++) {
+        if (ngx_strcmp(cycle->modules[i]->name, "ngx_http_upstream_hash_module") == 0) {
+            module = cycle->modules[i];
+            break;
+        }
+    }
+
+    if (module == NULL) {
+        return NGX_OK;
+    }
+
+    /* the points are built only for "hash ... consistent" */
+    hcf = uscf->srv_conf[module->ctx_index];
+    if (hcf == NULL || hcf->points == NULL) {
+        return NGX_OK;
+    }
+
+    n = (dus->hash_points != NGX_CONF_UNSET) ? (ngx_uint_t) dus->hash_points : hcf->points->number * 2;
+    n = ngx_max(n, hcf->points->number);
+
+    size = sizeof(ngx_dynamic_upstream_chash_points_t) + sizeof(ngx_dynamic_upstream_chash_point_t) * (n - 1);
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+    points = ngx_slab_alloc_locked(shpool, size);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (points == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "failed to allocate %ui consistent hash points in upstream zone \"%V\"",
+                      n, &uscf->shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(points, hcf->points,
+               sizeof(ngx_dynamic_upstream_chash_points_t)
+               + sizeof(ngx_dynamic_upstream_chash_point_t) * (hcf->points->number - 1));
+
+    dus->sh->chash = points;
+    dus->sh->chash_size = n;
+
+    /* the workers inherit the pointer */
+    hcf->points = points;
+
+    return NGX_OK;
+}
+
+
+/*
+ * merges the points of the added peer into the sorted points.
+ * the other points are not moved between the servers, and
+ * the readers are excluded by the write lock of the peers.
+ */
+ngx_int_t
+ngx_dynamic_upstream_chash_add_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t                            i, j, n, w;
+    ngx_dynamic_upstream_chash_point_t   *added;
+    ngx_dynamic_upstream_chash_points_t  *points;
+
+    points = sh->chash;
+    if (points == NULL) {
+        return NGX_OK;
+    }
+
+    n = peer->weight * NGX_DYNAMIC_UPSTREAM_CHASH_POINTS;
+
+    if (points->number + n > sh->chash_size) {
+        return NGX_DECLINED;
+    }
+
+    added = ngx_alloc(sizeof(ngx_dynamic_upstream_chash_point_t) * n, ngx_cycle->log);
+    if (added == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = ngx_dynamic_upstream_chash_points(&peer->server, peer->weight, added);
+
+    ngx_qsort(added, n, sizeof(ngx_dynamic_upstream_chash_point_t), ngx_dynamic_upstream_chash_cmp_points);
+
+    /* the same hash is kept once as ngx_http_upstream_init_chash() does */
+    for (i = 0, j = 0; i < n; i++) {
+        if ((j > 0 && added[j - 1].hash == added[i].hash)
+            || ngx_dynamic_upstream_chash_exists(points, added[i].hash))
+        {
+            continue;
+        }
+
+        added[j++] = added[i];
+    }
+
+    /* merged from the tail */
+    i = points->number;
+    w = points->number + j;
+    n = j;
+
+    while (n > 0) {
+        if (i > 0 && points->point[i - 1].hash > added[n - 1].hash) {
+            points->point[--w] = points->point[--i];
+        } else {
+            points->point[--w] = added[--n];
+        }
+    }
+
+    points->number += j;
+
+    ngx_free(added);
+
+    return NGX_OK;
+}
+
+
+/*
+ * drops the points of the removed peer. the points shared with another
+ * peer of the same server, such as an address of a name, are kept for it.
+ */
+void
+ngx_dynamic_upstream_chash_remove_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peers_t *peers,
+                                         ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_str_t                            *server, *s;
+    ngx_uint_t                            i, j;
+    ngx_http_upstream_rr_peer_t          *p;
+    ngx_dynamic_upstream_chash_points_t  *points;
+
+    points = sh->chash;
+    if (points == NULL) {
+        return;
+    }
+
+    server = NULL;
+
+    for (p = peers->peer; p; p = p->next) {
+        if (p != peer
+            && p->server.len == peer->server.len
+            && ngx_strncmp(p->server.data, peer->server.data, peer->server.len) == 0)
+        {
+            server = &p->server;
+            break;
+        }
+    }
+
+    for (i = 0, j = 0; i < points->number; i++) {
+        s = points->point[i].server;
+
+        if (s->len == peer->server.len && ngx_strncmp(s->data, peer->server.data, s->len) == 0) {
+            if (server == NULL) {
+                continue;
+            }
+
+            /* the removed peer may own the string */
+            points->point[i].server = server;
+        }
+
+        points->point[j++] = points->point[i];
+    }
+
+    points->number = j;
+}
+
+
+/* same as ngx_http_upstream_init_chash(), compatible with Cache::Memcached::Fast */
+static ngx_uint_t
+ngx_dynamic_upstream_chash_points(ngx_str_t *server, ngx_uint_t weight, ngx_dynamic_upstream_chash_point_t *point)
+{
+    u_char      *host, *port, c;
+    size_t       host_len, port_len;
+    uint32_t     hash, base_hash;
+    ngx_uint_t   i, n;
+    union {
+        uint32_t                        value;
+        u_char                          byte[4];
+    } prev_hash;
+
+    if (server->len >= 5 && ngx_strncasecmp(server->data, (u_char *) "unix:", 5) == 0) {
+        host = server->data + 5;
+        host_len = server->len - 5;
+        port = NULL;
+        port_len = 0;
+        goto done;
+    }
+
+    for (i = 0; i < server->len; i++) {
+        c = server->data[server->len - i - 1];
+
+        if (c == ':') {
+            host = server->data;
+            host_len = server->len - i - 1;
+            port = server->data + server->len - i;
+            port_len = i;
+            goto done;
+        }
+
+        if (c < '0' || c > '9') {
+            break;
+        }
+    }
+
+    host = server->data;
+    host_len = server->len;
+    port = NULL;
+    port_len = 0;
+
+ done:
+
+    ngx_crc32_init(base_hash);
+    ngx_crc32_update(&base_hash, host, host_len);
+    ngx_crc32_update(&base_hash, (u_char *) "", 1);
+    ngx_crc32_update(&base_hash, port, port_len);
+
+    prev_hash.value = 0;
+    n = weight * NGX_DYNAMIC_UPSTREAM_CHASH_POINTS;
+
+    for (i = 0; i < n; i++) {
+        hash = base_hash;
+
+        ngx_crc32_update(&hash, prev_hash.byte, 4);
+        ngx_crc32_final(hash);
+
+        point[i].hash = hash;
+        point[i].server = server;
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+        prev_hash.value = hash;
+#else
+        prev_hash.byte[0] = (u_char) (hash & 0xff);
+        prev_hash.byte[1] = (u_char) ((hash >> 8) & 0xff);
+        prev_hash.byte[2] = (u_char) ((hash >> 16) & 0xff);
+        prev_hash.byte[3] = (u_char) ((hash >> 24) & 0xff);
+#endif
+    }
+
+    return n;
+}
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_chash_exists(ngx_dynamic_upstream_chash_points_t *points, uint32_t hash)
+{
+    ngx_uint_t  i, j, k;
+
+    i = 0;
+    j = points->number;
+
+    while (i < j) {
+        k = (i + j) / 2;
+
+        if (hash > points->point[k].hash) {
+            i = k + 1;
+
+        } else if (hash < points->point[k].hash) {
+            j = k;
+
+        } else {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int ngx_libc_cdecl
+ngx_dynamic_upstream_chash_cmp_points(const void *one, const void *two)
+{
+    ngx_dynamic_upstream_chash_point_t  *first, *second;
+
+    first = (ngx_dynamic_upstream_chash_point_t *) one;
+    second = (ngx_dynamic_upstream_chash_point_t *) two;
+
+    if (first->hash < second->hash) {
+        return -1;
+
+    } else if (first->hash > second->hash) {
+        return 1;
+
+    } else {
+        return 0;
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_CHASH_H
+#define NGX_DYNAMIC_UPSTREAM_CHASH_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+ngx_int_t ngx_dynamic_upstream_chash_init_zone(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *uscf);
+ngx_int_t ngx_dynamic_upstream_chash_add_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer);
+void ngx_dynamic_upstream_chash_remove_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peers_t *peers,
+                                              ngx_http_upstream_rr_peer_t *peer);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_CHASH_H */
@@ -0,0 +1,464 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_state.h"
+#include "ngx_dynamic_upstream_check.h"
+#include "ngx_dynamic_upstream_keepalive.h"
+
+
+/* "HTTP/1.1 200" */
+#define NGX_DYNAMIC_UPSTREAM_CHECK_STATUS_LINE_LEN 12
+
+#define NGX_DYNAMIC_UPSTREAM_CHECK_BUFFER_SIZE 1024
+
+
+typedef struct ngx_dynamic_upstream_check_ctx_s ngx_dynamic_upstream_check_ctx_t;
+
+struct ngx_dynamic_upstream_check_ctx_s {
+    ngx_pool_t                        *pool;
+    ngx_peer_connection_t              pc;
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_upstream_rr_peer_t       *peer;  /* only compared, it may be removed */
+    ngx_str_t                          name;
+    ngx_buf_t                         *request;
+    ngx_buf_t                         *response;
+    ngx_dynamic_upstream_check_ctx_t  *next;
+};
+
+
+static ngx_dynamic_upstream_check_ctx_t *
+ngx_dynamic_upstream_check_create(ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peer_t *peer);
+static void
+ngx_dynamic_upstream_check_start(ngx_dynamic_upstream_check_ctx_t *ctx);
+static void
+ngx_dynamic_upstream_check_write_handler(ngx_event_t *wev);
+static void
+ngx_dynamic_upstream_check_read_handler(ngx_event_t *rev);
+static void
+ngx_dynamic_upstream_check_dummy_handler(ngx_event_t *ev);
+static ngx_int_t
+ngx_dynamic_upstream_check_status(ngx_dynamic_upstream_srv_conf_t *dus, ngx_buf_t *b);
+static void
+ngx_dynamic_upstream_check_finalize(ngx_dynamic_upstream_check_ctx_t *ctx, ngx_uint_t ok);
+
+
+void
+ngx_dynamic_upstream_check_tick(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_slab_pool_t                   *shpool;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_http_upstream_rr_peers_t      *peers, *list;
+    ngx_dynamic_upstream_shctx_t      *sh;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+    ngx_dynamic_upstream_check_ctx_t  *ctx, *checks;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    sh = dus->sh;
+
+    /* unlocked check, the worker claiming the round checks all the peers */
+    if (dus->check == 0 || sh->check_next > ngx_current_msec) {
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    if (!ngx_shmtx_trylock(&shpool->mutex)) {
+        return;
+    }
+
+    if (sh->check_next > ngx_current_msec) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    sh->check_next = ngx_current_msec + dus->check;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    peers = uscf->peer.data;
+    checks = NULL;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (list = peers; list; list = list->next) {
+        for (peer = list->peer; peer; peer = peer->next) {
+            ctx = ngx_dynamic_upstream_check_create(uscf, peer);
+            if (ctx == NULL) {
+                continue;
+            }
+
+            ctx->next = checks;
+            checks = ctx;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    /* the results are recorded with the write lock */
+    while (checks) {
+        ctx = checks;
+        checks = ctx->next;
+
+        ngx_dynamic_upstream_check_start(ctx);
+    }
+}
+
+
+/* copies the peer since it may be removed while checking */
+static ngx_dynamic_upstream_check_ctx_t *
+ngx_dynamic_upstream_check_create(ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_pool_t                        *pool;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+    ngx_dynamic_upstream_check_ctx_t  *ctx;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    pool = ngx_create_pool(NGX_DYNAMIC_UPSTREAM_CHECK_BUFFER_SIZE * 2, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    ctx = ngx_pcalloc(pool, sizeof(ngx_dynamic_upstream_check_ctx_t));
+    if (ctx == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    ctx->pool = pool;
+    ctx->uscf = uscf;
+    ctx->peer = peer;
+
+    ctx->name.data = ngx_pstrdup(pool, &peer->name);
+    if (ctx->name.data == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+    ctx->name.len = peer->name.len;
+
+    ctx->pc.sockaddr = ngx_palloc(pool, peer->socklen);
+    if (ctx->pc.sockaddr == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+    ngx_memcpy(ctx->pc.sockaddr, peer->sockaddr, peer->socklen);
+
+    ctx->pc.socklen = peer->socklen;
+    ctx->pc.name = &ctx->name;
+    ctx->pc.get = ngx_event_get_peer;
+    ctx->pc.log = ngx_cycle->log;
+    ctx->pc.log_error = NGX_ERROR_ERR;
+
+    if (dus->check_type == NGX_DYNAMIC_UPSTREAM_CHECK_HTTP) {
+        ctx->request = ngx_create_temp_buf(pool, sizeof("GET  HTTP/1.0" CRLF "Host: " CRLF
+                                                        "Connection: close" CRLF CRLF) - 1
+                                                 + dus->check_uri.len + uscf->host.len);
+        ctx->response = ngx_create_temp_buf(pool, NGX_DYNAMIC_UPSTREAM_CHECK_BUFFER_SIZE);
+
+        if (ctx->request == NULL || ctx->response == NULL) {
+            ngx_destroy_pool(pool);
+            return NULL;
+        }
+
+        ctx->request->last = ngx_sprintf(ctx->request->last,
+                                         "GET %V HTTP/1.0" CRLF "Host: %V" CRLF "Connection: close" CRLF CRLF,
+                                         &dus->check_uri, &uscf->host);
+    }
+
+    return ctx;
+}
+
+
+static void
+ngx_dynamic_upstream_check_start(ngx_dynamic_upstream_check_ctx_t *ctx)
+{
+    ngx_int_t                         rc;
+    ngx_connection_t                 *c;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(ctx->uscf, ngx_dynamic_upstream_module);
+
+    rc = ngx_event_connect_peer(&ctx->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_dynamic_upstream_check_finalize(ctx, 0);
+        return;
+    }
+
+    c = ctx->pc.connection;
+
+    c->data = ctx;
+    c->pool = ctx->pool;
+    c->log = ngx_cycle->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->read->handler = ngx_dynamic_upstream_check_read_handler;
+    c->write->handler = ngx_dynamic_upstream_check_write_handler;
+
+    ngx_add_timer(c->write, dus->check_timeout);
+
+    if (rc == NGX_OK) {
+        ngx_dynamic_upstream_check_write_handler(c->write);
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_check_write_handler(ngx_event_t *wev)
+{
+    ssize_t                            n;
+    ngx_connection_t                  *c;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+    ngx_dynamic_upstream_check_ctx_t  *ctx;
+
+    c = wev->data;
+    ctx = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "check of server %V timed out", &ctx->name);
+        ngx_dynamic_upstream_check_finalize(ctx, 0);
+        return;
+    }
+
+    if (ngx_dynamic_upstream_check_connected(c) != NGX_OK) {
+        ngx_dynamic_upstream_check_finalize(ctx, 0);
+        return;
+    }
+
+    /* connected */
+    if (ctx->request == NULL) {
+        ngx_dynamic_upstream_check_finalize(ctx, 1);
+        return;
+    }
+
+    while (ctx->request->pos < ctx->request->last) {
+        n = c->send(c, ctx->request->pos, ctx->request->last - ctx->request->pos);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_dynamic_upstream_check_finalize(ctx, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_dynamic_upstream_check_finalize(ctx, 0);
+            return;
+        }
+
+        ctx->request->pos += n;
+    }
+
+    /* the request is sent, the response is waited */
+    dus = ngx_http_conf_upstream_srv_conf(ctx->uscf, ngx_dynamic_upstream_module);
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    wev->handler = ngx_dynamic_upstream_check_dummy_handler;
+
+    if (!c->read->timer_set) {
+        ngx_add_timer(c->read, dus->check_timeout);
+    }
+
+    if (c->read->ready) {
+        ngx_dynamic_upstream_check_read_handler(c->read);
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_check_read_handler(ngx_event_t *rev)
+{
+    ssize_t                            n;
+    ngx_int_t                          rc;
+    ngx_buf_t                         *b;
+    ngx_connection_t                  *c;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+    ngx_dynamic_upstream_check_ctx_t  *ctx;
+
+    c = rev->data;
+    ctx = c->data;
+    b = ctx->response;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "check of server %V timed out", &ctx->name);
+        ngx_dynamic_upstream_check_finalize(ctx, 0);
+        return;
+    }
+
+    /* the request is not sent yet */
+    if (b == NULL || ctx->request->pos < ctx->request->last) {
+        return;
+    }
+
+    dus = ngx_http_conf_upstream_srv_conf(ctx->uscf, ngx_dynamic_upstream_module);
+
+    for ( ;; ) {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_dynamic_upstream_check_finalize(ctx, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_dynamic_upstream_check_finalize(ctx, 0);
+            return;
+        }
+
+        b->last += n;
+
+        rc = ngx_dynamic_upstream_check_status(dus, b);
+
+        if (rc != NGX_AGAIN) {
+            if (rc == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "check of server %V got unexpected response \"%*s\"",
+                              &ctx->name, (size_t) (b->last - b->pos), b->pos);
+            }
+
+            ngx_dynamic_upstream_check_finalize(ctx, rc == NGX_OK);
+            return;
+        }
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_check_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "dynamic upstream check dummy handler");
+}
+
+
+/* returns the result of the non-blocking connect() */
+ngx_int_t
+ngx_dynamic_upstream_check_connected(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        ngx_log_error(NGX_LOG_ERR, c->log, err, "connect() failed in check");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* returns NGX_AGAIN until the status code is received */
+static ngx_int_t
+ngx_dynamic_upstream_check_status(ngx_dynamic_upstream_srv_conf_t *dus, ngx_buf_t *b)
+{
+    ngx_int_t  status;
+
+    if (b->last - b->pos < NGX_DYNAMIC_UPSTREAM_CHECK_STATUS_LINE_LEN) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_strncmp(b->pos, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0 || b->pos[8] != ' ') {
+        return NGX_ERROR;
+    }
+
+    status = ngx_atoi(&b->pos[9], 3);
+    if (status == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    /* 2xx and 3xx are healthy without the status */
+    if (dus->check_status) {
+        return status == dus->check_status ? NGX_OK : NGX_ERROR;
+    }
+
+    return (status >= 200 && status < 400) ? NGX_OK : NGX_ERROR;
+}
+
+
+/* records the result in the peer state and flips down with the rise and fall thresholds */
+static void
+ngx_dynamic_upstream_check_finalize(ngx_dynamic_upstream_check_ctx_t *ctx, ngx_uint_t ok)
+{
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    if (ctx->pc.connection) {
+        ngx_close_connection(ctx->pc.connection);
+        ctx->pc.connection = NULL;
+    }
+
+    dus = ngx_http_conf_upstream_srv_conf(ctx->uscf, ngx_dynamic_upstream_module);
+    peers = ctx->uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    ps = ngx_dynamic_upstream_state_lookup(dus->sh, ctx->peer);
+
+    /* the peer may be removed or replaced while checking */
+    if (ps == NULL
+        || ps->peer->name.len != ctx->name.len
+        || ngx_strncmp(ps->peer->name.data, ctx->name.data, ctx->name.len) != 0)
+    {
+        goto done;
+    }
+
+    peer = ps->peer;
+
+    ps->checks++;
+
+    if (ok) {
+        ps->check_fails = 0;
+        ps->check_oks++;
+
+        if (ps->check_down && ps->check_oks >= (ngx_uint_t) dus->check_rise) {
+            ps->check_down = 0;
+            peer->down = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "check upped server %V", &ctx->name);
+        }
+
+    } else {
+        ps->check_oks = 0;
+        ps->check_fails++;
+
+        /* the servers down by the API are left as they are */
+        if (!ps->check_down && !peer->down && ps->check_fails >= (ngx_uint_t) dus->check_fall) {
+            ps->check_down = 1;
+            peer->down = 1;
+
+            ngx_dynamic_upstream_keepalive_evict_locked(dus->sh, peer);
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "check downed server %V", &ctx->name);
+        }
+    }
+
+ done:
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_destroy_pool(ctx->pool);
+}
@@ -0,0 +1,15 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_CHECK_H
+#define NGX_DYNAMIC_UPSTREAM_CHECK_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+void ngx_dynamic_upstream_check_tick(ngx_http_upstream_srv_conf_t *uscf);
+ngx_int_t ngx_dynamic_upstream_check_connected(ngx_connection_t *c);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_CHECK_H */
@@ -0,0 +1,136 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_state.h"
+#include "ngx_dynamic_upstream_drain.h"
+#include "ngx_dynamic_upstream_keepalive.h"
+
+
+/* the down peer is not selected any more and is removed by the tick */
+void
+ngx_dynamic_upstream_drain_start(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_peer_state_t *ps,
+                                 ngx_msec_t timeout)
+{
+    if (ps->drain == 0) {
+        sh->drain++;
+    }
+
+    ps->drain = 1;
+    ps->drain_deadline = timeout ? ngx_current_msec + timeout : 0;
+
+    /* the idle connections are not needed for the requests in flight */
+    if (!ps->peer->down) {
+        ngx_dynamic_upstream_keepalive_evict_locked(sh, ps->peer);
+    }
+
+    ps->peer->down = 1;
+}
+
+
+void
+ngx_dynamic_upstream_drain_cancel(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_peer_state_t *ps)
+{
+    if (ps->drain == 0) {
+        return;
+    }
+
+    ps->drain = 0;
+    ps->drain_deadline = 0;
+
+    sh->drain--;
+}
+
+
+/*
+ * removes the draining peers without the connections or with the expired timeout.
+ * the peer with the connections is unlinked at the timeout and released when they are closed,
+ * the balancers still decrement its conns at the end of the requests.
+ * the last primary peer is kept down since the primary peers can not be empty.
+ */
+void
+ngx_dynamic_upstream_drain_tick(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_upstream_rr_peer_t        *peer, *prev, *next, **pp;
+    ngx_http_upstream_rr_peers_t       *peers, *list;
+    ngx_dynamic_upstream_shctx_t       *sh;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    sh = dus->sh;
+
+    /* unlocked check */
+    if (sh->drain == 0 && sh->retired == NULL) {
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    if (!ngx_shmtx_trylock(&shpool->mutex)) {
+        return;
+    }
+
+    peers = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    for (pp = &sh->retired; *pp; /* void */) {
+        peer = *pp;
+
+        if (peer->conns) {
+            pp = &peer->next;
+            continue;
+        }
+
+        *pp = peer->next;
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "released drained server %V", &peer->name);
+
+        ngx_dynamic_upstream_op_release_peer(shpool, peer);
+    }
+
+    for (list = peers; list && sh->drain; list = list->next) {
+        prev = NULL;
+
+        for (peer = list->peer; peer; peer = next) {
+            next = peer->next;
+
+            ps = ngx_dynamic_upstream_state_lookup(sh, peer);
+
+            if (ps == NULL
+                || ps->drain == 0
+                || (list == peers && peers->number < 2)
+                || (peer->conns
+                    && (ps->drain_deadline == 0
+                        || (ngx_msec_int_t) (ngx_current_msec - ps->drain_deadline) < 0)))
+            {
+                prev = peer;
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "drained %sserver %V with %ui connections",
+                          list != peers ? "backup " : "", &peer->name, peer->conns);
+
+            if (peer->conns == 0) {
+                ngx_dynamic_upstream_op_free_peer(shpool, sh, peers, list, prev, peer);
+                continue;
+            }
+
+            ngx_dynamic_upstream_op_unlink_peer(shpool, sh, peers, list, prev, peer);
+
+            peer->down = 1;
+            peer->next = sh->retired;
+            sh->retired = peer;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+    ngx_shmtx_unlock(&shpool->mutex);
+}
@@ -0,0 +1,17 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_DRAIN_H
+#define NGX_DYNAMIC_UPSTREAM_DRAIN_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+void ngx_dynamic_upstream_drain_start(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_peer_state_t *ps,
+                                      ngx_msec_t timeout);
+void ngx_dynamic_upstream_drain_cancel(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_peer_state_t *ps);
+void ngx_dynamic_upstream_drain_tick(ngx_http_upstream_srv_conf_t *uscf);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_DRAIN_H */
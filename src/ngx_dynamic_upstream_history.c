@@ -0,0 +1,168 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_history.h"
+#include "ngx_dynamic_upstream_state.h"
+
+
+static u_char *
+ngx_dynamic_upstream_history_render_params(u_char *p, ngx_dynamic_upstream_params_t *params);
+
+
+/* the parameters given by the API, not the ones adjusted */
+void
+ngx_dynamic_upstream_history_params_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer,
+                                           ngx_dynamic_upstream_params_t *params)
+{
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    ps = ngx_dynamic_upstream_state_lookup(sh, peer);
+
+    params->weight = ps ? ps->weight : peer->weight;
+    params->max_fails = peer->max_fails;
+    params->fail_timeout = ps ? ps->fail_timeout : peer->fail_timeout;
+    params->down = peer->down;
+}
+
+
+/*
+ * records the change of the peer by op under the locks of the upstream,
+ * the generation is the one committed by op.
+ */
+void
+ngx_dynamic_upstream_history_record_locked(ngx_http_request_t *r, ngx_dynamic_upstream_shctx_t *sh,
+                                           ngx_int_t op, ngx_uint_t backup, ngx_http_upstream_rr_peer_t *peer,
+                                           ngx_dynamic_upstream_params_t *old)
+{
+    ngx_dynamic_upstream_history_t  *h;
+
+    if (sh == NULL) {
+        return;
+    }
+
+    h = &sh->history[sh->history_n++ % NGX_DYNAMIC_UPSTREAM_HISTORY];
+
+    h->time = ngx_time();
+    h->generation = sh->generation + 1;
+    h->op = op;
+    h->backup = backup;
+
+    if (op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+        ngx_dynamic_upstream_history_params_locked(sh, peer, &h->old);
+
+    } else {
+        if (old != NULL) {
+            h->old = *old;
+        }
+
+        ngx_dynamic_upstream_history_params_locked(sh, peer, &h->new);
+    }
+
+    h->server_len = ngx_min(peer->name.len, NGX_DYNAMIC_UPSTREAM_HISTORY_SERVER);
+    ngx_memcpy(h->server, peer->name.data, h->server_len);
+
+    h->addr_len = ngx_min(r->connection->addr_text.len, NGX_INET6_ADDRSTRLEN);
+    ngx_memcpy(h->addr, r->connection->addr_text.data, h->addr_len);
+}
+
+
+/*
+ * the last n changes from the oldest, a change is in a line such as
+ * "1700000000 generation=3 client=127.0.0.1 param server 127.0.0.1:6001 weight=1 ... -> weight=2 ...;"
+ */
+ngx_buf_t *
+ngx_dynamic_upstream_history_render(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t n)
+{
+    size_t                            size;
+    ngx_uint_t                        i, last;
+    ngx_buf_t                        *b;
+    ngx_str_t                         server, addr;
+    ngx_slab_pool_t                  *shpool;
+    ngx_dynamic_upstream_history_t   *history, *h;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    history = ngx_palloc(r->pool, sizeof(ngx_dynamic_upstream_history_t) * NGX_DYNAMIC_UPSTREAM_HISTORY);
+    if (history == NULL) {
+        return NULL;
+    }
+
+    last = 0;
+
+    /* the ring is copied at once not to render under the lock */
+    if (dus->sh != NULL) {
+        ngx_shmtx_lock(&shpool->mutex);
+
+        last = dus->sh->history_n;
+        ngx_memcpy(history, dus->sh->history, sizeof(ngx_dynamic_upstream_history_t) * NGX_DYNAMIC_UPSTREAM_HISTORY);
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    n = ngx_min(n, ngx_min(last, NGX_DYNAMIC_UPSTREAM_HISTORY));
+
+    size = n * (sizeof(" generation= client= remove server  -> backup;\n") - 1
+                + NGX_TIME_T_LEN + NGX_INT_T_LEN + NGX_INET6_ADDRSTRLEN + NGX_DYNAMIC_UPSTREAM_HISTORY_SERVER
+                + 2 * (sizeof("weight= max_fails= fail_timeout= down") - 1 + 3 * NGX_INT_T_LEN));
+
+    b = ngx_create_temp_buf(r->pool, ngx_max(size, 1));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    for (i = last - n; i != last; i++) {
+        h = &history[i % NGX_DYNAMIC_UPSTREAM_HISTORY];
+
+        server.data = h->server;
+        server.len = h->server_len;
+        addr.data = h->addr;
+        addr.len = h->addr_len;
+
+        b->last = ngx_sprintf(b->last, "%T generation=%ui client=%V %s server %V ",
+                              h->time, h->generation, &addr,
+                              h->op == NGX_DYNAMIC_UPSTEAM_OP_ADD ? "add"
+                              : h->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE ? "remove" : "param",
+                              &server);
+
+        switch (h->op) {
+        case NGX_DYNAMIC_UPSTEAM_OP_ADD:
+            b->last = ngx_dynamic_upstream_history_render_params(b->last, &h->new);
+            break;
+        case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
+            b->last = ngx_dynamic_upstream_history_render_params(b->last, &h->old);
+            break;
+        default:
+            b->last = ngx_dynamic_upstream_history_render_params(b->last, &h->old);
+            b->last = ngx_cpymem(b->last, " -> ", sizeof(" -> ") - 1);
+            b->last = ngx_dynamic_upstream_history_render_params(b->last, &h->new);
+            break;
+        }
+
+        if (h->backup) {
+            b->last = ngx_cpymem(b->last, " backup", sizeof(" backup") - 1);
+        }
+
+        *b->last++ = ';';
+        *b->last++ = '\n';
+    }
+
+    return b;
+}
+
+
+static u_char *
+ngx_dynamic_upstream_history_render_params(u_char *p, ngx_dynamic_upstream_params_t *params)
+{
+    p = ngx_sprintf(p, "weight=%i max_fails=%ui fail_timeout=%T",
+                    params->weight, params->max_fails, params->fail_timeout);
+
+    if (params->down) {
+        p = ngx_cpymem(p, " down", sizeof(" down") - 1);
+    }
+
+    return p;
+}
@@ -0,0 +1,20 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_HISTORY_H
+#define NGX_DYNAMIC_UPSTREAM_HISTORY_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+void ngx_dynamic_upstream_history_params_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer,
+                                                ngx_dynamic_upstream_params_t *params);
+void ngx_dynamic_upstream_history_record_locked(ngx_http_request_t *r, ngx_dynamic_upstream_shctx_t *sh,
+                                                ngx_int_t op, ngx_uint_t backup, ngx_http_upstream_rr_peer_t *peer,
+                                                ngx_dynamic_upstream_params_t *old);
+ngx_buf_t *ngx_dynamic_upstream_history_render(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf,
+                                               ngx_uint_t n);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_HISTORY_H */
@@ -0,0 +1,586 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_check.h"
+#include "ngx_dynamic_upstream_keepalive.h"
+
+
+#define NGX_DYNAMIC_UPSTREAM_WARM_TIMEOUT 5000
+
+
+/*
+ * the layouts of the configuration of ngx_http_upstream_keepalive_module by the version,
+ * the cache is not operated for the unknown versions.
+ */
+#if (nginx_version < 1015003)
+#define NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT 1
+#elif (nginx_version < 1019010)
+#define NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT 2     /* keepalive_requests and keepalive_timeout */
+#elif (nginx_version < 1029000)
+#define NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT 3     /* keepalive_time */
+#endif
+
+
+/*
+ * the configuration and the cache item of ngx_http_upstream_keepalive_module,
+ * which are not exported. these must be same as ngx_http_upstream_keepalive_module.c.
+ * max_cached is the first in all the versions.
+ */
+typedef struct {
+    ngx_uint_t                         max_cached;
+#if (NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT >= 2)
+    ngx_uint_t                         requests;
+#endif
+#if (NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT >= 3)
+    ngx_msec_t                         time;
+#endif
+#if (NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT >= 2)
+    ngx_msec_t                         timeout;
+#endif
+
+    ngx_queue_t                        cache;
+    ngx_queue_t                        free;
+
+    ngx_http_upstream_init_pt          original_init_upstream;
+    ngx_http_upstream_init_peer_pt     original_init_peer;
+} ngx_dynamic_upstream_keepalive_srv_conf_t;
+
+
+typedef struct {
+    ngx_dynamic_upstream_keepalive_srv_conf_t  *conf;
+
+    ngx_queue_t                                 queue;
+    ngx_connection_t                           *connection;
+
+    socklen_t                                   socklen;
+    u_char                                      sockaddr[NGX_SOCKADDRLEN];
+} ngx_dynamic_upstream_keepalive_cache_t;
+
+
+/* the connection being warmed */
+typedef struct {
+    ngx_dynamic_upstream_keepalive_srv_conf_t  *conf;
+    struct sockaddr                            *sockaddr;
+    socklen_t                                   socklen;
+} ngx_dynamic_upstream_keepalive_warm_t;
+
+
+/* records the address of the added peer for the workers */
+void
+ngx_dynamic_upstream_keepalive_warm_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer,
+                                           ngx_uint_t n)
+{
+    ngx_dynamic_upstream_warmed_t  *warmed;
+
+    if (peer->socklen > NGX_SOCKADDRLEN) {
+        return;
+    }
+
+    warmed = &sh->warmed[sh->warm_gen % NGX_DYNAMIC_UPSTREAM_WARMED];
+
+    warmed->socklen = peer->socklen;
+    ngx_memcpy(warmed->sockaddr, peer->sockaddr, peer->socklen);
+    warmed->n = n;
+
+    sh->warm_gen++;
+}
+
+
+static ngx_dynamic_upstream_keepalive_srv_conf_t *
+ngx_dynamic_upstream_keepalive_conf(ngx_http_upstream_srv_conf_t *uscf);
+static ngx_uint_t
+ngx_dynamic_upstream_keepalive_is_evicted(ngx_dynamic_upstream_shctx_t *sh, ngx_uint_t from, ngx_uint_t to,
+                                          ngx_dynamic_upstream_keepalive_cache_t *item);
+static ngx_uint_t
+ngx_dynamic_upstream_keepalive_purge(ngx_dynamic_upstream_keepalive_srv_conf_t *kcf,
+                                     ngx_dynamic_upstream_shctx_t *sh, ngx_uint_t from, ngx_uint_t to);
+static void
+ngx_dynamic_upstream_keepalive_close(ngx_connection_t *c);
+static void
+ngx_dynamic_upstream_keepalive_warm(ngx_dynamic_upstream_keepalive_srv_conf_t *kcf,
+                                    ngx_dynamic_upstream_warmed_t *warmed);
+static void
+ngx_dynamic_upstream_keepalive_connect_handler(ngx_event_t *wev);
+static ngx_int_t
+ngx_dynamic_upstream_keepalive_park(ngx_dynamic_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c,
+                                    struct sockaddr *sockaddr, socklen_t socklen);
+static void
+ngx_dynamic_upstream_keepalive_close_handler(ngx_event_t *ev);
+static void
+ngx_dynamic_upstream_keepalive_dummy_handler(ngx_event_t *ev);
+
+
+/* the keepalive module is looked up by the name not to require it in the build */
+static ngx_module_t  *ngx_dynamic_upstream_keepalive_module;
+
+
+void
+ngx_dynamic_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    ngx_dynamic_upstream_keepalive_module = NULL;
+
+    for (i = 0; cycle->modules[i]; i++) {
+        if (ngx_strcmp(cycle->modules[i]->name, "ngx_http_upstream_keepalive_module") == 0) {
+            ngx_dynamic_upstream_keepalive_module = cycle->modules[i];
+            break;
+        }
+    }
+
+    /* a respawned worker has no connections to purge or to warm */
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL || uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+        if (dus->sh == NULL) {
+            continue;
+        }
+
+#if !(NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT)
+        if (ngx_worker == 0 && ngx_dynamic_upstream_keepalive_enabled(uscf)) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "the keepalive connections of upstream \"%V\" are not purged or warmed "
+                          "with this version of nginx", &uscf->host);
+        }
+#endif
+
+        dus->evict_gen = dus->sh->evict_gen;
+        dus->warm_gen = dus->sh->warm_gen;
+    }
+}
+
+
+/* records the address of the removed or downed peer for the workers */
+void
+ngx_dynamic_upstream_keepalive_evict_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_dynamic_upstream_evicted_t  *evicted;
+
+    if (peer->socklen > NGX_SOCKADDRLEN) {
+        return;
+    }
+
+    evicted = &sh->evicted[sh->evict_gen % NGX_DYNAMIC_UPSTREAM_EVICTED];
+
+    evicted->socklen = peer->socklen;
+    ngx_memcpy(evicted->sockaddr, peer->sockaddr, peer->socklen);
+
+    sh->evict_gen++;
+}
+
+
+/* the keepalive directive is in the upstream, whatever the layout is */
+ngx_uint_t
+ngx_dynamic_upstream_keepalive_enabled(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t  *max_cached;
+
+    if (ngx_dynamic_upstream_keepalive_module == NULL) {
+        return 0;
+    }
+
+    max_cached = uscf->srv_conf[ngx_dynamic_upstream_keepalive_module->ctx_index];
+
+    return max_cached != NULL && *max_cached != 0;
+}
+
+
+/* NULL without the keepalive directive or with the unknown layout */
+static ngx_dynamic_upstream_keepalive_srv_conf_t *
+ngx_dynamic_upstream_keepalive_conf(ngx_http_upstream_srv_conf_t *uscf)
+{
+#if (NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT)
+    ngx_dynamic_upstream_keepalive_srv_conf_t  *kcf;
+
+    if (ngx_dynamic_upstream_keepalive_module == NULL) {
+        return NULL;
+    }
+
+    kcf = uscf->srv_conf[ngx_dynamic_upstream_keepalive_module->ctx_index];
+
+    /* the cache is initialized only with the keepalive directive */
+    if (kcf == NULL || kcf->original_init_upstream == NULL) {
+        return NULL;
+    }
+
+    return kcf;
+#else
+    return NULL;
+#endif
+}
+
+
+/* the keepalive module calls the balancer through this, NULL without the keepalive directive or with the unknown layout */
+ngx_http_upstream_init_peer_pt *
+ngx_dynamic_upstream_keepalive_init_peer(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_dynamic_upstream_keepalive_srv_conf_t  *kcf;
+
+    kcf = ngx_dynamic_upstream_keepalive_conf(uscf);
+    if (kcf == NULL) {
+        return NULL;
+    }
+
+    return &kcf->original_init_peer;
+}
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_keepalive_is_evicted(ngx_dynamic_upstream_shctx_t *sh, ngx_uint_t from, ngx_uint_t to,
+                                          ngx_dynamic_upstream_keepalive_cache_t *item)
+{
+    ngx_uint_t                       g;
+    ngx_dynamic_upstream_evicted_t  *evicted;
+
+    /* the addresses are lost when the ring is overrun */
+    if (to - from > NGX_DYNAMIC_UPSTREAM_EVICTED) {
+        return 1;
+    }
+
+    for (g = from; g != to; g++) {
+        evicted = &sh->evicted[g % NGX_DYNAMIC_UPSTREAM_EVICTED];
+
+        if (ngx_cmp_sockaddr((struct sockaddr *) evicted->sockaddr, evicted->socklen,
+                             (struct sockaddr *) item->sockaddr, item->socklen, 1)
+            == NGX_OK)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* closes the cached connections to the addresses evicted in the generations from "from" to "to" */
+static ngx_uint_t
+ngx_dynamic_upstream_keepalive_purge(ngx_dynamic_upstream_keepalive_srv_conf_t *kcf,
+                                     ngx_dynamic_upstream_shctx_t *sh, ngx_uint_t from, ngx_uint_t to)
+{
+    ngx_uint_t                               n;
+    ngx_queue_t                             *q, *next;
+    ngx_dynamic_upstream_keepalive_cache_t  *item;
+
+    n = 0;
+
+    for (q = ngx_queue_head(&kcf->cache); q != ngx_queue_sentinel(&kcf->cache); q = next) {
+        next = ngx_queue_next(q);
+
+        item = ngx_queue_data(q, ngx_dynamic_upstream_keepalive_cache_t, queue);
+
+        if (!ngx_dynamic_upstream_keepalive_is_evicted(sh, from, to, item)) {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&kcf->free, q);
+
+        ngx_dynamic_upstream_keepalive_close(item->connection);
+
+        n++;
+    }
+
+    return n;
+}
+
+
+/* same as ngx_http_upstream_keepalive_close() */
+static void
+ngx_dynamic_upstream_keepalive_close(ngx_connection_t *c)
+{
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_dynamic_upstream_keepalive_close;
+            return;
+        }
+    }
+
+#endif
+
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+
+
+/* opens the connections to the address and parks them in the cache of the known layout */
+static void
+ngx_dynamic_upstream_keepalive_warm(ngx_dynamic_upstream_keepalive_srv_conf_t *kcf,
+                                    ngx_dynamic_upstream_warmed_t *warmed)
+{
+    ngx_int_t                               rc;
+    ngx_str_t                               name;
+    ngx_uint_t                              i;
+    ngx_pool_t                             *pool;
+    ngx_connection_t                       *c;
+    ngx_peer_connection_t                   pc;
+    ngx_dynamic_upstream_keepalive_warm_t  *warm;
+
+    ngx_str_set(&name, "warm");
+
+    for (i = 0; i < warmed->n && !ngx_queue_empty(&kcf->free); i++) {
+
+        pool = ngx_create_pool(128, ngx_cycle->log);
+        if (pool == NULL) {
+            return;
+        }
+
+        warm = ngx_palloc(pool, sizeof(ngx_dynamic_upstream_keepalive_warm_t));
+        if (warm == NULL) {
+            ngx_destroy_pool(pool);
+            return;
+        }
+
+        warm->conf = kcf;
+        warm->socklen = warmed->socklen;
+
+        warm->sockaddr = ngx_palloc(pool, warmed->socklen);
+        if (warm->sockaddr == NULL) {
+            ngx_destroy_pool(pool);
+            return;
+        }
+        ngx_memcpy(warm->sockaddr, warmed->sockaddr, warmed->socklen);
+
+        ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+        pc.sockaddr = warm->sockaddr;
+
+        pc.socklen = warmed->socklen;
+        pc.name = &name;
+        pc.get = ngx_event_get_peer;
+        pc.log = ngx_cycle->log;
+        pc.log_error = NGX_ERROR_ERR;
+
+        rc = ngx_event_connect_peer(&pc);
+
+        if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+            if (pc.connection) {
+                ngx_close_connection(pc.connection);
+            }
+
+            ngx_destroy_pool(pool);
+            return;
+        }
+
+        c = pc.connection;
+
+        c->pool = pool;
+        c->data = warm;
+        c->log = ngx_cycle->log;
+        c->read->log = c->log;
+        c->write->log = c->log;
+
+        c->read->handler = ngx_dynamic_upstream_keepalive_dummy_handler;
+        c->write->handler = ngx_dynamic_upstream_keepalive_connect_handler;
+
+        if (rc == NGX_OK) {
+            ngx_dynamic_upstream_keepalive_connect_handler(c->write);
+            continue;
+        }
+
+        ngx_add_timer(c->write, NGX_DYNAMIC_UPSTREAM_WARM_TIMEOUT);
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_keepalive_connect_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                       *c;
+    ngx_dynamic_upstream_keepalive_warm_t  *warm;
+
+    c = wev->data;
+    warm = c->data;
+
+    if (wev->timedout
+        || ngx_dynamic_upstream_check_connected(c) != NGX_OK
+        || ngx_dynamic_upstream_keepalive_park(warm->conf, c, warm->sockaddr, warm->socklen) != NGX_OK)
+    {
+        ngx_dynamic_upstream_keepalive_close(c);
+    }
+}
+
+
+/* same as ngx_http_upstream_free_keepalive_peer() except the cached connections are not replaced */
+static ngx_int_t
+ngx_dynamic_upstream_keepalive_park(ngx_dynamic_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c,
+                                    struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_queue_t                             *q;
+    ngx_dynamic_upstream_keepalive_cache_t  *item;
+
+    if (ngx_queue_empty(&kcf->free) || socklen > NGX_SOCKADDRLEN) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_dynamic_upstream_keepalive_cache_t, queue);
+
+    ngx_queue_insert_head(&kcf->cache, q);
+
+    item->connection = c;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+#if (NGX_DYNAMIC_UPSTREAM_KEEPALIVE_LAYOUT >= 2)
+    /* closed by keepalive_timeout as the connections cached by the keepalive module */
+    ngx_add_timer(c->read, kcf->timeout);
+#endif
+
+    c->write->handler = ngx_dynamic_upstream_keepalive_dummy_handler;
+    c->read->handler = ngx_dynamic_upstream_keepalive_close_handler;
+
+    c->data = item;
+    c->idle = 1;
+    c->pool->log = ngx_cycle->log;
+
+    item->socklen = socklen;
+    ngx_memcpy(item->sockaddr, sockaddr, socklen);
+
+    if (c->read->ready) {
+        ngx_dynamic_upstream_keepalive_close_handler(c->read);
+    }
+
+    return NGX_OK;
+}
+
+
+/* same as ngx_http_upstream_keepalive_close_handler() */
+static void
+ngx_dynamic_upstream_keepalive_close_handler(ngx_event_t *ev)
+{
+    int                                         n;
+    char                                        buf[1];
+    ngx_connection_t                           *c;
+    ngx_dynamic_upstream_keepalive_cache_t     *item;
+    ngx_dynamic_upstream_keepalive_srv_conf_t  *conf;
+
+    c = ev->data;
+
+    if (c->close || ev->timedout) {
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+ close:
+
+    item = c->data;
+    conf = item->conf;
+
+    ngx_dynamic_upstream_keepalive_close(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&conf->free, &item->queue);
+}
+
+
+static void
+ngx_dynamic_upstream_keepalive_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "dynamic upstream keepalive dummy handler");
+}
+
+
+/*
+ * every worker closes its own cached connections to the evicted peers
+ * and opens the connections to the added peers.
+ */
+void
+ngx_dynamic_upstream_keepalive_tick(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                                  n, gen;
+    ngx_http_upstream_rr_peers_t               *peers;
+    ngx_dynamic_upstream_warmed_t               warmed;
+    ngx_dynamic_upstream_srv_conf_t            *dus;
+    ngx_dynamic_upstream_keepalive_srv_conf_t  *kcf;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    /* unlocked check */
+    if (dus->sh->evict_gen == dus->evict_gen && dus->sh->warm_gen == dus->warm_gen) {
+        return;
+    }
+
+    kcf = ngx_dynamic_upstream_keepalive_conf(uscf);
+
+    if (kcf == NULL) {
+        dus->evict_gen = dus->sh->evict_gen;
+        dus->warm_gen = dus->sh->warm_gen;
+        return;
+    }
+
+    peers = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    gen = dus->sh->evict_gen;
+    n = ngx_dynamic_upstream_keepalive_purge(kcf, dus->sh, dus->evict_gen, gen);
+    dus->evict_gen = gen;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (n) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "closed %ui keepalive connections to evicted servers in upstream \"%V\"",
+                      n, &uscf->host);
+    }
+
+    /* the addresses overrun in the ring are not warmed */
+    if (dus->sh->warm_gen - dus->warm_gen > NGX_DYNAMIC_UPSTREAM_WARMED) {
+        dus->warm_gen = dus->sh->warm_gen - NGX_DYNAMIC_UPSTREAM_WARMED;
+    }
+
+    while (dus->warm_gen != dus->sh->warm_gen) {
+
+        /* the connections are opened without the lock */
+        ngx_http_upstream_rr_peers_rlock(peers);
+        warmed = dus->sh->warmed[dus->warm_gen % NGX_DYNAMIC_UPSTREAM_WARMED];
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        dus->warm_gen++;
+
+        ngx_dynamic_upstream_keepalive_warm(kcf, &warmed);
+    }
+}
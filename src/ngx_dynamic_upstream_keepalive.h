@@ -0,0 +1,20 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_KEEPALIVE_H
+#define NGX_DYNAMIC_UPSTREAM_KEEPALIVE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+void ngx_dynamic_upstream_keepalive_init_process(ngx_cycle_t *cycle);
+void ngx_dynamic_upstream_keepalive_evict_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer);
+void ngx_dynamic_upstream_keepalive_warm_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer,
+                                               ngx_uint_t n);
+void ngx_dynamic_upstream_keepalive_tick(ngx_http_upstream_srv_conf_t *uscf);
+ngx_uint_t ngx_dynamic_upstream_keepalive_enabled(ngx_http_upstream_srv_conf_t *uscf);
+ngx_http_upstream_init_peer_pt *ngx_dynamic_upstream_keepalive_init_peer(ngx_http_upstream_srv_conf_t *uscf);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_KEEPALIVE_H */
@@ -4,17 +4,78 @@
 #include <ngx_http.h>
 
 #include "ngx_dynamic_upstream_op.h"
-#include <stdio.h>
+#include "ngx_dynamic_upstream_persist.h"
+#include "ngx_dynamic_upstream_state.h"
+#include "ngx_dynamic_upstream_weight.h"
+#include "ngx_dynamic_upstream_drain.h"
+#include "ngx_dynamic_upstream_check.h"
+#include "ngx_dynamic_upstream_backoff.h"
+#include "ngx_dynamic_upstream_keepalive.h"
+#include "ngx_dynamic_upstream_chash.h"
+#include "ngx_dynamic_upstream_balancer.h"
+#include "ngx_dynamic_upstream_spare.h"
+#include "ngx_dynamic_upstream_replicate.h"
+#include "ngx_dynamic_upstream_queue.h"
+#include "ngx_dynamic_upstream_history.h"
+#if (NGX_DYNAMIC_UPSTREAM_STREAM)
+#include "ngx_dynamic_upstream_stream.h"
+#endif
+
+
+#define NGX_DYNAMIC_UPSTREAM_TICK 1000
 
 
 static ngx_http_upstream_srv_conf_t *
 ngx_dynamic_upstream_get_zone(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op);
 static ngx_int_t
-ngx_dynamic_upstream_create_response_buf(ngx_http_upstream_rr_peers_t *peers, ngx_buf_t *b, size_t size, ngx_int_t verbose);
+ngx_dynamic_upstream_create_response_buf(ngx_http_upstream_srv_conf_t *uscf, ngx_buf_t *b, size_t size,
+                                         ngx_dynamic_upstream_op_t *op);
+static ngx_uint_t
+ngx_dynamic_upstream_listed(ngx_dynamic_upstream_op_t *op, ngx_http_upstream_rr_peer_t *peer, ngx_uint_t backup);
+static ngx_chain_t *
+ngx_dynamic_upstream_export(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t generation);
 static ngx_int_t
 ngx_dynamic_upstream_handler(ngx_http_request_t *r);
+static void
+ngx_dynamic_upstream_body_handler(ngx_http_request_t *r);
+static ngx_int_t
+ngx_dynamic_upstream_process(ngx_http_request_t *r);
+static ngx_int_t
+ngx_dynamic_upstream_apply(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                           ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t *generation);
+static ngx_int_t
+ngx_dynamic_upstream_apply_zones(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op, ngx_buf_t **bp);
+static ngx_uint_t
+ngx_dynamic_upstream_match_zone(ngx_str_t *upstreams, ngx_str_t *name);
+static ngx_int_t
+ngx_dynamic_upstream_if_match(ngx_http_request_t *r, ngx_uint_t generation);
+static ngx_int_t
+ngx_dynamic_upstream_set_etag(ngx_http_request_t *r, ngx_uint_t generation);
 static char *
 ngx_dynamic_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_dynamic_upstream_latency_weight(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_dynamic_upstream_load_header(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_dynamic_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *
+ngx_dynamic_upstream_backoff(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void *
+ngx_dynamic_upstream_create_srv_conf(ngx_conf_t *cf);
+static ngx_int_t
+ngx_dynamic_upstream_preconfiguration(ngx_conf_t *cf);
+static ngx_int_t
+ngx_dynamic_upstream_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t
+ngx_dynamic_upstream_init_module(ngx_cycle_t *cycle);
+static ngx_int_t
+ngx_dynamic_upstream_init_process(ngx_cycle_t *cycle);
+static void
+ngx_dynamic_upstream_timer_handler(ngx_event_t *ev);
+
+
+static ngx_event_t  ngx_dynamic_upstream_timer;
 
 
 static ngx_command_t ngx_dynamic_upstream_commands[] = {
@@ -27,18 +88,108 @@ static ngx_command_t ngx_dynamic_upstream_commands[] = {
         NULL
     },
 
+    {
+        ngx_string("dynamic_upstream_stats"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        offsetof(ngx_dynamic_upstream_srv_conf_t, stats),
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_latency_weight"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+        ngx_dynamic_upstream_latency_weight,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_load_header"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+        ngx_dynamic_upstream_load_header,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_check"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+        ngx_dynamic_upstream_check,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_backoff"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+        ngx_dynamic_upstream_backoff,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_hash_points"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        offsetof(ngx_dynamic_upstream_srv_conf_t, hash_points),
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_spare"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        offsetof(ngx_dynamic_upstream_srv_conf_t, spare),
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_replicate"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+        ngx_dynamic_upstream_replicate_conf,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_queue"),
+        NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+        ngx_dynamic_upstream_queue_conf,
+        NGX_HTTP_SRV_CONF_OFFSET,
+        0,
+        NULL
+    },
+
+    {
+        ngx_string("dynamic_upstream_spare_variable"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
+        ngx_dynamic_upstream_spare_variable,
+        0,
+        0,
+        NULL
+    },
+
     ngx_null_command
 };
 
 
 static ngx_http_module_t ngx_dynamic_upstream_module_ctx = {
-    NULL,                              /* preconfiguration */
-    NULL,                              /* postconfiguration */
+    ngx_dynamic_upstream_preconfiguration, /* preconfiguration */
+    ngx_dynamic_upstream_postconfiguration, /* postconfiguration */
 
     NULL,                              /* create main configuration */
     NULL,                              /* init main configuration */
 
-    NULL,                              /* create server configuration */
+    ngx_dynamic_upstream_create_srv_conf, /* create server configuration */
     NULL,                              /* merge server configuration */
 
     NULL,                              /* create location configuration */
@@ -52,8 +203,8 @@ ngx_module_t ngx_dynamic_upstream_module = {
     ngx_dynamic_upstream_commands,    /* module directives */
     NGX_HTTP_MODULE,                  /* module type */
     NULL,                             /* init master */
-    NULL,                             /* init module */
-    NULL,                             /* init process */
+    ngx_dynamic_upstream_init_module, /* init module */
+    ngx_dynamic_upstream_init_process, /* init process */
     NULL,                             /* init thread */
     NULL,                             /* exit thread */
     NULL,                             /* exit process */
@@ -82,78 +233,240 @@ ngx_dynamic_upstream_get_zone(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *
         }
     }
 
-    return NULL;
+    /* a spare upstream is also found by the name claimed */
+    return ngx_dynamic_upstream_spare_get_zone(r, &op->upstream);
 }    
 
 
 static ngx_int_t
-ngx_dynamic_upstream_create_response_buf(ngx_http_upstream_rr_peers_t *peers, ngx_buf_t *b, size_t size, ngx_int_t verbose)
+ngx_dynamic_upstream_create_response_buf(ngx_http_upstream_srv_conf_t *uscf, ngx_buf_t *b, size_t size,
+                                         ngx_dynamic_upstream_op_t *op)
 {
-    ngx_http_upstream_rr_peer_t  *peer;
-    u_char                        namebuf[512], *last;
+    ngx_int_t                           verbose, n;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers, *list;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+    u_char                              namebuf[512], *last;
 
     last = b->last + size;
+    verbose = op->verbose;
+    n = 0;
 
-    for (peer = peers->peer; peer; peer = peer->next) {
+    peers = uscf->peer.data;
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
 
-        if (peer->name.len > 511) {
-            return NGX_ERROR;
-        }
+    /* the backup peers follow the primary peers */
+    for (list = peers; list; list = list->next) {
 
-        ngx_cpystrn(namebuf, peer->name.data, peer->name.len + 1);
+        for (peer = list->peer; peer; peer = peer->next) {
 
-        if (verbose) {
-            b->last = ngx_snprintf(b->last, last - b->last, "server %s weight=%d max_fails=%d fail_timeout=%d",
-                                   namebuf, peer->weight, peer->max_fails, peer->fail_timeout, peer->down);
+            if (!ngx_dynamic_upstream_listed(op, peer, list != peers)) {
+                continue;
+            }
 
-        } else {
-            b->last = ngx_snprintf(b->last, last - b->last, "server %s", namebuf);
+            /* the page is of the servers filtered */
+            if (n++ < op->offset) {
+                continue;
+            }
 
-        }
+            if (op->limit && n > op->offset + op->limit) {
+                return NGX_OK;
+            }
+
+            if (peer->name.len > 511) {
+                return NGX_ERROR;
+            }
+
+            ngx_cpystrn(namebuf, peer->name.data, peer->name.len + 1);
+
+            if (verbose) {
+                b->last = ngx_snprintf(b->last, last - b->last, "server %s weight=%d max_fails=%d fail_timeout=%d",
+                                       namebuf, peer->weight, peer->max_fails, peer->fail_timeout, peer->down);
+
+                ps = (dus->sh != NULL) ? ngx_dynamic_upstream_state_lookup(dus->sh, peer) : NULL;
+
+                if (ps != NULL && dus->stats) {
+                    b->last = ngx_dynamic_upstream_state_render(b->last, last, ps);
+                }
+
+                if (ps != NULL && dus->load_header.len) {
+                    b->last = ngx_snprintf(b->last, last - b->last, " load=%ui.%03ui", ps->load / 1000, ps->load % 1000);
+                }
+
+                if (ps != NULL && ps->slow_start) {
+                    b->last = ngx_snprintf(b->last, last - b->last, " slow_start=%M", ps->slow_start / 1000);
+                }
+
+                if (ps != NULL && ps->drain) {
+                    b->last = ngx_snprintf(b->last, last - b->last, " drain");
+                }
+
+                if (ps != NULL && ps->backoff) {
+                    b->last = ngx_snprintf(b->last, last - b->last, " backoff=%ui", ps->backoff);
+                }
+
+                if (ps != NULL && dus->check && ps->checks) {
+                    b->last = ngx_snprintf(b->last, last - b->last, " check=%s checks=%ui",
+                                           ps->check_fails ? "failed" : "ok", ps->checks);
+                }
+
+            } else {
+                b->last = ngx_snprintf(b->last, last - b->last, "server %s", namebuf);
+
+            }
 
-        b->last = peer->down ? ngx_snprintf(b->last, last - b->last, " down;\n") : ngx_snprintf(b->last, last - b->last, ";\n");
+            if (list != peers) {
+                b->last = ngx_snprintf(b->last, last - b->last, " backup");
+            }
+
+            b->last = peer->down ? ngx_snprintf(b->last, last - b->last, " down;\n") : ngx_snprintf(b->last, last - b->last, ";\n");
+        }
     }
 
     return NGX_OK;
 }
 
 
+/*
+ * filters the servers of the response by state=, and by server= of the list
+ * or of the operation with quiet=.
+ */
+static ngx_uint_t
+ngx_dynamic_upstream_listed(ngx_dynamic_upstream_op_t *op, ngx_http_upstream_rr_peer_t *peer, ngx_uint_t backup)
+{
+    switch (op->state) {
+    case NGX_DYNAMIC_UPSTREAM_LIST_UP:
+        if (peer->down) {
+            return 0;
+        }
+        break;
+    case NGX_DYNAMIC_UPSTREAM_LIST_DOWN:
+        if (!peer->down) {
+            return 0;
+        }
+        break;
+    case NGX_DYNAMIC_UPSTREAM_LIST_BACKUP:
+        if (!backup) {
+            return 0;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (op->server.len == 0 || (op->op != NGX_DYNAMIC_UPSTEAM_OP_LIST && !op->quiet)) {
+        return 1;
+    }
+
+    if (op->backup && !backup) {
+        return 0;
+    }
+
+    return ngx_dynamic_upstream_op_is_server(op, &peer->name, peer->sockaddr, peer->socklen);
+}
+
+
+/*
+ * dumps the servers in the format of replace after the version line, so that
+ * the dump is imported by another node. the dump is in the buffers of a page,
+ * not in a buffer of the zone size, for the large upstreams.
+ */
+static ngx_chain_t *
+ngx_dynamic_upstream_export(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t generation)
+{
+    size_t                              size;
+    ngx_int_t                           weight;
+    time_t                              fail_timeout;
+    ngx_buf_t                          *b;
+    ngx_chain_t                        *out, **ll, *cl;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers, *list;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    peers = uscf->peer.data;
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    b = ngx_create_temp_buf(r->pool, ngx_pagesize);
+    out = ngx_alloc_chain_link(r->pool);
+    if (b == NULL || out == NULL) {
+        return NULL;
+    }
+
+    b->last = ngx_snprintf(b->last, b->end - b->last, NGX_DYNAMIC_UPSTREAM_EXPORT "%d generation=%ui\n",
+                           NGX_DYNAMIC_UPSTREAM_EXPORT_VERSION, generation);
+
+    out->buf = b;
+    out->next = NULL;
+    ll = &out->next;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (list = peers; list; list = list->next) {
+
+        for (peer = list->peer; peer; peer = peer->next) {
+
+            size = sizeof("server  weight= max_fails= fail_timeout= backup down;\n") - 1
+                   + peer->name.len + 3 * NGX_INT_T_LEN;
+
+            if ((size_t) (b->end - b->last) < size) {
+                b = ngx_create_temp_buf(r->pool, ngx_max((size_t) ngx_pagesize, size));
+                cl = ngx_alloc_chain_link(r->pool);
+                if (b == NULL || cl == NULL) {
+                    ngx_http_upstream_rr_peers_unlock(peers);
+                    return NULL;
+                }
+
+                cl->buf = b;
+                cl->next = NULL;
+                *ll = cl;
+                ll = &cl->next;
+            }
+
+            ps = (dus->sh != NULL) ? ngx_dynamic_upstream_state_lookup(dus->sh, peer) : NULL;
+
+            /* the parameters given by the API, not the ones adjusted */
+            weight = ps ? ps->weight : peer->weight;
+            fail_timeout = ps ? ps->fail_timeout : peer->fail_timeout;
+
+            b->last = ngx_sprintf(b->last, "server %V weight=%i max_fails=%ui fail_timeout=%T",
+                                  &peer->name, weight, peer->max_fails, fail_timeout);
+
+            if (list != peers) {
+                b->last = ngx_cpymem(b->last, " backup", sizeof(" backup") - 1);
+            }
+
+            /* the server down by the checks is upped by the checks of the importer */
+            if (peer->down && (ps == NULL || !ps->check_down)) {
+                b->last = ngx_cpymem(b->last, " down", sizeof(" down") - 1);
+            }
+
+            *b->last++ = ';';
+            *b->last++ = '\n';
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return out;
+}
+
+
 static ngx_int_t
 ngx_dynamic_upstream_handler(ngx_http_request_t *r)
 {
-    size_t                          size;
-    ngx_int_t                       rc;
-    ngx_chain_t                     out;
-    ngx_dynamic_upstream_op_t       op;
-    ngx_buf_t                      *b;
-    ngx_http_upstream_srv_conf_t   *uscf;
-    ngx_slab_pool_t                *shpool;
-    ssize_t                        n;
-
-    printf("mmmmmmmmmm\n");
-    //FILE *pFile = fopen("//opt//44.txt","w");
-    //fwrite ("hello",1,5,pFile);
-    //fflush(pFile);
-    //fclose(pFile);    
-    ngx_fd_t          fd;
-    fd = ngx_open_file("//opt//aa.txt", NGX_FILE_WRONLY, NGX_FILE_CREATE_OR_OPEN,NGX_FILE_OWNER_ACCESS);
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "xxxxxxxxxxxxxxxxxxx.");
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_open_file_n "//opt//aa.txt  failed");
-    }
-    //ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,fd);
-    n = ngx_write_fd(fd, "hhhhh", 5);
-
-    if (n == -1) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "ngx_write_fd error!");
-    }    
+    ngx_int_t  rc;
+
+    /* the servers of replace are in the body */
+    if (r->method == NGX_HTTP_POST) {
+        rc = ngx_http_read_client_request_body(r, ngx_dynamic_upstream_body_handler);
+
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
 
-    if ( ngx_close_file(fd) == NGX_FILE_ERROR ) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                  "ngx_close_file feiled.");
+        return NGX_DONE;
     }
 
     if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
@@ -165,7 +478,29 @@ ngx_dynamic_upstream_handler(ngx_http_request_t *r)
     if (rc != NGX_OK) {
         return rc;
     }
-    
+
+    return ngx_dynamic_upstream_process(r);
+}
+
+
+static void
+ngx_dynamic_upstream_body_handler(ngx_http_request_t *r)
+{
+    ngx_http_finalize_request(r, ngx_dynamic_upstream_process(r));
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_process(ngx_http_request_t *r)
+{
+    ngx_int_t                         rc;
+    ngx_uint_t                        generation;
+    ngx_chain_t                       out;
+    ngx_dynamic_upstream_op_t         op;
+    ngx_buf_t                        *b;
+    ngx_http_upstream_srv_conf_t     *uscf;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
     r->headers_out.content_type_len = sizeof("text/plain") - 1;
     ngx_str_set(&r->headers_out.content_type, "text/plain");
     r->headers_out.content_type_lowcase = NULL;
@@ -187,7 +522,42 @@ ngx_dynamic_upstream_handler(ngx_http_request_t *r)
         }
         return op.status;
     }
-    
+
+    if (op.stream) {
+#if (NGX_DYNAMIC_UPSTREAM_STREAM)
+        rc = ngx_dynamic_upstream_stream_handler(r, &op, &b);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        goto send;
+#else
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "stream upstreams are not supported. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_HTTP_BAD_REQUEST;
+#endif
+    }
+
+    if (op.op & NGX_DYNAMIC_UPSTEAM_OP_CLAIM) {
+        rc = ngx_dynamic_upstream_spare_claim(r, &op, &b);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        goto send;
+    }
+
+    if (op.upstreams) {
+        rc = ngx_dynamic_upstream_apply_zones(r, &op, &b);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        goto send;
+    }
+
     uscf = ngx_dynamic_upstream_get_zone(r, &op);
     if (uscf == NULL) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -197,19 +567,85 @@ ngx_dynamic_upstream_handler(ngx_http_request_t *r)
         return NGX_HTTP_NOT_FOUND;
     }
 
-    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
-    ngx_shmtx_lock(&shpool->mutex);
-    
-    rc = ngx_dynamic_upstream_op(r, &op, shpool, uscf);
+    /* the release is serialized with the claims out of the locks of the upstream */
+    if (op.op & NGX_DYNAMIC_UPSTEAM_OP_RELEASE) {
+        rc = ngx_dynamic_upstream_spare_release(r, &op, uscf, &generation);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        return ngx_dynamic_upstream_respond(r, &op, uscf, generation);
+    }
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    /* the op is applied by the writer worker, and the request waits for it */
+    if (dus->queue && ngx_dynamic_upstream_queue_push(r, &op, uscf) == NGX_OK) {
+        r->main->count++;
+        return NGX_DONE;
+    }
+
+    rc = ngx_dynamic_upstream_apply(r, &op, uscf, &generation);
     if (rc != NGX_OK) {
-        ngx_shmtx_unlock(&shpool->mutex);
-        if (op.status == NGX_HTTP_OK) {
+        return rc;
+    }
+
+    return ngx_dynamic_upstream_respond(r, &op, uscf, generation);
+
+ send:
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_dynamic_upstream_send(r, &out);
+}
+
+
+/* sends the response of op applied to the upstream as the generation */
+ngx_int_t
+ngx_dynamic_upstream_respond(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                             ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t generation)
+{
+    size_t                            size;
+    ngx_int_t                         rc;
+    ngx_chain_t                       out, *cl;
+    ngx_buf_t                        *b;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    peers = uscf->peer.data;
+    cl = NULL;
+
+    if (ngx_dynamic_upstream_set_etag(r, generation) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (op->export) {
+        cl = ngx_dynamic_upstream_export(r, uscf, generation);
+        if (cl == NULL) {
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
-        return op.status;
+
+        goto send;
     }
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    if (op->history) {
+        b = ngx_dynamic_upstream_history_render(r, uscf, op->history);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        goto send;
+    }
+
+    if (op->changes != NULL) {
+        b = ngx_dynamic_upstream_op_render_changes(r, op);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        goto send;
+    }
 
     size = uscf->shm_zone->shm.size;
 
@@ -218,10 +654,9 @@ ngx_dynamic_upstream_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    out.buf = b;
-    out.next = NULL;
-
-    rc = ngx_dynamic_upstream_create_response_buf((ngx_http_upstream_rr_peers_t *)uscf->peer.data, b, size, op.verbose);
+    ngx_http_upstream_rr_peers_rlock(peers);
+    rc = ngx_dynamic_upstream_create_response_buf(uscf, b, size, op);
+    ngx_http_upstream_rr_peers_unlock(peers);
 
     if (rc == NGX_ERROR) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -231,8 +666,46 @@ ngx_dynamic_upstream_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
+ send:
+
+    if (cl == NULL) {
+        out.buf = b;
+        out.next = NULL;
+        cl = &out;
+    }
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    /* the op committed is forwarded to the peer nodes, not the op forwarded */
+    if (dus->replicate != NULL
+        && dus->sh != NULL
+        && op->replicated == 0
+        && op->op != NGX_DYNAMIC_UPSTEAM_OP_LIST
+        && (op->changes == NULL || op->changes->nelts))
+    {
+        return ngx_dynamic_upstream_replicate(r, uscf, generation, cl);
+    }
+
+    return ngx_dynamic_upstream_send(r, cl);
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_send(ngx_http_request_t *r, ngx_chain_t *cl)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t  *ln;
+
+    b = NULL;
+
     r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = b->last - b->pos;
+    r->headers_out.content_length_n = 0;
+
+    for (ln = cl; ln; ln = ln->next) {
+        b = ln->buf;
+        r->headers_out.content_length_n += b->last - b->pos;
+    }
 
     b->last_buf = (r == r->main) ? 1 : 0;
     b->last_in_chain = 1;
@@ -243,17 +716,728 @@ ngx_dynamic_upstream_handler(ngx_http_request_t *r)
         return rc;
     }
 
-    return ngx_http_output_filter(r, &out);
+    return ngx_http_output_filter(r, cl);
 }
 
 
-static char *
-ngx_dynamic_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+/* applies op to the upstream in the critical section, returns NGX_OK or a HTTP status code */
+static ngx_int_t
+ngx_dynamic_upstream_apply(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                           ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t *generation)
 {
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_int_t                         rc;
+    ngx_slab_pool_t                  *shpool;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_dynamic_upstream_handler;
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+    peers = uscf->peer.data;
 
-    return NGX_CONF_OK;
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    ngx_shmtx_lock(&shpool->mutex);
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    *generation = (dus->sh != NULL) ? dus->sh->generation : 0;
+
+    /* the op retried by the origin is applied once */
+    if (op->replicated && dus->sh != NULL && ngx_dynamic_upstream_replicate_seen_locked(dus->sh, op)) {
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_LIST;
+    }
+
+    /* the mutation based on the stale list is refused, the generation of the origin is not of this node */
+    if (op->op != NGX_DYNAMIC_UPSTEAM_OP_LIST
+        && !op->replicated
+        && ngx_dynamic_upstream_if_match(r, *generation) != NGX_OK)
+    {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        ngx_shmtx_unlock(&shpool->mutex);
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "generation of upstream is %ui. %s:%d",
+                      *generation,
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_HTTP_PRECONDITION_FAILED;
+    }
+
+    rc = ngx_dynamic_upstream_op(r, op, shpool, uscf);
+    if (rc != NGX_OK) {
+        /* the servers changed before the failure are of a new generation */
+        if (dus->sh != NULL && op->changes != NULL && op->changes->nelts) {
+            *generation = ++dus->sh->generation;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+        ngx_shmtx_unlock(&shpool->mutex);
+        if (op->status == NGX_HTTP_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        return op->status;
+    }
+
+    if (dus->sh != NULL
+        && op->op != NGX_DYNAMIC_UPSTEAM_OP_LIST
+        && (op->changes == NULL || op->changes->nelts))
+    {
+        *generation = ++dus->sh->generation;
+
+        if (op->replicated) {
+            ngx_dynamic_upstream_replicate_applied_locked(dus->sh, op);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    /* the file is written out of the locks */
+    ngx_dynamic_upstream_persist(r->pool, r->connection->log, uscf, op);
+
+    return NGX_OK;
+}
+
+
+/*
+ * applies op to the upstreams of the list or the wildcard one by one,
+ * the result of an upstream is "upstream zone_a status=200 generation=3;" in a line.
+ */
+static ngx_int_t
+ngx_dynamic_upstream_apply_zones(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op, ngx_buf_t **bp)
+{
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_uint_t                      i, n, generation;
+    ngx_buf_t                      *b;
+    ngx_str_t                      *name;
+    ngx_dynamic_upstream_op_t       zop;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf  = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    size = 0;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->shm_zone != NULL) {
+            size += sizeof("upstream  status=000 generation=;\n") - 1
+                    + uscfp[i]->shm_zone->shm.name.len + NGX_INT_T_LEN;
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, size ? size : 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    n = 0;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        name = &uscf->shm_zone->shm.name;
+
+        if (!ngx_dynamic_upstream_match_zone(&op->upstream, name)) {
+            continue;
+        }
+
+        /* an upstream does not see the result of the others */
+        zop = *op;
+        zop.upstream = *name;
+        zop.status = NGX_HTTP_OK;
+
+        /* the servers of replace are rewritten by an upstream */
+        if (op->servers != NULL) {
+            zop.servers = ngx_array_create(r->pool, op->servers->nelts, sizeof(ngx_dynamic_upstream_op_t));
+            if (zop.servers == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ngx_memcpy(zop.servers->elts, op->servers->elts, op->servers->nelts * op->servers->size);
+            zop.servers->nelts = op->servers->nelts;
+        }
+
+        rc = ngx_dynamic_upstream_apply(r, &zop, uscf, &generation);
+
+        b->last = ngx_sprintf(b->last, "upstream %V status=%ui generation=%ui;\n",
+                              name, rc == NGX_OK ? (ngx_uint_t) NGX_HTTP_OK : (ngx_uint_t) rc, generation);
+        n++;
+    }
+
+    if (n == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream is not found. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    *bp = b;
+
+    return NGX_OK;
+}
+
+
+/* matches the name of a zone with "zone_a,zone_b", and "zone_*" matches the prefix */
+static ngx_uint_t
+ngx_dynamic_upstream_match_zone(ngx_str_t *upstreams, ngx_str_t *name)
+{
+    u_char  *p, *last, *comma;
+    size_t   len;
+
+    p = upstreams->data;
+    last = p + upstreams->len;
+
+    while (p < last) {
+        comma = ngx_strlchr(p, last, ',');
+        if (comma == NULL) {
+            comma = last;
+        }
+
+        len = comma - p;
+
+        if (len && p[len - 1] == '*') {
+            if (name->len >= len - 1 && ngx_strncmp(name->data, p, len - 1) == 0) {
+                return 1;
+            }
+
+        } else if (name->len == len && ngx_strncmp(name->data, p, len) == 0) {
+            return 1;
+        }
+
+        p = comma + 1;
+    }
+
+    return 0;
+}
+
+
+/* If-Match has the generation of the upstream, such as "12" or 12. "*" matches any */
+static ngx_int_t
+ngx_dynamic_upstream_if_match(ngx_http_request_t *r, ngx_uint_t generation)
+{
+    u_char     *p, *last;
+    ngx_int_t   n;
+
+    if (r->headers_in.if_match == NULL) {
+        return NGX_OK;
+    }
+
+    p = r->headers_in.if_match->value.data;
+    last = p + r->headers_in.if_match->value.len;
+
+    if (last - p == 1 && *p == '*') {
+        return NGX_OK;
+    }
+
+    if (last - p > 2 && p[0] == 'W' && p[1] == '/') {
+        p += 2;
+    }
+
+    if (last - p > 2 && p[0] == '"' && last[-1] == '"') {
+        p++;
+        last--;
+    }
+
+    n = ngx_atoi(p, last - p);
+    if (n == NGX_ERROR || (ngx_uint_t) n != generation) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+/* the generation of the upstream is sent as the entity tag */
+static ngx_int_t
+ngx_dynamic_upstream_set_etag(ngx_http_request_t *r, ngx_uint_t generation)
+{
+    ngx_table_elt_t  *etag;
+
+    etag = ngx_list_push(&r->headers_out.headers);
+    if (etag == NULL) {
+        return NGX_ERROR;
+    }
+
+    etag->value.data = ngx_pnalloc(r->pool, NGX_INT_T_LEN + 2);
+    if (etag->value.data == NULL) {
+        etag->hash = 0;
+        return NGX_ERROR;
+    }
+
+    etag->hash = 1;
+    ngx_str_set(&etag->key, "ETag");
+    etag->value.len = ngx_sprintf(etag->value.data, "\"%ui\"", generation) - etag->value.data;
+
+    r->headers_out.etag = etag;
+
+    /* If-Match is for the generation before the operation */
+    r->disable_not_modified = 1;
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_dynamic_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_dynamic_upstream_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_dynamic_upstream_latency_weight(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t *dus = conf;
+
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (dus->latency_weight) {
+        return "is duplicate";
+    }
+
+    dus->latency_weight = 10000;
+    dus->latency_weight_min = 1;
+    dus->latency_weight_max = 100;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            dus->latency_weight = ngx_parse_time(&s, 0);
+            if (dus->latency_weight == (ngx_msec_t) NGX_ERROR || dus->latency_weight == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+            dus->latency_weight_min = ngx_atoi(&value[i].data[4], value[i].len - 4);
+            if (dus->latency_weight_min == NGX_ERROR || dus->latency_weight_min == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+            dus->latency_weight_max = ngx_atoi(&value[i].data[4], value[i].len - 4);
+            if (dus->latency_weight_max == NGX_ERROR || dus->latency_weight_max == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (dus->latency_weight_min > dus->latency_weight_max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"min\" is greater than \"max\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+ invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_dynamic_upstream_load_header(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t *dus = conf;
+
+    ngx_str_t  *value, s;
+
+    if (dus->load_header.len) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    dus->load_header = value[1];
+    dus->load_weight = 5000;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "interval=", 9) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 9;
+        s.data = &value[2].data[9];
+
+        dus->load_weight = ngx_parse_time(&s, 0);
+        if (dus->load_weight == (ngx_msec_t) NGX_ERROR || dus->load_weight == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_dynamic_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t *dus = conf;
+
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (dus->check) {
+        return "is duplicate";
+    }
+
+    dus->check = 5000;
+    dus->check_timeout = 1000;
+    dus->check_rise = 2;
+    dus->check_fall = 3;
+    dus->check_type = NGX_DYNAMIC_UPSTREAM_CHECK_TCP;
+    ngx_str_set(&dus->check_uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            dus->check = ngx_parse_time(&s, 0);
+            if (dus->check == (ngx_msec_t) NGX_ERROR || dus->check == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            dus->check_timeout = ngx_parse_time(&s, 0);
+            if (dus->check_timeout == (ngx_msec_t) NGX_ERROR || dus->check_timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rise=", 5) == 0) {
+            dus->check_rise = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (dus->check_rise == NGX_ERROR || dus->check_rise == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fall=", 5) == 0) {
+            dus->check_fall = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (dus->check_fall == NGX_ERROR || dus->check_fall == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=tcp") == 0) {
+            dus->check_type = NGX_DYNAMIC_UPSTREAM_CHECK_TCP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=http") == 0) {
+            dus->check_type = NGX_DYNAMIC_UPSTREAM_CHECK_HTTP;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+            dus->check_uri.len = value[i].len - 4;
+            dus->check_uri.data = &value[i].data[4];
+
+            if (dus->check_uri.len == 0 || dus->check_uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+            dus->check_status = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (dus->check_status < 100 || dus->check_status > 599) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    /* the next round does not start while checking */
+    if (dus->check_timeout >= dus->check) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"timeout\" must be less than \"interval\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+ invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_dynamic_upstream_backoff(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t *dus = conf;
+
+    ngx_str_t  *value, s;
+
+    if (dus->backoff) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    dus->backoff = 300;
+
+    if (cf->args->nelts == 2) {
+
+        if (ngx_strncmp(value[1].data, "max=", 4) != 0) {
+            goto invalid;
+        }
+
+        s.len = value[1].len - 4;
+        s.data = &value[1].data[4];
+
+        dus->backoff = ngx_parse_time(&s, 1);
+        if (dus->backoff == (time_t) NGX_ERROR || dus->backoff == 0) {
+            goto invalid;
+        }
+    }
+
+    return NGX_CONF_OK;
+
+ invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static void *
+ngx_dynamic_upstream_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_dynamic_upstream_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_dynamic_upstream_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->latency_weight = 0;
+     *     conf->latency_weight_min = 0;
+     *     conf->latency_weight_max = 0;
+     *     conf->load_header = { 0, NULL };
+     *     conf->load_weight = 0;
+     *     conf->check = 0;
+     *     conf->check_status = 0;
+     *     conf->backoff = 0;
+     *     conf->queue = 0;
+     *     conf->sh = NULL;
+     */
+
+    conf->stats = NGX_CONF_UNSET;
+    conf->hash_points = NGX_CONF_UNSET;
+    conf->spare = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_preconfiguration(ngx_conf_t *cf)
+{
+    return ngx_dynamic_upstream_balancer_preconfiguration(cf);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_dynamic_upstream_state_log_handler;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        /* only upstreams with the zone are operated */
+        if (uscf->shm_zone == NULL || uscf->shm_zone->shm.addr == NULL || uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+        /* the latency weight is computed from the stats */
+        ngx_conf_init_value(dus->stats, dus->latency_weight ? 1 : 0);
+        ngx_conf_init_value(dus->spare, 0);
+
+        if (dus->latency_weight && !dus->stats) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "\"dynamic_upstream_latency_weight\" requires \"dynamic_upstream_stats\" in upstream \"%V\"",
+                          &uscf->host);
+            return NGX_ERROR;
+        }
+
+        if (ngx_dynamic_upstream_state_init_zone(cycle, uscf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_dynamic_upstream_chash_init_zone(cycle, uscf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_dynamic_upstream_queue_init_zone(cycle, uscf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_init_process(ngx_cycle_t *cycle)
+{
+    ngx_event_t  *ev;
+
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module) == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_dynamic_upstream_keepalive_init_process(cycle);
+    ngx_dynamic_upstream_balancer_init_process(cycle);
+    ngx_dynamic_upstream_queue_init_process(cycle);
+
+    ev = &ngx_dynamic_upstream_timer;
+
+    ngx_memzero(ev, sizeof(ngx_event_t));
+
+    ev->handler = ngx_dynamic_upstream_timer_handler;
+    ev->log = cycle->log;
+
+    ngx_add_timer(ev, NGX_DYNAMIC_UPSTREAM_TICK);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_timer_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL || uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+        if (dus->sh == NULL) {
+            continue;
+        }
+
+        ngx_dynamic_upstream_weight_tick(uscf);
+        ngx_dynamic_upstream_drain_tick(uscf);
+        ngx_dynamic_upstream_check_tick(uscf);
+        ngx_dynamic_upstream_backoff_tick(uscf);
+        ngx_dynamic_upstream_keepalive_tick(uscf);
+    }
+
+#if (NGX_DYNAMIC_UPSTREAM_STREAM)
+    ngx_dynamic_upstream_stream_tick();
+#endif
+
+    ngx_add_timer(ev, NGX_DYNAMIC_UPSTREAM_TICK);
 }
@@ -7,11 +7,13 @@
 #include <ngx_http.h>
 
 
-#define NGX_DYNAMIC_UPSTEAM_OP_LIST   0
-#define NGX_DYNAMIC_UPSTEAM_OP_ADD    1
-#define NGX_DYNAMIC_UPSTEAM_OP_REMOVE 2
-#define NGX_DYNAMIC_UPSTEAM_OP_BACKUP 4
-#define NGX_DYNAMIC_UPSTEAM_OP_PARAM  8
+#define NGX_DYNAMIC_UPSTEAM_OP_LIST    0
+#define NGX_DYNAMIC_UPSTEAM_OP_ADD     1
+#define NGX_DYNAMIC_UPSTEAM_OP_REMOVE  2
+#define NGX_DYNAMIC_UPSTEAM_OP_PARAM   8
+#define NGX_DYNAMIC_UPSTEAM_OP_REPLACE 16
+#define NGX_DYNAMIC_UPSTEAM_OP_CLAIM   32
+#define NGX_DYNAMIC_UPSTEAM_OP_RELEASE 64
 
 
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT       1
@@ -19,6 +21,53 @@
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT 4
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP           8
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN         16
+#define NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN        32
+
+
+/* state= of the list */
+#define NGX_DYNAMIC_UPSTREAM_LIST_UP     1
+#define NGX_DYNAMIC_UPSTREAM_LIST_DOWN   2
+#define NGX_DYNAMIC_UPSTREAM_LIST_BACKUP 3
+
+
+#define NGX_DYNAMIC_UPSTREAM_CHECK_TCP  0
+#define NGX_DYNAMIC_UPSTREAM_CHECK_HTTP 1
+
+
+/* the peers have the tries of a request, the servers not down by the configuration */
+#if (nginx_version >= 1011005)
+#define NGX_DYNAMIC_UPSTREAM_TRIES 1
+#endif
+
+
+/* size of the rings of the evicted and the warmed addresses */
+#define NGX_DYNAMIC_UPSTREAM_EVICTED 32
+#define NGX_DYNAMIC_UPSTREAM_WARMED  32
+
+
+/* max length of the name claimed for a spare upstream */
+#define NGX_DYNAMIC_UPSTREAM_SPARE_NAME 64
+
+
+/* the first line of an export is "# ngx_dynamic_upstream 1 generation=7" */
+#define NGX_DYNAMIC_UPSTREAM_EXPORT         "# ngx_dynamic_upstream "
+#define NGX_DYNAMIC_UPSTREAM_EXPORT_VERSION 1
+
+
+/* size of the ring of the ops replicated from the origin */
+#define NGX_DYNAMIC_UPSTREAM_REPLICATED 32
+
+/* max length of the name of the origin of a replicated op */
+#define NGX_DYNAMIC_UPSTREAM_NODE 64
+
+
+/* max length of the server of a queued op, the longer ones are applied at once */
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_SERVER 128
+
+
+/* size of the ring of the changes by the API, the longer servers are truncated */
+#define NGX_DYNAMIC_UPSTREAM_HISTORY        64
+#define NGX_DYNAMIC_UPSTREAM_HISTORY_SERVER 64
 
 
 typedef struct ngx_dynamic_upstream_op_t {
@@ -26,15 +75,244 @@ typedef struct ngx_dynamic_upstream_op_t {
     ngx_int_t op;
     ngx_int_t op_param;
     ngx_int_t backup;
+    ngx_int_t stream;
     ngx_int_t weight;
     ngx_int_t max_fails;
     ngx_int_t fail_timeout;
     ngx_int_t up;
     ngx_int_t down;
+    ngx_int_t slow_start;
+    ngx_int_t drain;   /* timeout in seconds, 0 is none */
+    ngx_int_t warm;
+    ngx_int_t quiet;   /* the response is the server of op only */
+    ngx_int_t state;   /* NGX_DYNAMIC_UPSTREAM_LIST_*, 0 is all */
+    ngx_int_t offset;
+    ngx_int_t limit;   /* 0 is all */
     ngx_str_t upstream;
+    ngx_int_t upstreams; /* upstream is a list or a wildcard */
     ngx_str_t server;
+    socklen_t socklen; /* of server, 0 is a name */
+    u_char sockaddr[NGX_SOCKADDRLEN];
+    ngx_str_t server_prefix;
+    ngx_str_t claim;   /* name for a spare upstream */
+    ngx_int_t export;
+    ngx_int_t import;  /* replace by an export */
+    time_t epoch;      /* of the zone of the origin */
+    ngx_uint_t replicated; /* generation of the origin, 0 is not replicated */
+    ngx_str_t node;    /* name of the origin */
+    ngx_int_t queued;  /* applied by the writer worker */
+    ngx_int_t history; /* number of the changes listed, 0 is not the history */
+    ngx_cidr_t *server_cidr; /* NULL is none */
     ngx_uint_t status;
+    ngx_array_t *servers; /* of ngx_dynamic_upstream_op_t, by replace */
+    ngx_array_t *changes; /* of ngx_dynamic_upstream_change_t, by replace or a selector */
 } ngx_dynamic_upstream_op_t;
 
 
+typedef struct {
+    ngx_int_t                     op;       /* ADD, REMOVE or PARAM */
+    ngx_int_t                     backup;
+    ngx_str_t                     server;
+} ngx_dynamic_upstream_change_t;
+
+
+/* side state of a peer, kept in the slab of the upstream zone */
+typedef struct {
+    ngx_rbtree_node_t             node;     /* key is the peer address */
+    ngx_rbtree_node_t             addr_node; /* key is the hash of the sockaddr */
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    ngx_uint_t                    requests;
+    off_t                         bytes;
+    ngx_uint_t                    status[5]; /* 1xx - 5xx */
+    ngx_msec_t                    response_time; /* EWMA in usec */
+    ngx_uint_t                    load;     /* EWMA of the reported load, 1/1000 */
+    ngx_int_t                     weight;   /* weight before the adjustment */
+    ngx_int_t                     target;   /* weight after the adjustment, before the slow start */
+    ngx_msec_t                    slow_start;       /* 0 unless the weight is ramping */
+    ngx_msec_t                    slow_start_begin;
+    ngx_uint_t                    drain;    /* removed when the connections are gone */
+    ngx_msec_t                    drain_deadline;   /* 0 is none */
+
+    ngx_uint_t                    checks;       /* number of the active checks done */
+    ngx_uint_t                    check_oks;    /* consecutive */
+    ngx_uint_t                    check_fails;  /* consecutive */
+    ngx_uint_t                    check_down;   /* down by the checks */
+
+    time_t                        fail_timeout; /* fail_timeout before the backoff */
+    ngx_uint_t                    backoff;      /* consecutive failure windows */
+    time_t                        backoff_accessed;
+} ngx_dynamic_upstream_peer_state_t;
+
+
+typedef struct {
+    socklen_t                     socklen;
+    u_char                        sockaddr[NGX_SOCKADDRLEN];
+} ngx_dynamic_upstream_evicted_t;
+
+
+typedef struct {
+    socklen_t                     socklen;
+    u_char                        sockaddr[NGX_SOCKADDRLEN];
+    ngx_uint_t                    n;        /* connections per worker */
+} ngx_dynamic_upstream_warmed_t;
+
+
+typedef struct {
+    time_t                        epoch;
+    ngx_uint_t                    generation;
+    size_t                        node_len;
+    u_char                        node[NGX_DYNAMIC_UPSTREAM_NODE];
+} ngx_dynamic_upstream_replicated_t;
+
+
+/*
+ * a slot of the ring of the ops. the slot of the position p is free when seq is p,
+ * then seq is p + the state of the op, and p + the size of the ring when freed for the next round.
+ */
+typedef struct {
+    ngx_atomic_t                  seq;
+    ngx_uint_t                    status;       /* of the op applied */
+    ngx_uint_t                    generation;
+
+    ngx_int_t                     op;
+    ngx_int_t                     op_param;
+    ngx_int_t                     backup;
+    ngx_int_t                     weight;
+    ngx_int_t                     max_fails;
+    ngx_int_t                     fail_timeout;
+    ngx_int_t                     up;
+    ngx_int_t                     down;
+    ngx_int_t                     slow_start;
+    ngx_int_t                     drain;
+    ngx_int_t                     warm;
+    size_t                        server_len;
+    u_char                        server[NGX_DYNAMIC_UPSTREAM_QUEUE_SERVER];
+    size_t                        addr_len;     /* of the client */
+    u_char                        addr[NGX_INET6_ADDRSTRLEN];
+} ngx_dynamic_upstream_queued_t;
+
+
+typedef struct {
+    ngx_int_t                     weight;
+    ngx_uint_t                    max_fails;
+    time_t                        fail_timeout;
+    ngx_uint_t                    down;
+} ngx_dynamic_upstream_params_t;
+
+
+/* a change of a peer by the API, the parameters of the peer before and after */
+typedef struct {
+    time_t                          time;
+    ngx_uint_t                      generation;
+    ngx_int_t                       op;         /* ADD, REMOVE or PARAM */
+    ngx_uint_t                      backup;
+    ngx_dynamic_upstream_params_t   old;        /* none for ADD */
+    ngx_dynamic_upstream_params_t   new;        /* none for REMOVE */
+    size_t                          server_len;
+    u_char                          server[NGX_DYNAMIC_UPSTREAM_HISTORY_SERVER];
+    size_t                          addr_len;   /* of the client */
+    u_char                          addr[NGX_INET6_ADDRSTRLEN];
+} ngx_dynamic_upstream_history_t;
+
+
+/*
+ * the consistent hash points of ngx_http_upstream_hash_module,
+ * which are not exported. these must be same as ngx_http_upstream_hash_module.c.
+ */
+typedef struct {
+    uint32_t                      hash;
+    ngx_str_t                    *server;
+} ngx_dynamic_upstream_chash_point_t;
+
+
+typedef struct {
+    ngx_uint_t                          number;
+    ngx_dynamic_upstream_chash_point_t  point[1];
+} ngx_dynamic_upstream_chash_points_t;
+
+
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_node_t             sentinel;
+    ngx_rbtree_t                  addrs;      /* the peer states by the sockaddr */
+    ngx_rbtree_node_t             addrs_sentinel;
+    ngx_msec_t                    weight_next;
+    ngx_uint_t                    slow_start; /* number of the peers ramping */
+    ngx_uint_t                    drain;      /* number of the peers draining */
+    ngx_http_upstream_rr_peer_t  *retired;    /* unlinked by the drain timeout, chained by next */
+    ngx_msec_t                    check_next;
+
+    /* the address of the generation g is in evicted[g % NGX_DYNAMIC_UPSTREAM_EVICTED] */
+    ngx_uint_t                      evict_gen;
+    ngx_dynamic_upstream_evicted_t  evicted[NGX_DYNAMIC_UPSTREAM_EVICTED];
+
+    ngx_uint_t                      warm_gen;
+    ngx_dynamic_upstream_warmed_t   warmed[NGX_DYNAMIC_UPSTREAM_WARMED];
+
+    ngx_uint_t                      generation; /* changed by the API */
+    time_t                          epoch;      /* when the zone is created, the generation restarts */
+
+    /* the ops applied from the origins, by "replicated=epoch.generation.node" */
+    ngx_uint_t                         replicated_n;
+    ngx_dynamic_upstream_replicated_t  replicated[NGX_DYNAMIC_UPSTREAM_REPLICATED];
+
+    /* the ring of the ops, NULL unless dynamic_upstream_queue */
+    ngx_dynamic_upstream_queued_t     *queue;
+    ngx_atomic_t                       queue_tail;  /* reserved by the callers */
+    ngx_atomic_uint_t                  queue_head;  /* applied by the writer */
+
+    /* the change of the count n is in history[n % NGX_DYNAMIC_UPSTREAM_HISTORY] */
+    ngx_uint_t                      history_n;
+    ngx_dynamic_upstream_history_t  history[NGX_DYNAMIC_UPSTREAM_HISTORY];
+
+    /* the name claimed for a spare upstream, 0 is free */
+    size_t                          spare_len;
+    u_char                          spare[NGX_DYNAMIC_UPSTREAM_SPARE_NAME];
+    ngx_atomic_t                    spare_generation;  /* claims and releases, counted in the first spare */
+
+    /* the points of "hash ... consistent", NULL for the other balancers */
+    ngx_dynamic_upstream_chash_points_t  *chash;
+    ngx_uint_t                            chash_size; /* allocated points */
+} ngx_dynamic_upstream_shctx_t;
+
+
+typedef struct {
+    ngx_flag_t                      stats;
+    ngx_msec_t                      latency_weight; /* interval, 0 is off */
+    ngx_int_t                       latency_weight_min;
+    ngx_int_t                       latency_weight_max;
+    ngx_str_t                       load_header;
+    ngx_msec_t                      load_weight;    /* interval */
+    ngx_msec_t                      check;          /* interval, 0 is off */
+    ngx_msec_t                      check_timeout;
+    ngx_int_t                       check_rise;
+    ngx_int_t                       check_fall;
+    ngx_uint_t                      check_type;
+    ngx_str_t                       check_uri;
+    ngx_int_t                       check_status;   /* 0 is 2xx or 3xx */
+    time_t                          backoff;        /* max fail_timeout, 0 is off */
+    ngx_int_t                       hash_points;    /* for "hash ... consistent" */
+    ngx_flag_t                      spare;          /* claimed by the API */
+    ngx_array_t                    *replicate;      /* of ngx_dynamic_upstream_replica_conf_t, NULL is off */
+    ngx_str_t                       replicate_node; /* name of this node, the host name by default */
+    ngx_uint_t                      queue;          /* slots, 0 is off */
+    ngx_msec_t                      queue_interval;
+    ngx_dynamic_upstream_shctx_t   *sh;
+    ngx_uint_t                      evict_gen;      /* seen by the worker */
+    ngx_uint_t                      warm_gen;       /* seen by the worker */
+    ngx_uint_t                      tried;          /* max words of the tried bitmap, 0 is not replaced */
+    ngx_uint_t                      random;         /* the balancer is random */
+    ngx_http_upstream_init_peer_pt  original_init_peer;
+} ngx_dynamic_upstream_srv_conf_t;
+
+
+extern ngx_module_t ngx_dynamic_upstream_module;
+
+
+ngx_int_t ngx_dynamic_upstream_send(ngx_http_request_t *r, ngx_chain_t *cl);
+ngx_int_t ngx_dynamic_upstream_respond(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                       ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t generation);
+
+
 #endif /* NGX_DYNAMIC_UPSTEAM_H */
@@ -2,15 +2,24 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
-#include <sys/file.h>
 
 
 #include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_state.h"
+#include "ngx_dynamic_upstream_weight.h"
+#include "ngx_dynamic_upstream_drain.h"
+#include "ngx_dynamic_upstream_keepalive.h"
+#include "ngx_dynamic_upstream_chash.h"
+#include "ngx_dynamic_upstream_balancer.h"
+#include "ngx_dynamic_upstream_spare.h"
+#include "ngx_dynamic_upstream_history.h"
 #include "ngx_inet_slab.h"
 
 
 static const ngx_str_t ngx_dynamic_upstream_params[] = {
     ngx_string("arg_upstream"),
+    ngx_string("arg_stream"),
     ngx_string("arg_verbose"),
     ngx_string("arg_add"),
     ngx_string("arg_remove"),
@@ -20,21 +29,66 @@ static const ngx_str_t ngx_dynamic_upstream_params[] = {
     ngx_string("arg_max_fails"),
     ngx_string("arg_fail_timeout"),
     ngx_string("arg_up"),
-    ngx_string("arg_down")
+    ngx_string("arg_down"),
+    ngx_string("arg_slow_start"),
+    ngx_string("arg_drain"),
+    ngx_string("arg_warm"),
+    ngx_string("arg_replace"),
+    ngx_string("arg_server_cidr"),
+    ngx_string("arg_server_prefix"),
+    ngx_string("arg_quiet"),
+    ngx_string("arg_state"),
+    ngx_string("arg_offset"),
+    ngx_string("arg_limit"),
+    ngx_string("arg_claim"),
+    ngx_string("arg_release"),
+    ngx_string("arg_export"),
+    ngx_string("arg_import"),
+    ngx_string("arg_replicated"),
+    ngx_string("arg_history")
 };
 
 
 static ngx_int_t
 ngx_dynamic_upstream_is_shpool_range(ngx_http_request_t *r,ngx_slab_pool_t *shpool, void *p);
+static ngx_http_upstream_rr_peer_t *
+ngx_dynamic_upstream_op_find_peer(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_op_t *op,
+                                  ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t **list,
+                                  ngx_http_upstream_rr_peer_t **prev);
 static ngx_int_t
-ngx_dynamic_upstream_op_add(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
-                            ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
+ngx_dynamic_upstream_op_param(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                              ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
 static ngx_int_t
-ngx_dynamic_upstream_op_remove(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+ngx_dynamic_upstream_op_replace(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t
+ngx_dynamic_upstream_op_add_peer(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                 ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
+static void
+ngx_dynamic_upstream_op_free_url(ngx_slab_pool_t *shpool, ngx_url_t *u);
+static ngx_int_t
+ngx_dynamic_upstream_op_remove_peer(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                    ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t
+ngx_dynamic_upstream_op_remove_target(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                      ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf,
+                                      ngx_http_upstream_rr_peers_t *list, ngx_http_upstream_rr_peer_t *prev,
+                                      ngx_http_upstream_rr_peer_t *target);
+static ngx_int_t
+ngx_dynamic_upstream_op_apply_param(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *list,
+                                    ngx_http_upstream_rr_peer_t *target, ngx_uint_t *recalc);
+static ngx_int_t
+ngx_dynamic_upstream_op_select(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
                                ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
+static ngx_uint_t
+ngx_dynamic_upstream_op_match(ngx_dynamic_upstream_op_t *op, ngx_http_upstream_rr_peer_t *peer);
 static ngx_int_t
-ngx_dynamic_upstream_op_update_param(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
-                                     ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
+ngx_dynamic_upstream_op_parse_servers(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op);
+static ngx_uint_t
+ngx_dynamic_upstream_op_kept(ngx_http_upstream_rr_peer_t **kept, ngx_uint_t n, ngx_http_upstream_rr_peer_t *peer);
+static int ngx_libc_cdecl
+ngx_dynamic_upstream_op_cmp_peers(const void *one, const void *two);
 
 
 static ngx_int_t
@@ -53,9 +107,9 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *
 {
     ngx_uint_t                  i;
     size_t                      args_size;
-    u_char                     *low;
+    u_char                     *low, *p, *q;
     ngx_uint_t                  key;
-    ngx_str_t                  *args;
+    ngx_str_t                  *args, value;
     ngx_http_variable_value_t  *var;
 
     ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
@@ -89,6 +143,9 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *
                 op->upstream.data = var->data;
                 op->upstream.len = var->len;
 
+            } else if (ngx_strcmp("arg_stream", args[i].data) == 0) {
+                op->stream = 1;
+
             } else if (ngx_strcmp("arg_verbose", args[i].data) == 0) {
                 op->verbose = 1;
 
@@ -158,11 +215,230 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *
                 op->op |= NGX_DYNAMIC_UPSTEAM_OP_PARAM;
                 op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
                 op->verbose = 1;
-                
+
+            } else if (ngx_strcmp("arg_slow_start", args[i].data) == 0) {
+                op->slow_start = ngx_atoi(var->data, var->len);
+                if (op->slow_start == NGX_ERROR) {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "slow_start is not number. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
+            } else if (ngx_strcmp("arg_drain", args[i].data) == 0) {
+                if (var->len) {
+                    op->drain = ngx_atoi(var->data, var->len);
+                    if (op->drain == NGX_ERROR) {
+                        op->status = NGX_HTTP_BAD_REQUEST;
+                        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                      "drain is not number. %s:%d",
+                                      __FUNCTION__,
+                                      __LINE__);
+                        return NGX_ERROR;
+                    }
+                }
+                op->op |= NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN;
+                op->verbose = 1;
+
+            } else if (ngx_strcmp("arg_warm", args[i].data) == 0) {
+                op->warm = ngx_atoi(var->data, var->len);
+                if (op->warm == NGX_ERROR) {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "warm is not number. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
+            } else if (ngx_strcmp("arg_replace", args[i].data) == 0) {
+                op->op |= NGX_DYNAMIC_UPSTEAM_OP_REPLACE;
+
+            } else if (ngx_strcmp("arg_server_cidr", args[i].data) == 0) {
+                op->server_cidr = ngx_palloc(r->pool, sizeof(ngx_cidr_t));
+                if (op->server_cidr == NULL) {
+                    op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                    return NGX_ERROR;
+                }
+
+                value.data = var->data;
+                value.len = var->len;
+
+                /* the host bits such as 10.2.3.0/16 are ignored */
+                if (ngx_ptocidr(&value, op->server_cidr) == NGX_ERROR) {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "server_cidr is invalid. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
+            } else if (ngx_strcmp("arg_server_prefix", args[i].data) == 0) {
+                if (var->len == 0) {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "server_prefix is empty. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
+                op->server_prefix.data = var->data;
+                op->server_prefix.len = var->len;
+
+            } else if (ngx_strcmp("arg_quiet", args[i].data) == 0) {
+                op->quiet = 1;
+
+            } else if (ngx_strcmp("arg_state", args[i].data) == 0) {
+                if (var->len == 2 && ngx_strncmp(var->data, "up", 2) == 0) {
+                    op->state = NGX_DYNAMIC_UPSTREAM_LIST_UP;
+
+                } else if (var->len == 4 && ngx_strncmp(var->data, "down", 4) == 0) {
+                    op->state = NGX_DYNAMIC_UPSTREAM_LIST_DOWN;
+
+                } else if (var->len == 6 && ngx_strncmp(var->data, "backup", 6) == 0) {
+                    op->state = NGX_DYNAMIC_UPSTREAM_LIST_BACKUP;
+
+                } else {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "state is not up, down or backup. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
+            } else if (ngx_strcmp("arg_offset", args[i].data) == 0) {
+                op->offset = ngx_atoi(var->data, var->len);
+                if (op->offset == NGX_ERROR) {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "offset is not number. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
+            } else if (ngx_strcmp("arg_limit", args[i].data) == 0) {
+                op->limit = ngx_atoi(var->data, var->len);
+                if (op->limit == NGX_ERROR) {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "limit is not number. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
+            } else if (ngx_strcmp("arg_claim", args[i].data) == 0) {
+                op->claim.data = var->data;
+                op->claim.len = var->len;
+                op->op |= NGX_DYNAMIC_UPSTEAM_OP_CLAIM;
+
+            } else if (ngx_strcmp("arg_release", args[i].data) == 0) {
+                op->op |= NGX_DYNAMIC_UPSTEAM_OP_RELEASE;
+
+            } else if (ngx_strcmp("arg_export", args[i].data) == 0) {
+                op->export = 1;
+
+            } else if (ngx_strcmp("arg_import", args[i].data) == 0) {
+                op->import = 1;
+                op->op |= NGX_DYNAMIC_UPSTEAM_OP_REPLACE;
+
+            } else if (ngx_strcmp("arg_replicated", args[i].data) == 0) {
+                /* "epoch.generation.node" of the origin, the node has dots of a host name */
+                p = ngx_strlchr(var->data, var->data + var->len, '.');
+                q = (p != NULL) ? ngx_strlchr(p + 1, var->data + var->len, '.') : NULL;
+
+                if (q != NULL) {
+                    op->epoch = ngx_atotm(var->data, p - var->data);
+                    op->replicated = ngx_atoi(p + 1, q - p - 1);
+                    op->node.data = q + 1;
+                    op->node.len = var->data + var->len - q - 1;
+                }
+
+                if (q == NULL || op->epoch == NGX_ERROR
+                    || op->replicated == (ngx_uint_t) NGX_ERROR || op->replicated == 0
+                    || op->node.len == 0 || op->node.len > NGX_DYNAMIC_UPSTREAM_NODE)
+                {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "replicated is not epoch.generation.node. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
+            } else if (ngx_strcmp("arg_history", args[i].data) == 0) {
+                /* "history=" is all the changes kept */
+                op->history = var->len ? ngx_atoi(var->data, var->len) : NGX_DYNAMIC_UPSTREAM_HISTORY;
+                if (op->history == NGX_ERROR || op->history == 0) {
+                    op->status = NGX_HTTP_BAD_REQUEST;
+                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                                  "history is not number. %s:%d",
+                                  __FUNCTION__,
+                                  __LINE__);
+                    return NGX_ERROR;
+                }
+
             }
         }
     }
 
+    /* "zone_a,zone_b" or "zone_*" */
+    if (ngx_strlchr(op->upstream.data, op->upstream.data + op->upstream.len, ',') != NULL
+        || ngx_strlchr(op->upstream.data, op->upstream.data + op->upstream.len, '*') != NULL)
+    {
+        if (op->stream) {
+            op->status = NGX_HTTP_BAD_REQUEST;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstreams of stream are not supported. %s:%d",
+                          __FUNCTION__,
+                          __LINE__);
+            return NGX_ERROR;
+        }
+
+        op->upstreams = 1;
+    }
+
+    /* a spare upstream is claimed or released alone */
+    if (op->op & (NGX_DYNAMIC_UPSTEAM_OP_CLAIM|NGX_DYNAMIC_UPSTEAM_OP_RELEASE)) {
+        if ((op->op != NGX_DYNAMIC_UPSTEAM_OP_CLAIM && op->op != NGX_DYNAMIC_UPSTEAM_OP_RELEASE)
+            || op->stream || op->upstreams || op->server.len)
+        {
+            op->status = NGX_HTTP_BAD_REQUEST;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "claim or release with the other operations is not allowed. %s:%d",
+                          __FUNCTION__,
+                          __LINE__);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (op->export && (op->op != NGX_DYNAMIC_UPSTEAM_OP_LIST || op->stream || op->upstreams)) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "export with the other operations is not allowed. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+
+    if (op->history && (op->op != NGX_DYNAMIC_UPSTEAM_OP_LIST || op->stream || op->upstreams || op->export)) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "history with the other operations is not allowed. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+
     /* can not add and remove at once */
     if ((op->op & NGX_DYNAMIC_UPSTEAM_OP_ADD) &&
         (op->op & NGX_DYNAMIC_UPSTEAM_OP_REMOVE))
@@ -175,6 +451,35 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *
         return NGX_ERROR;
     }
 
+    /* the selectors are for remove and the parameters of the existing servers */
+    if ((op->server_cidr != NULL || op->server_prefix.len)
+        && (op->server.len || op->stream
+            || (op->op & (NGX_DYNAMIC_UPSTEAM_OP_ADD|NGX_DYNAMIC_UPSTEAM_OP_REPLACE))
+            || !(op->op & (NGX_DYNAMIC_UPSTEAM_OP_REMOVE|NGX_DYNAMIC_UPSTEAM_OP_PARAM))))
+    {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "server_cidr and server_prefix are allowed only with remove or parameters. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+
+    if (op->op & NGX_DYNAMIC_UPSTEAM_OP_REPLACE) {
+        if ((op->op & (NGX_DYNAMIC_UPSTEAM_OP_ADD|NGX_DYNAMIC_UPSTEAM_OP_REMOVE)) || op->stream) {
+            op->status = NGX_HTTP_BAD_REQUEST;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "replace with add, remove or stream is not allowed. %s:%d",
+                          __FUNCTION__,
+                          __LINE__);
+            return NGX_ERROR;
+        }
+
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_REPLACE;
+
+        return ngx_dynamic_upstream_op_parse_servers(r, op);
+    }
+
     if (op->op & NGX_DYNAMIC_UPSTEAM_OP_ADD) {
         op->op = NGX_DYNAMIC_UPSTEAM_OP_ADD;
     } else if (op->op & NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
@@ -182,7 +487,7 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *
     }
 
     /* can not up and down at once */
-    if (op->up && op->down) {
+    if (op->up && (op->down || (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN))) {
         op->status = NGX_HTTP_BAD_REQUEST;
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                       "down and up at once are not allowed. %s:%d",
@@ -191,477 +496,1451 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *
         return NGX_ERROR;
     }
 
+    ngx_dynamic_upstream_op_parse_addr(r->pool, op);
+
     return NGX_OK;
 }
 
 
-ngx_int_t
-ngx_dynamic_upstream_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
-                        ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+/*
+ * parses the server of op into the sockaddr, so that "10.0.0.1" and "10.0.0.1:80",
+ * or "[::1]:80" and "[0:0::1]:80" are the same server. the server of a name is not resolved
+ * and is compared by the name.
+ */
+void
+ngx_dynamic_upstream_op_parse_addr(ngx_pool_t *pool, ngx_dynamic_upstream_op_t *op)
 {
-    ngx_int_t  rc;
+    ngx_url_t  u;
 
-    rc = NGX_OK;
+    op->socklen = 0;
 
-    switch (op->op) {
-    case NGX_DYNAMIC_UPSTEAM_OP_ADD:
-        rc = ngx_dynamic_upstream_op_add(r, op, shpool, uscf);
-        break;
-    case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
-        rc = ngx_dynamic_upstream_op_remove(r, op, shpool, uscf);
-        break;
-#if 0
-    case NGX_DYNAMIC_UPSTEAM_OP_BACKUP:
-        break;
-#endif
-    case NGX_DYNAMIC_UPSTEAM_OP_PARAM:
-        rc = ngx_dynamic_upstream_op_update_param(r, op, shpool, uscf);
-        break;
-    case NGX_DYNAMIC_UPSTEAM_OP_LIST:
-    default:
-        rc = NGX_OK;
-        break;
+    if (op->server.len == 0) {
+        return;
     }
 
-    return rc;
-}
+    ngx_memzero(&u, sizeof(ngx_url_t));
 
-int strloc(char str1[],char str2[])
-{
-    if (strstr(str1,str2)==NULL)//找出字符串str1首次出现在str2的位置，如果找不到，返回空指针~
-        return (-1);
-    else 
-        *(strstr(str1,str2)+1)='\0';//当然，这里已经动了str2的字符串了，如果不想动原来的，可以另外用一个str3来复制str2
-    return (strlen(str1));
+    u.url = op->server;
+    u.default_port = 80;
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(pool, &u) != NGX_OK || u.naddrs != 1 || u.addrs[0].socklen > NGX_SOCKADDRLEN) {
+        return;
+    }
+
+    ngx_memcpy(op->sockaddr, u.addrs[0].sockaddr, u.addrs[0].socklen);
+    op->socklen = u.addrs[0].socklen;
 }
 
-int strloc2(char str1[],int length,char ch)
+
+/* tests whether the server of op is the server of the name and the sockaddr */
+ngx_uint_t
+ngx_dynamic_upstream_op_is_server(ngx_dynamic_upstream_op_t *op, ngx_str_t *name,
+                                  struct sockaddr *sockaddr, socklen_t socklen)
 {
-   int i=0;
-   for(;i<length;i++){
-       if(str1[i]==ch)return i;
-   }
-   return -1;
+    if (op->socklen) {
+        return ngx_cmp_sockaddr((struct sockaddr *) op->sockaddr, op->socklen, sockaddr, socklen, 1) == NGX_OK;
+    }
+
+    return op->server.len == name->len && ngx_strncmp(op->server.data, name->data, name->len) == 0;
 }
 
 
+/*
+ * parses the servers of replace in the request body. a server is in a line
+ * in the format of the list, such as "server 127.0.0.1:6001 weight=2 backup;".
+ * the parameters not given are the defaults of the server directive.
+ */
 static ngx_int_t
-ngx_dynamic_upstream_op_add(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
-                            ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+ngx_dynamic_upstream_op_parse_servers(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op)
 {
-    ngx_http_upstream_rr_peer_t   *peer, *last;
-    ngx_http_upstream_rr_peers_t  *peers;
-    ngx_url_t                      u;
-
-    // ----------------------add begin---------------------------------
-    char * cfg_file = (char *)(uscf->file_name);
-    ssize_t           n;
-    ngx_fd_t          fd;
-    fd = ngx_open_file("//opt//add.txt", NGX_FILE_WRONLY, NGX_FILE_CREATE_OR_OPEN,NGX_FILE_OWNER_ACCESS);
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "xxxxxxxxxxxxxxxxxxx.");
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_open_file_n "//opt//add.txt  failed");
-    }
-    char msg[2000];
-    strcpy(msg,"op_add:");
-    char server_data[200];
-    strncpy(server_data,(char*)(op->server.data),25);
-    //int index=strchr(server_data,"HTTP");
-    int index=strloc(server_data,"HTTP");
-    //ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"index: %d",index);
-    char serverd[50];
-    char serverd2[80];
-    strncpy(serverd,(char*)(op->server.data),index-2);
-    strcpy(serverd2,"        server ");
-    strcat(serverd2,serverd);
-    strcat(serverd2,";\n");
-    strncpy(server_data,(char*)(op->upstream.data),25);
-    //index=strloc(server_data,200,"&add");
-    index=strloc2(server_data,200,'&');
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"index: %d",index);
-    char upstreamd[50];
-    strncpy(upstreamd,(char*)(op->upstream.data),index-1);
-    char dst[index-2];
-    strncpy(dst,upstreamd,index-3);
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"serverd:dst %s %s iiiiiiiiii",serverd,dst);
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"serverd:server_data %s|%s|%s|%s9999999999999",serverd,upstreamd,op->server.data,op->upstream.data);
- 
-    FILE * pFile;
-    FILE * pf;
-    char * tmp_file="//tmp//nginx.conf";
-    pFile=fopen(cfg_file,"r");
-    pf=fopen(tmp_file,"w");
-    flock(pf->_fileno, LOCK_EX); //lock file.
-    if(pFile==NULL){
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"open nginx.conf failed.");
-    }
-    char tmp[500];
-    while(fgets(tmp,500,pFile)!=NULL){
-        fputs(tmp,pf);
-        if (strstr(tmp,upstreamd)!=NULL){
-            fputs(serverd2,pf);
-        }
-    }
-    fclose(pFile);
-    fclose(pf);
-
-    //strcat(msg,(char*)(op->server.data));
-    strcat(msg,(char*)(op->upstream.data));
-    n = ngx_write_fd(fd, msg, 1997);
-
-    if (n == -1) {
+    u_char                     *p, *last, *eol, *start;
+    u_char                      header[sizeof(NGX_DYNAMIC_UPSTREAM_EXPORT) + NGX_INT_T_LEN];
+    size_t                      len;
+    ssize_t                     n;
+    ngx_str_t                   token, value;
+    ngx_uint_t                  i, j, primary;
+    ngx_url_t                   u;
+    ngx_buf_t                  *b;
+    ngx_chain_t                *cl;
+    ngx_dynamic_upstream_op_t  *server, *servers;
+
+    if (r->request_body == NULL || r->request_body->bufs == NULL) {
+        op->status = NGX_HTTP_BAD_REQUEST;
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "ngx_write_fd error!");
+                      "replace requires the servers in the request body. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
     }
 
-    if ( ngx_close_file(fd) == NGX_FILE_ERROR ) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                  "ngx_close_file feiled.");
+    len = 0;
+
+    for (cl = r->request_body->bufs; cl; cl = cl->next) {
+        len += ngx_buf_size(cl->buf);
     }
-     
-    char cmd2[200]="mv -f ";
-    strcat(cmd2,tmp_file);
-    strcat(cmd2," ");
-    strcat(cmd2,cfg_file);
-    system(cmd2);
-    flock(pf->_fileno, LOCK_UN); //unlock file.
-    // ----------------------------------add end-----------
 
-    peers = uscf->peer.data;
-    for (peer = peers->peer, last = peer; peer; peer = peer->next) {
-        if (op->server.len == peer->name.len && ngx_strncmp(op->server.data, peer->name.data, peer->name.len) == 0) {
+    start = ngx_pnalloc(r->pool, len);
+    op->servers = ngx_array_create(r->pool, 16, sizeof(ngx_dynamic_upstream_op_t));
+    if (start == NULL || op->servers == NULL) {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        return NGX_ERROR;
+    }
+
+    /* the large body is in the temporary file */
+    p = start;
+
+    for (cl = r->request_body->bufs; cl; cl = cl->next) {
+        b = cl->buf;
+
+        if (ngx_buf_in_memory(b)) {
+            p = ngx_cpymem(p, b->pos, b->last - b->pos);
+            continue;
+        }
+
+        n = ngx_read_file(b->file, p, b->file_last - b->file_pos, b->file_pos);
+        if (n != b->file_last - b->file_pos) {
+            op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            return NGX_ERROR;
+        }
+
+        p += n;
+    }
+
+    last = p;
+
+    /* an import is of the export of the same version */
+    if (op->import) {
+        p = ngx_cpymem(header, NGX_DYNAMIC_UPSTREAM_EXPORT, sizeof(NGX_DYNAMIC_UPSTREAM_EXPORT) - 1);
+        p = ngx_sprintf(p, "%d ", NGX_DYNAMIC_UPSTREAM_EXPORT_VERSION);
+
+        if ((size_t) (last - start) < (size_t) (p - header)
+            || ngx_strncmp(start, header, p - header) != 0)
+        {
             op->status = NGX_HTTP_BAD_REQUEST;
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "server %V already exists in upstream. %s:%d",
-                          &op->server,
+                          "import requires an export of version %d. %s:%d",
+                          NGX_DYNAMIC_UPSTREAM_EXPORT_VERSION,
                           __FUNCTION__,
                           __LINE__);
             return NGX_ERROR;
         }
-        last = peer;
     }
 
-    ngx_memzero(&u, sizeof(ngx_url_t));
+    for (p = start; p < last; p = eol + 1) {
+        eol = ngx_strlchr(p, last, '\n');
+        if (eol == NULL) {
+            eol = last;
+        }
 
-    u.url.data = ngx_slab_alloc_locked(shpool, op->server.len);
-    if (u.url.data == NULL) {
-        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "failed to allocate memory from slab %s:%d",
-                      __FUNCTION__,
-                      __LINE__);
-        return NGX_ERROR;
-    }
-    ngx_cpystrn(u.url.data, op->server.data, op->server.len + 1);
-    u.url.len      = op->server.len;
-    u.default_port = 80;
+        server = NULL;
 
-    if (ngx_parse_url_slab(shpool, &u) != NGX_OK) {
-        if (u.err) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "%s in upstream \"%V\"", u.err, &u.url);
-        }
+        while (p < eol) {
 
-        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        return NGX_ERROR;
-    }
+            if (*p == ' ' || *p == '\t' || *p == '\r' || *p == ';') {
+                p++;
+                continue;
+            }
 
-    last->next = ngx_slab_calloc_locked(shpool, sizeof(ngx_http_upstream_rr_peer_t));
-    if (last->next == NULL) {
-        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "failed to allocate memory from slab %s:%d",
-                      __FUNCTION__,
-                      __LINE__);
-        return NGX_ERROR;
-    }
+            if (*p == '#') {
+                break;
+            }
 
-    last->next->name     = u.url;
-    last->next->server   = u.url;
-    last->next->sockaddr = u.addrs[0].sockaddr;
-    last->next->socklen  = u.addrs[0].socklen;
+            token.data = p;
 
-    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
-        last->next->weight = op->weight;
-        last->next->effective_weight = op->weight;
-        last->next->current_weight = 0;
-    } else {
-        last->next->weight = 1;
-        last->next->effective_weight = 1;
-        last->next->current_weight = 0;
-    }
+            while (p < eol && *p != ' ' && *p != '\t' && *p != '\r' && *p != ';') {
+                p++;
+            }
 
-    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) {
-        last->next->max_fails = op->max_fails;
-    } else {
-        last->next->max_fails = 1;
-    }
+            token.len = p - token.data;
 
-    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) {
-        last->next->fail_timeout = op->fail_timeout;
-    } else {
-        last->next->fail_timeout = 10;
-    }
+            if (server == NULL) {
+                if (token.len == 6 && ngx_strncmp(token.data, "server", 6) == 0) {
+                    continue;
+                }
 
-    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
-        last->next->down = op->down;
-    }
+                server = ngx_array_push(op->servers);
+                if (server == NULL) {
+                    op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                    return NGX_ERROR;
+                }
 
-    peers->number++;
-    peers->total_weight += last->next->weight;
-    peers->single = (peers->number == 1);
-    peers->weighted = (peers->total_weight != peers->number);
+                ngx_memzero(server, sizeof(ngx_dynamic_upstream_op_t));
 
-    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                  "added server %V", &op->server);
+                server->op = NGX_DYNAMIC_UPSTEAM_OP_ADD;
+                server->op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT
+                                   |NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS
+                                   |NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT;
+                server->status = NGX_HTTP_OK;
+                server->upstream = op->upstream;
+                server->server = token;
+                server->weight = 1;
+                server->max_fails = 1;
+                server->fail_timeout = 10;
 
-    return NGX_OK;
-}
+                ngx_dynamic_upstream_op_parse_addr(r->pool, server);
 
+                continue;
+            }
 
-static ngx_int_t
-ngx_dynamic_upstream_op_remove(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
-                               ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
-{
-    ngx_http_upstream_rr_peer_t   *peer, *target, *prev;
-    ngx_http_upstream_rr_peers_t  *peers;
-    ngx_uint_t                     weight;
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"rrrrrrrrrrrrmmmmmmmmmmmmmmvvvvvvvvvvvv");
-    char * cfg_file = (char *)(uscf->file_name);
-
-    char server_data[200];
-    strncpy(server_data,(char*)(op->server.data),25);
-    int index=strloc(server_data,"HTTP");
-    char serverd[50];
-    char serverd2[80];
-    strncpy(serverd,(char*)(op->server.data),index-2);
-    strcpy(serverd2,"        server ");
-    strcat(serverd2,serverd);
-    strcat(serverd2,"\n");
-    strncpy(server_data,(char*)(op->upstream.data),25);
-    index=strloc(server_data,"&remove");
-    char upstreamd[50];
-    strncpy(upstreamd,(char*)(op->upstream.data),index-1);
-    //ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"serverd:upstreamd %s %s",serverd,upstreamd);
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"serverd:server_data %s|%s|%s|%s9999999999999",serverd,upstreamd,op->server.data,op->upstream.data);
-
-    FILE * pFile;
-    FILE * pf;
-    char * tmp_file="//tmp//nginx.conf";
-    pFile=fopen(cfg_file,"r");
-    pf=fopen(tmp_file,"w");
-    flock(pf->_fileno, LOCK_EX);
-    if(pFile==NULL){
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"open nginx.conf failed.");
-    }
-    char tmp[500];
-    while(fgets(tmp,500,pFile)!=NULL){
-        if (strstr(tmp,serverd)==NULL){
-            fputs(tmp,pf);
-        }
-    }
-    fclose(pFile);
-    fclose(pf);
-  
-    char cmd2[200]="mv -f ";
-    strcat(cmd2,tmp_file);
-    strcat(cmd2," ");
-    strcat(cmd2,cfg_file);
-    system(cmd2);
-    flock(pf->_fileno, LOCK_UN);
-//**/
-// -------------------------------add end ----------------------------
+            if (token.len > 7 && ngx_strncmp(token.data, "weight=", 7) == 0) {
+                server->weight = ngx_atoi(token.data + 7, token.len - 7);
+                if (server->weight == NGX_ERROR || server->weight == 0) {
+                    goto invalid;
+                }
 
-    peers = uscf->peer.data;
+            } else if (token.len > 10 && ngx_strncmp(token.data, "max_fails=", 10) == 0) {
+                server->max_fails = ngx_atoi(token.data + 10, token.len - 10);
+                if (server->max_fails == NGX_ERROR) {
+                    goto invalid;
+                }
 
-    if (peers->number < 2) {
-        op->status = NGX_HTTP_BAD_REQUEST;
-        return NGX_ERROR;
-    }
+            } else if (token.len > 13 && ngx_strncmp(token.data, "fail_timeout=", 13) == 0) {
+                value.data = token.data + 13;
+                value.len = token.len - 13;
 
-    target = NULL;
-    prev = NULL;
-    for (peer = peers->peer; peer ; peer = peer->next) {
-        if (op->server.len == peer->name.len && ngx_strncmp(op->server.data, peer->name.data, peer->name.len) == 0) {
-            target = peer;
-            peer = peer->next;
-            break;
+                server->fail_timeout = ngx_parse_time(&value, 1);
+                if (server->fail_timeout == NGX_ERROR) {
+                    goto invalid;
+                }
+
+            } else if (token.len == 4 && ngx_strncmp(token.data, "down", 4) == 0) {
+                server->down = 1;
+                server->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+
+            } else if (token.len == 6 && ngx_strncmp(token.data, "backup", 6) == 0) {
+                server->backup = 1;
+
+            } else {
+                goto invalid;
+            }
         }
-        prev = peer;
     }
 
-    /* not found */
-    if (target == NULL) {
+    servers = op->servers->elts;
+    primary = 0;
+
+    for (i = 0; i < op->servers->nelts; i++) {
+        if (!servers[i].backup) {
+            primary++;
+        }
+
+        /* the invalid server is refused before any change, the name is resolved by the add */
+        if (servers[i].socklen == 0) {
+            ngx_memzero(&u, sizeof(ngx_url_t));
+
+            u.url = servers[i].server;
+            u.default_port = 80;
+            u.no_resolve = 1;
+
+            if (ngx_parse_url(r->pool, &u) != NGX_OK) {
+                op->status = NGX_HTTP_BAD_REQUEST;
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "%s in server %V. %s:%d",
+                              u.err ? u.err : "invalid address",
+                              &servers[i].server,
+                              __FUNCTION__,
+                              __LINE__);
+                return NGX_ERROR;
+            }
+        }
+
+        for (j = 0; j < i; j++) {
+            if (servers[j].socklen
+                ? ngx_dynamic_upstream_op_is_server(&servers[i], &servers[j].server,
+                                                    (struct sockaddr *) servers[j].sockaddr, servers[j].socklen)
+                : ngx_dynamic_upstream_op_is_server(&servers[j], &servers[i].server,
+                                                    (struct sockaddr *) servers[i].sockaddr, servers[i].socklen))
+            {
+                op->status = NGX_HTTP_BAD_REQUEST;
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "server %V is duplicated. %s:%d",
+                              &servers[i].server,
+                              __FUNCTION__,
+                              __LINE__);
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    /* the primary peers can not be empty */
+    if (primary == 0) {
         op->status = NGX_HTTP_BAD_REQUEST;
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "server %V is not found. %s:%d",
-                      &op->server,
+                      "replace requires a primary server. %s:%d",
                       __FUNCTION__,
                       __LINE__);
         return NGX_ERROR;
     }
-    weight = target->weight;
-    /* released removed peer and attributes */
-    if (ngx_dynamic_upstream_is_shpool_range(r, shpool, target->name.data)) {
-        ngx_slab_free_locked(shpool, target->name.data);
-    }
 
-    if (ngx_dynamic_upstream_is_shpool_range(r, shpool, target->sockaddr)) {
-        ngx_slab_free_locked(shpool, target->sockaddr);
-    }
+    return NGX_OK;
 
-    ngx_slab_free_locked(shpool, target);
+ invalid:
 
-    /* found head */
-    if (prev == NULL) {
-        peers->peer = peer;
-        goto ok;
+    op->status = NGX_HTTP_BAD_REQUEST;
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "invalid parameter \"%V\" of server %V. %s:%d",
+                  &token,
+                  &server->server,
+                  __FUNCTION__,
+                  __LINE__);
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                        ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t  rc;
+
+    rc = NGX_OK;
+
+    if (ngx_dynamic_upstream_balancer_fixed(uscf)
+        && ((op->op & (NGX_DYNAMIC_UPSTEAM_OP_ADD|NGX_DYNAMIC_UPSTEAM_OP_REMOVE|NGX_DYNAMIC_UPSTEAM_OP_REPLACE))
+            || (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN)))
+    {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "the servers of upstream \"%V\" with random are not added or removed "
+                      "with this version of nginx. %s:%d",
+                      &uscf->host,
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
     }
 
-    /* found tail */
-    if (peer == NULL) {
-        prev->next = NULL;
-        goto ok;
+    if (op->server_cidr != NULL || op->server_prefix.len) {
+        return ngx_dynamic_upstream_op_select(r, op, shpool, uscf);
     }
 
-    /* found inside */
-    prev->next = peer;
+    switch (op->op) {
+    case NGX_DYNAMIC_UPSTEAM_OP_ADD:
+        rc = ngx_dynamic_upstream_op_add_peer(r, op, shpool, uscf);
+        break;
+    case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
+        rc = ngx_dynamic_upstream_op_remove_peer(r, op, shpool, uscf);
+        break;
+    case NGX_DYNAMIC_UPSTEAM_OP_PARAM:
+        rc = ngx_dynamic_upstream_op_param(r, op, shpool, uscf);
+        break;
+    case NGX_DYNAMIC_UPSTEAM_OP_REPLACE:
+        rc = ngx_dynamic_upstream_op_replace(r, op, shpool, uscf);
+        break;
+    case NGX_DYNAMIC_UPSTEAM_OP_LIST:
+    default:
+        rc = NGX_OK;
+        break;
+    }
 
- ok:
-    peers->number--;
-    peers->total_weight -= weight;
-    peers->single = (peers->number == 1);
-    peers->weighted = (peers->total_weight != peers->number);
+    return rc;
+}
 
-    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                  "removed server %V", &op->server);
+void
+ngx_dynamic_upstream_op_set_weight(ngx_http_upstream_rr_peer_t *peer, ngx_int_t weight)
+{
+    peer->weight = weight;
+    peer->effective_weight = weight;
+}
 
-    return NGX_OK;
+
+/*
+ * recalculates the aggregates after weights are changed.
+ * the smooth weighted round robin keeps the sum of current_weight zero,
+ * current_weight are restarted from zero not to give a burst to the changed peer.
+ */
+void
+ngx_dynamic_upstream_op_recalc_weight(ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                    w;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    w = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        peer->current_weight = 0;
+        w += peer->weight;
+    }
+
+    peers->total_weight = w;
+    peers->weighted = (peers->total_weight != peers->number);
+
+    ngx_dynamic_upstream_balancer_changed(peers);
 }
 
 
-static ngx_int_t
-ngx_dynamic_upstream_op_update_param(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
-                                     ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+/*
+ * finds the server of op in the primary peers and then in the backup peers.
+ * only the backup peers are searched with "backup".
+ * the peer of the address is found in the index of the zone, and then
+ * the list and prev are found by the pointer.
+ */
+static ngx_http_upstream_rr_peer_t *
+ngx_dynamic_upstream_op_find_peer(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_op_t *op,
+                                  ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t **list,
+                                  ngx_http_upstream_rr_peer_t **prev)
 {
-    ngx_http_upstream_rr_peer_t   *peer, *target;
-    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_http_upstream_rr_peer_t        *peer, *p, *found;
+    ngx_http_upstream_rr_peers_t       *l;
+    ngx_dynamic_upstream_peer_state_t  *ps;
 
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,"vvvvvvvvvvvvvvvvvvvvvVVVVVVV");
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,"sssssssss:%s", (u_char *)(uscf->file_name));
-    char * cfg_file = (char *)(uscf->file_name);
+    found = NULL;
 
-    char server_data[200];
-    strncpy(server_data,(char*)(op->server.data),25);
+    if (sh != NULL && op->socklen) {
+        ps = ngx_dynamic_upstream_state_lookup_addr(sh, (struct sockaddr *) op->sockaddr);
+        if (ps == NULL) {
+            return NULL;
+        }
 
-    peers = uscf->peer.data;
+        found = ps->peer;
+    }
 
-    target = NULL;
-    for (peer = peers->peer; peer ; peer = peer->next) {
-        if (op->server.len == peer->name.len && ngx_strncmp(op->server.data, peer->name.data, peer->name.len) == 0) {
-            target = peer;
-            break;
+ again:
+
+    for (l = op->backup ? peers->next : peers; l; l = l->next) {
+        p = NULL;
+
+        for (peer = l->peer; peer; peer = peer->next) {
+            if (found != NULL
+                ? peer == found
+                : ngx_dynamic_upstream_op_is_server(op, &peer->name, peer->sockaddr, peer->socklen))
+            {
+                *list = l;
+
+                if (prev) {
+                    *prev = p;
+                }
+
+                return peer;
+            }
+
+            p = peer;
         }
     }
 
-    if (target == NULL) {
+    /* the indexed peer is a primary server of the same address as the backup server */
+    if (found != NULL) {
+        found = NULL;
+        goto again;
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_op_add_peer(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                 ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_http_upstream_rr_peer_t        *peer, *last;
+    ngx_http_upstream_rr_peers_t       *peers, *list;
+    ngx_dynamic_upstream_op_t           any;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+    ngx_url_t                           u;
+    ngx_int_t                           rc;
+    ngx_uint_t                          created;
+
+    peers = uscf->peer.data;
+    created = 0;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    /* the same address in the primary and the backup peers is a duplicate as well */
+    any = *op;
+    any.backup = 0;
+
+    if (ngx_dynamic_upstream_op_find_peer(dus->sh, &any, peers, &list, NULL) != NULL) {
         op->status = NGX_HTTP_BAD_REQUEST;
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "server %V is not found. %s:%d",
+                      "server %V already exists in upstream. %s:%d",
                       &op->server,
                       __FUNCTION__,
                       __LINE__);
         return NGX_ERROR;
     }
 
+    /* the first backup server of the upstream without backup servers */
+    if (op->backup && peers->next == NULL) {
+        peers->next = ngx_slab_calloc_locked(shpool, sizeof(ngx_http_upstream_rr_peers_t));
+        if (peers->next == NULL) {
+            op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "failed to allocate memory from slab %s:%d",
+                          __FUNCTION__,
+                          __LINE__);
+            return NGX_ERROR;
+        }
+
+        peers->next->shpool = shpool;
+        peers->next->name   = peers->name;
+
+        created = 1;
+    }
+
+    list = op->backup ? peers->next : peers;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url.data = ngx_slab_alloc_locked(shpool, op->server.len);
+    if (u.url.data == NULL) {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "failed to allocate memory from slab %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        goto failed;
+    }
+    ngx_cpystrn(u.url.data, op->server.data, op->server.len + 1);
+    u.url.len      = op->server.len;
+    u.default_port = 80;
+
+    if (ngx_parse_url_slab(shpool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "%s in upstream \"%V\"", u.err, &u.url);
+        }
+
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        goto failed_url;
+    }
+
+    peer = ngx_slab_calloc_locked(shpool, sizeof(ngx_http_upstream_rr_peer_t));
+    if (peer == NULL) {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "failed to allocate memory from slab %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        goto failed_url;
+    }
+
+    peer->name     = u.url;
+    peer->server   = u.url;
+    peer->sockaddr = u.addrs[0].sockaddr;
+    peer->socklen  = u.addrs[0].socklen;
+
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
-        target->weight = op->weight;
-        target->current_weight = op->weight;
-        target->effective_weight = op->weight;
+        peer->weight = op->weight;
+        peer->effective_weight = op->weight;
+        peer->current_weight = 0;
+    } else {
+        peer->weight = 1;
+        peer->effective_weight = 1;
+        peer->current_weight = 0;
     }
 
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) {
-        target->max_fails = op->max_fails;
+        peer->max_fails = op->max_fails;
+    } else {
+        peer->max_fails = 1;
     }
 
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) {
-        target->fail_timeout = op->fail_timeout;
+        peer->fail_timeout = op->fail_timeout;
+    } else {
+        peer->fail_timeout = 10;
     }
-    
-    char serverd[50];
-    char serverd2[80];
 
-    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) {
-        target->down = 0;
-        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                      "downed server %V", &op->server);
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,"downed server %V",&op->server);
-        //strcat(serverd2," up\n");
-        int index=strloc(server_data,"&up");
-        strncpy(serverd,(char*)(op->server.data),index-1);
-        strcpy(serverd2,"        server ");
-        strcat(serverd2,serverd);
-        strcat(serverd2,";\n");
-        strncpy(server_data,(char*)(op->upstream.data),25);
-        index=strloc(server_data,"&server");
-        char upstreamd[50];
-        strncpy(upstreamd,(char*)(op->upstream.data),index-1);
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
+        peer->down = op->down;
+    }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"serverd:server_data %s|%s|%s|%s9999999999999",serverd,upstreamd,op->server.data,op->upstream.data);
+    if (dus->sh != NULL && ngx_dynamic_upstream_state_add_locked(shpool, dus->sh, peer) != NGX_OK) {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "failed to allocate memory from slab %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        goto failed_peer;
     }
 
-    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
-        target->down = 1;
-        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
-                      "upped server %V", &op->server);
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,"upped server %V",&op->server);
-        //strcat(serverd2," down\n");
-        int index=strloc(server_data,"&down");
-        strncpy(serverd,(char*)(op->server.data),index-1);
-        strcpy(serverd2,"        server ");
-        strcat(serverd2,serverd);
-        strcat(serverd2," down;\n");
-        strncpy(server_data,(char*)(op->upstream.data),25);
-        index=strloc(server_data,"&server");
-        char upstreamd[50];
-        strncpy(upstreamd,(char*)(op->upstream.data),index-1);
-
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"serverd:server_data %s|%s|%s|%s9999999999999",serverd,upstreamd,op->server.data,op->upstream.data);
-    }
- 
-    FILE * pFile;
-    FILE * pf;
-    char * tmp_file="//tmp//nginx.conf";
-    //pFile=fopen("//usr//local//nginx//conf//nginx.conf","r");
-    pFile=fopen(cfg_file,"r");
-    pf=fopen(tmp_file,"w");
-    flock(pf->_fileno, LOCK_EX);
-    if(pFile==NULL){
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,"open nginx.conf failed.");
-    }
-    char tmp[500];
-    while(fgets(tmp,500,pFile)!=NULL){
-        if (strstr(tmp,serverd)!=NULL){
-            fputs(serverd2,pf);
-        }else{
-            fputs(tmp,pf);
-        }
-    }
-    fclose(pFile);
-    fclose(pf);    
-
-    /**char cmd[100]="rm -f ";
-    strcat(cmd,cfg_file);
-    system(cmd);**/
-    char cmd2[200]="mv -f ";
-    strcat(cmd2,tmp_file);
-    strcat(cmd2," ");
-    strcat(cmd2,cfg_file);
-    system(cmd2);
-    flock(pf->_fileno, LOCK_UN);
-    //system("mv //usr//local//nginx//conf//nginx2.conf //usr//local//nginx//conf//nginx.conf");
+    /* the backup servers have no points */
+    if (!op->backup && dus->sh != NULL) {
+        rc = ngx_dynamic_upstream_chash_add_locked(dus->sh, peer);
+        if (rc != NGX_OK) {
+            op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          rc == NGX_DECLINED
+                          ? "no room for consistent hash points of %V, see dynamic_upstream_hash_points. %s:%d"
+                          : "failed to allocate consistent hash points of %V %s:%d",
+                          &op->server,
+                          __FUNCTION__,
+                          __LINE__);
+            goto failed_state;
+        }
+    }
+
+    /* the peer starts with the weight 1 and is ramped by the timer */
+    if (op->slow_start && dus->sh != NULL) {
+        ps = ngx_dynamic_upstream_state_lookup(dus->sh, peer);
+        if (ps != NULL) {
+            ngx_dynamic_upstream_weight_slow_start(dus->sh, ps, (ngx_msec_t) op->slow_start * 1000);
+        }
+    }
+
+    /* every worker opens the connections on its tick */
+    if (op->warm && !peer->down && dus->sh != NULL) {
+        ngx_dynamic_upstream_keepalive_warm_locked(dus->sh, peer, op->warm);
+    }
+
+    for (last = list->peer; last && last->next; last = last->next) { /* void */ }
+
+    if (last == NULL) {
+        list->peer = peer;
+    } else {
+        last->next = peer;
+    }
+
+    list->number++;
+    list->total_weight += peer->weight;
+#if (NGX_DYNAMIC_UPSTREAM_TRIES)
+    /* a backup list created by the API starts with no tries */
+    list->tries++;
+#endif
+    list->single = (list == peers && list->number == 1);
+    list->weighted = (list->total_weight != list->number);
+
+    ngx_dynamic_upstream_balancer_changed(peers);
+
+    ngx_dynamic_upstream_history_record_locked(r, dus->sh, NGX_DYNAMIC_UPSTEAM_OP_ADD, op->backup, peer, NULL);
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "added %sserver %V", op->backup ? "backup " : "", &op->server);
 
     return NGX_OK;
+
+    /* the allocations are freed in the reverse order on every failure */
+
+ failed_state:
+
+    ngx_dynamic_upstream_state_remove_locked(shpool, dus->sh, peer);
+
+ failed_peer:
+
+    ngx_slab_free_locked(shpool, peer);
+
+ failed_url:
+
+    ngx_dynamic_upstream_op_free_url(shpool, &u);
+
+ failed:
+
+    if (created) {
+        ngx_slab_free_locked(shpool, peers->next);
+        peers->next = NULL;
+    }
+
+    return NGX_ERROR;
+}
+
+
+/* frees the url parsed into the slab, the addresses with their names and the url itself */
+static void
+ngx_dynamic_upstream_op_free_url(ngx_slab_pool_t *shpool, ngx_url_t *u)
+{
+    ngx_uint_t  i;
+
+    if (u->addrs != NULL) {
+        for (i = 0; i < u->naddrs; i++) {
+            if (u->addrs[i].name.data != NULL) {
+                ngx_slab_free_locked(shpool, u->addrs[i].name.data);
+            }
+
+            if (u->addrs[i].sockaddr != NULL) {
+                ngx_slab_free_locked(shpool, u->addrs[i].sockaddr);
+            }
+        }
+
+        ngx_slab_free_locked(shpool, u->addrs);
+    }
+
+    ngx_slab_free_locked(shpool, u->url.data);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_op_remove_peer(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                    ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                         rc;
+    ngx_http_upstream_rr_peer_t      *target, *prev;
+    ngx_http_upstream_rr_peers_t     *peers, *list;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    peers = uscf->peer.data;
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    prev = NULL;
+    target = ngx_dynamic_upstream_op_find_peer(dus->sh, op, peers, &list, &prev);
+
+    /* not found */
+    if (target == NULL) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "server %V is not found. %s:%d",
+                      &op->server,
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+
+    /* the primary peers can not be empty */
+    if (list == peers && peers->number < 2) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        return NGX_ERROR;
+    }
+
+    rc = ngx_dynamic_upstream_op_remove_target(r, op, shpool, uscf, list, prev, target);
+
+    return (rc == NGX_DONE) ? NGX_OK : rc;
+}
+
+
+/* removes the peer following prev in the list, NGX_DONE if the peer is drained instead */
+static ngx_int_t
+ngx_dynamic_upstream_op_remove_target(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                      ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf,
+                                      ngx_http_upstream_rr_peers_t *list, ngx_http_upstream_rr_peer_t *prev,
+                                      ngx_http_upstream_rr_peer_t *target)
+{
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    peers = uscf->peer.data;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    ngx_dynamic_upstream_history_record_locked(r, dus->sh, NGX_DYNAMIC_UPSTEAM_OP_REMOVE, list != peers, target, NULL);
+
+    /*
+     * the balancers release the peer at the end of the request,
+     * so the peer in use is drained instead.
+     */
+    if (target->conns && dus->sh != NULL) {
+        ps = ngx_dynamic_upstream_state_lookup(dus->sh, target);
+        if (ps != NULL) {
+            ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                          "removing %sserver %V after %ui connections",
+                          list != peers ? "backup " : "", &op->server, target->conns);
+
+            ngx_dynamic_upstream_drain_start(dus->sh, ps, 0);
+            return NGX_DONE;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "removed %sserver %V", list != peers ? "backup " : "", &op->server);
+
+    ngx_dynamic_upstream_op_free_peer(shpool, dus->sh, peers, list, prev, target);
+
+    return NGX_OK;
+}
+
+
+/* unlinks the peer following prev in the list and releases it */
+void
+ngx_dynamic_upstream_op_free_peer(ngx_slab_pool_t *shpool, ngx_dynamic_upstream_shctx_t *sh,
+                                  ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *list,
+                                  ngx_http_upstream_rr_peer_t *prev, ngx_http_upstream_rr_peer_t *target)
+{
+    ngx_dynamic_upstream_op_unlink_peer(shpool, sh, peers, list, prev, target);
+    ngx_dynamic_upstream_op_release_peer(shpool, target);
+}
+
+
+/* the peer is not selected any more, but it is still valid for the balancers holding it */
+void
+ngx_dynamic_upstream_op_unlink_peer(ngx_slab_pool_t *shpool, ngx_dynamic_upstream_shctx_t *sh,
+                                    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *list,
+                                    ngx_http_upstream_rr_peer_t *prev, ngx_http_upstream_rr_peer_t *target)
+{
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_uint_t                    weight;
+
+    peer = target->next;
+    weight = target->weight;
+
+    if (sh != NULL) {
+        if (list == peers) {
+            ngx_dynamic_upstream_chash_remove_locked(sh, peers, target);
+        }
+
+        ngx_dynamic_upstream_keepalive_evict_locked(sh, target);
+        ngx_dynamic_upstream_state_remove_locked(shpool, sh, target);
+    }
+
+    /* found head */
+    if (prev == NULL) {
+        list->peer = peer;
+        goto ok;
+    }
+
+    /* found tail */
+    if (peer == NULL) {
+        prev->next = NULL;
+        goto ok;
+    }
+
+    /* found inside */
+    prev->next = peer;
+
+ ok:
+    list->number--;
+    list->total_weight -= weight;
+#if (NGX_DYNAMIC_UPSTREAM_TRIES)
+    /* the tries are not more than the servers left */
+    list->tries = ngx_min(list->tries, list->number);
+#endif
+    list->single = (list == peers && list->number == 1);
+    list->weighted = (list->total_weight != list->number);
+
+    ngx_dynamic_upstream_balancer_changed(peers);
+}
+
+
+/* releases the peer unlinked and its attributes */
+void
+ngx_dynamic_upstream_op_release_peer(ngx_slab_pool_t *shpool, ngx_http_upstream_rr_peer_t *target)
+{
+    if (ngx_dynamic_upstream_is_shpool_range(NULL, shpool, target->name.data)) {
+        ngx_slab_free_locked(shpool, target->name.data);
+    }
+
+    if (ngx_dynamic_upstream_is_shpool_range(NULL, shpool, target->sockaddr)) {
+        ngx_slab_free_locked(shpool, target->sockaddr);
+    }
+
+    ngx_slab_free_locked(shpool, target);
+}
+
+
+/*
+ * applies the parameters of op to the peer in the list.
+ * recalc is set when the weights of the list are to be recalculated by the caller,
+ * so that the servers of a selector are recalculated at once.
+ */
+static ngx_int_t
+ngx_dynamic_upstream_op_apply_param(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *list,
+                                    ngx_http_upstream_rr_peer_t *target, ngx_uint_t *recalc)
+{
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_dynamic_upstream_params_t       old;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    peers = uscf->peer.data;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    ps = (dus->sh != NULL) ? ngx_dynamic_upstream_state_lookup(dus->sh, target) : NULL;
+
+    if (dus->sh != NULL) {
+        ngx_dynamic_upstream_history_params_locked(dus->sh, target, &old);
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
+
+        /* the weight adjustments start from the new weight */
+        if (ps != NULL) {
+            ps->weight = op->weight;
+            ps->target = op->weight;
+        }
+
+        if (ps != NULL && ps->slow_start) {
+            ngx_dynamic_upstream_op_set_weight(target, ngx_dynamic_upstream_weight_ramp(dus->sh, ps, op->weight));
+        } else {
+            ngx_dynamic_upstream_op_set_weight(target, op->weight);
+        }
+
+        *recalc = 1;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) {
+        target->max_fails = op->max_fails;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) {
+        target->fail_timeout = op->fail_timeout;
+
+        /* the backoff starts over from the new fail_timeout */
+        if (ps != NULL) {
+            ps->fail_timeout = op->fail_timeout;
+            ps->backoff = 0;
+        }
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN) {
+
+        /* the primary peers can not be empty */
+        if (ps == NULL || (list == peers && peers->number < 2)) {
+            op->status = NGX_HTTP_BAD_REQUEST;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "server %V can not be drained. %s:%d",
+                          &op->server,
+                          __FUNCTION__,
+                          __LINE__);
+            return NGX_ERROR;
+        }
+
+        ngx_dynamic_upstream_drain_start(dus->sh, ps, (ngx_msec_t) op->drain * 1000);
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "draining server %V", &op->server);
+    }
+    
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) {
+
+        /* the peer coming back is ramped as well as the added peer */
+        if (target->down && op->slow_start && ps != NULL) {
+            ngx_dynamic_upstream_weight_slow_start(dus->sh, ps, (ngx_msec_t) op->slow_start * 1000);
+            *recalc = 1;
+        }
+
+        if (ps != NULL) {
+            ngx_dynamic_upstream_drain_cancel(dus->sh, ps);
+            ps->check_down = 0;
+        }
+
+        target->down = 0;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
+
+        /* the server down by the API is not upped by the checks */
+        if (ps != NULL) {
+            ps->check_down = 0;
+        }
+
+        if (!target->down && dus->sh != NULL) {
+            ngx_dynamic_upstream_keepalive_evict_locked(dus->sh, target);
+        }
+
+        target->down = 1;
+    }
+
+    ngx_dynamic_upstream_history_record_locked(r, dus->sh, NGX_DYNAMIC_UPSTEAM_OP_PARAM, list != peers, target, &old);
+
+    return NGX_OK;
+}
+
+
+/* applies the parameters to the server of op */
+static ngx_int_t
+ngx_dynamic_upstream_op_param(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                              ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                        recalc;
+    ngx_http_upstream_rr_peer_t      *target;
+    ngx_http_upstream_rr_peers_t     *peers, *list;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    peers = uscf->peer.data;
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    target = ngx_dynamic_upstream_op_find_peer(dus->sh, op, peers, &list, NULL);
+
+    if (target == NULL) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "server %V is not found. %s:%d",
+                      &op->server,
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+
+    recalc = 0;
+
+    if (ngx_dynamic_upstream_op_apply_param(r, op, uscf, list, target, &recalc) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (recalc) {
+        ngx_dynamic_upstream_op_recalc_weight(list);
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) {
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "upped server %V", &op->server);
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "downed server %V", &op->server);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_op_changed(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op, ngx_int_t what,
+                                ngx_str_t *server, ngx_int_t backup)
+{
+    ngx_dynamic_upstream_change_t  *change;
+
+    change = ngx_array_push(op->changes);
+    if (change == NULL) {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        return NGX_ERROR;
+    }
+
+    change->op = what;
+    change->backup = backup;
+    change->server = *server;
+
+    return NGX_OK;
+}
+
+
+/*
+ * makes the servers same as the servers of the request body in the critical section.
+ * only the servers differing are touched, and the others keep their states
+ * such as fails, conns and current_weight.
+ * the servers are validated by the parse, the changes made before a failure of the resolver
+ * or the slab are kept in op->changes and committed as a generation by the caller.
+ */
+static ngx_int_t
+ngx_dynamic_upstream_op_replace(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                           rc;
+    ngx_uint_t                          i, n, changed, recalc;
+    ngx_str_t                           name;
+    ngx_http_upstream_rr_peer_t        *peer, *prev, *next, *target, **kept;
+    ngx_http_upstream_rr_peers_t       *peers, *list;
+    ngx_dynamic_upstream_op_t          *server, *servers, any, remove;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    peers = uscf->peer.data;
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    servers = op->servers->elts;
+
+    op->changes = ngx_array_create(r->pool, 4, sizeof(ngx_dynamic_upstream_change_t));
+    kept = ngx_palloc(r->pool, sizeof(ngx_http_upstream_rr_peer_t *) * op->servers->nelts);
+    if (op->changes == NULL || kept == NULL) {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    /* nothing is changed when a server moves between the primary and the backup peers */
+    for (i = 0; i < op->servers->nelts; i++) {
+        any = servers[i];
+        any.backup = 0;
+
+        target = ngx_dynamic_upstream_op_find_peer(dus->sh, &any, peers, &list, NULL);
+
+        if (target != NULL && (list != peers) != (servers[i].backup != 0)) {
+            op->status = NGX_HTTP_BAD_REQUEST;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "server %V can not be moved between primary and backup. %s:%d",
+                          &servers[i].server,
+                          __FUNCTION__,
+                          __LINE__);
+            return NGX_ERROR;
+        }
+    }
+
+    /* added first not to empty the primary peers */
+    for (i = 0; i < op->servers->nelts; i++) {
+        server = &servers[i];
+
+        target = ngx_dynamic_upstream_op_find_peer(dus->sh, server, peers, &list, NULL);
+
+        if (target == NULL) {
+            if (ngx_dynamic_upstream_op_add_peer(r, server, shpool, uscf) != NGX_OK) {
+                op->status = server->status;
+                return NGX_ERROR;
+            }
+
+            target = ngx_dynamic_upstream_op_find_peer(dus->sh, server, peers, &list, NULL);
+            if (target != NULL) {
+                kept[n++] = target;
+            }
+
+            if (ngx_dynamic_upstream_op_changed(r, op, NGX_DYNAMIC_UPSTEAM_OP_ADD, &server->server, server->backup)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        kept[n++] = target;
+
+        ps = (dus->sh != NULL) ? ngx_dynamic_upstream_state_lookup(dus->sh, target) : NULL;
+
+        server->op_param = 0;
+
+        if (server->weight != (ps ? ps->weight : target->weight)) {
+            server->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT;
+        }
+
+        if ((ngx_uint_t) server->max_fails != target->max_fails) {
+            server->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS;
+        }
+
+        if (server->fail_timeout != (ps ? ps->fail_timeout : target->fail_timeout)) {
+            server->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT;
+        }
+
+        /* the server in the list stays */
+        changed = 0;
+
+        if (ps != NULL && ps->drain) {
+            ngx_dynamic_upstream_drain_cancel(dus->sh, ps);
+            changed = 1;
+        }
+
+        if (server->down) {
+            if (!target->down || (ps != NULL && ps->check_down)) {
+                server->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+            }
+
+        } else if (target->down && (ps == NULL || !ps->check_down)) {
+            /* the server down by the checks is upped by the checks */
+            server->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+        }
+
+        if (server->op_param == 0 && !changed) {
+            continue;
+        }
+
+        recalc = 0;
+
+        if (server->op_param
+            && ngx_dynamic_upstream_op_apply_param(r, server, uscf, list, target, &recalc) != NGX_OK)
+        {
+            op->status = server->status;
+            return NGX_ERROR;
+        }
+
+        if (recalc) {
+            ngx_dynamic_upstream_op_recalc_weight(list);
+        }
+
+        if (ngx_dynamic_upstream_op_changed(r, op, NGX_DYNAMIC_UPSTEAM_OP_PARAM, &server->server, server->backup)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    /* the peers not kept are removed, looked up in the sorted pointers for the large imports */
+    ngx_qsort(kept, n, sizeof(ngx_http_upstream_rr_peer_t *), ngx_dynamic_upstream_op_cmp_peers);
+
+    for (list = peers; list; list = list->next) {
+        prev = NULL;
+
+        for (peer = list->peer; peer; peer = next) {
+            next = peer->next;
+
+            if (ngx_dynamic_upstream_op_kept(kept, n, peer)) {
+                prev = peer;
+                continue;
+            }
+
+            ps = (dus->sh != NULL) ? ngx_dynamic_upstream_state_lookup(dus->sh, peer) : NULL;
+
+            /* the draining server is being removed */
+            if (ps != NULL && ps->drain) {
+                prev = peer;
+                continue;
+            }
+
+            /* the primary peers can not be empty */
+            if (list == peers && peers->number < 2) {
+                op->status = NGX_HTTP_BAD_REQUEST;
+                return NGX_ERROR;
+            }
+
+            /* the name is released with the peer */
+            name.data = ngx_pstrdup(r->pool, &peer->name);
+            if (name.data == NULL) {
+                op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                return NGX_ERROR;
+            }
+
+            name.len = peer->name.len;
+
+            ngx_memzero(&remove, sizeof(ngx_dynamic_upstream_op_t));
+            remove.op = NGX_DYNAMIC_UPSTEAM_OP_REMOVE;
+            remove.status = NGX_HTTP_OK;
+            remove.backup = (list != peers);
+            remove.upstream = op->upstream;
+            remove.server = name;
+
+            /* the peer itself is removed, the name may be duplicated by the resolved servers */
+            rc = ngx_dynamic_upstream_op_remove_target(r, &remove, shpool, uscf, list, prev, peer);
+
+            /* the drained peer stays in the list */
+            if (rc == NGX_DONE) {
+                prev = peer;
+                rc = NGX_OK;
+            }
+
+            if (rc != NGX_OK) {
+                op->status = remove.status;
+                return NGX_ERROR;
+            }
+
+            if (ngx_dynamic_upstream_op_changed(r, op, NGX_DYNAMIC_UPSTEAM_OP_REMOVE, &name, remove.backup)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_op_kept(ngx_http_upstream_rr_peer_t **kept, ngx_uint_t n, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t  i, j, k;
+
+    i = 0;
+    j = n;
+
+    while (i < j) {
+        k = (i + j) / 2;
+
+        if ((uintptr_t) peer > (uintptr_t) kept[k]) {
+            i = k + 1;
+
+        } else if ((uintptr_t) peer < (uintptr_t) kept[k]) {
+            j = k;
+
+        } else {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int ngx_libc_cdecl
+ngx_dynamic_upstream_op_cmp_peers(const void *one, const void *two)
+{
+    uintptr_t  first, second;
+
+    first = (uintptr_t) *(ngx_http_upstream_rr_peer_t **) one;
+    second = (uintptr_t) *(ngx_http_upstream_rr_peer_t **) two;
+
+    if (first < second) {
+        return -1;
+
+    } else if (first > second) {
+        return 1;
+
+    } else {
+        return 0;
+    }
+}
+
+
+/*
+ * removes or updates the servers matching server_cidr or server_prefix,
+ * such as the servers of a rack, in a pass under the lock.
+ */
+static ngx_int_t
+ngx_dynamic_upstream_op_select(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                               ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                      rc;
+    ngx_uint_t                     n, recalc;
+    ngx_str_t                      name;
+    ngx_http_upstream_rr_peer_t   *peer, *prev, *next;
+    ngx_http_upstream_rr_peers_t  *peers, *list;
+    ngx_dynamic_upstream_op_t      one;
+
+    peers = uscf->peer.data;
+
+    op->changes = ngx_array_create(r->pool, 16, sizeof(ngx_dynamic_upstream_change_t));
+    if (op->changes == NULL) {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        return NGX_ERROR;
+    }
+
+    /* the primary peers can not be empty */
+    if (!op->backup
+        && (op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE || (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN)))
+    {
+        n = 0;
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+            n += ngx_dynamic_upstream_op_match(op, peer);
+        }
+
+        if (n == peers->number) {
+            op->status = NGX_HTTP_BAD_REQUEST;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "all the primary servers are selected. %s:%d",
+                          __FUNCTION__,
+                          __LINE__);
+            return NGX_ERROR;
+        }
+    }
+
+    for (list = op->backup ? peers->next : peers; list; list = list->next) {
+        recalc = 0;
+        prev = NULL;
+
+        for (peer = list->peer; peer; peer = next) {
+            next = peer->next;
+
+            if (!ngx_dynamic_upstream_op_match(op, peer)) {
+                prev = peer;
+                continue;
+            }
+
+            /* the name is released with the removed peer */
+            name.data = ngx_pstrdup(r->pool, &peer->name);
+            if (name.data == NULL) {
+                op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                return NGX_ERROR;
+            }
+
+            name.len = peer->name.len;
+
+            one = *op;
+            one.server = name;
+            one.backup = (list != peers);
+
+            if (op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE) {
+                rc = ngx_dynamic_upstream_op_remove_target(r, &one, shpool, uscf, list, prev, peer);
+
+                /* the drained peer stays in the list */
+                if (rc == NGX_DONE) {
+                    prev = peer;
+                    rc = NGX_OK;
+                }
+
+            } else {
+                rc = ngx_dynamic_upstream_op_apply_param(r, &one, uscf, list, peer, &recalc);
+                prev = peer;
+            }
+
+            if (rc != NGX_OK) {
+                op->status = one.status;
+                return NGX_ERROR;
+            }
+
+            if (ngx_dynamic_upstream_op_changed(r, op, op->op, &name, one.backup) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (recalc) {
+            ngx_dynamic_upstream_op_recalc_weight(list);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* matches the address of the peer with server_cidr, or the name with server_prefix */
+static ngx_uint_t
+ngx_dynamic_upstream_op_match(ngx_dynamic_upstream_op_t *op, ngx_http_upstream_rr_peer_t *peer)
+{
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    ngx_uint_t            i;
+    struct sockaddr_in6  *sin6;
+#endif
+
+    if (op->server_prefix.len
+        && (peer->name.len < op->server_prefix.len
+            || ngx_strncmp(peer->name.data, op->server_prefix.data, op->server_prefix.len) != 0))
+    {
+        return 0;
+    }
+
+    if (op->server_cidr == NULL) {
+        return 1;
+    }
+
+    if (peer->sockaddr->sa_family != op->server_cidr->family) {
+        return 0;
+    }
+
+    switch (op->server_cidr->family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) peer->sockaddr;
+
+        for (i = 0; i < 16; i++) {
+            if ((sin6->sin6_addr.s6_addr[i] & op->server_cidr->u.in6.mask.s6_addr[i])
+                != op->server_cidr->u.in6.addr.s6_addr[i])
+            {
+                return 0;
+            }
+        }
+
+        return 1;
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) peer->sockaddr;
+
+        return (sin->sin_addr.s_addr & op->server_cidr->u.in.mask) == op->server_cidr->u.in.addr;
+
+    default:
+        return 0;
+    }
+}
+
+
+/* renders the changes by replace or a selector, "added server 127.0.0.1:6003;" in a line */
+ngx_buf_t *
+ngx_dynamic_upstream_op_render_changes(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op)
+{
+    size_t                          size;
+    ngx_uint_t                      i;
+    ngx_buf_t                      *b;
+    ngx_dynamic_upstream_change_t  *changes;
+    char                           *what;
+
+    changes = op->changes->elts;
+    size = 0;
+
+    for (i = 0; i < op->changes->nelts; i++) {
+        size += sizeof("updated server  backup;\n") - 1 + changes[i].server.len;
+    }
+
+    b = ngx_create_temp_buf(r->pool, size ? size : 1);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < op->changes->nelts; i++) {
+
+        switch (changes[i].op) {
+        case NGX_DYNAMIC_UPSTEAM_OP_ADD:
+            what = "added";
+            break;
+        case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
+            what = "removed";
+            break;
+        default:
+            what = "updated";
+            break;
+        }
+
+        b->last = ngx_sprintf(b->last, "%s server %V%s;\n",
+                              what, &changes[i].server, changes[i].backup ? " backup" : "");
+    }
+
+    return b;
 }
@@ -5,26 +5,25 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
-
-typedef struct ngx_dynamic_upstream_op_t {
-    ngx_int_t verbose;
-    ngx_int_t op;
-    ngx_int_t op_param;
-    ngx_int_t backup;
-    ngx_int_t weight;
-    ngx_int_t max_fails;
-    ngx_int_t fail_timeout;
-    ngx_int_t up;
-    ngx_int_t down;
-    ngx_str_t upstream;
-    ngx_str_t server;
-    ngx_uint_t status;
-} ngx_dynamic_upstream_op_t;
+#include "ngx_dynamic_upstream_module.h"
 
 
 ngx_int_t ngx_dynamic_upstream_build_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op);
 ngx_int_t ngx_dynamic_upstream_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
                                   ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
+void ngx_dynamic_upstream_op_set_weight(ngx_http_upstream_rr_peer_t *peer, ngx_int_t weight);
+void ngx_dynamic_upstream_op_recalc_weight(ngx_http_upstream_rr_peers_t *peers);
+ngx_uint_t ngx_dynamic_upstream_op_is_server(ngx_dynamic_upstream_op_t *op, ngx_str_t *name,
+                                             struct sockaddr *sockaddr, socklen_t socklen);
+void ngx_dynamic_upstream_op_parse_addr(ngx_pool_t *pool, ngx_dynamic_upstream_op_t *op);
+ngx_buf_t *ngx_dynamic_upstream_op_render_changes(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op);
+void ngx_dynamic_upstream_op_free_peer(ngx_slab_pool_t *shpool, ngx_dynamic_upstream_shctx_t *sh,
+                                       ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *list,
+                                       ngx_http_upstream_rr_peer_t *prev, ngx_http_upstream_rr_peer_t *target);
+void ngx_dynamic_upstream_op_unlink_peer(ngx_slab_pool_t *shpool, ngx_dynamic_upstream_shctx_t *sh,
+                                         ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *list,
+                                         ngx_http_upstream_rr_peer_t *prev, ngx_http_upstream_rr_peer_t *target);
+void ngx_dynamic_upstream_op_release_peer(ngx_slab_pool_t *shpool, ngx_http_upstream_rr_peer_t *target);
 
 
 #endif /* NGX_DYNAMIC_UPSTEAM_OP_H */
@@ -0,0 +1,335 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_persist.h"
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_persisted(ngx_dynamic_upstream_op_t *op);
+static u_char *
+ngx_dynamic_upstream_persist_token(u_char *p, u_char *last, ngx_str_t *token);
+static u_char *
+ngx_dynamic_upstream_persist_rewrite(ngx_dynamic_upstream_op_t *op, u_char *out, ngx_str_t *server,
+                                     u_char *p, u_char *last);
+static ngx_int_t
+ngx_dynamic_upstream_persist_write(ngx_log_t *log, u_char *name, u_char *data, size_t len,
+                                   ngx_file_info_t *fi);
+
+
+#define ngx_dynamic_upstream_persist_is(token, s)                                         \
+    ((token)->len == sizeof(s) - 1 && ngx_strncmp((token)->data, s, sizeof(s) - 1) == 0)
+
+
+/* add, remove, up and down of a server in an upstream, not the ones of the selectors or the upstreams */
+static ngx_uint_t
+ngx_dynamic_upstream_persisted(ngx_dynamic_upstream_op_t *op)
+{
+    if (op->upstreams || op->server_cidr != NULL || op->server_prefix.len) {
+        return 0;
+    }
+
+    switch (op->op) {
+    case NGX_DYNAMIC_UPSTEAM_OP_ADD:
+    case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
+        return 1;
+    case NGX_DYNAMIC_UPSTEAM_OP_PARAM:
+        return (op->op_param & (NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP|NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN)) != 0;
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * writes the server of op applied to the upstream to the configuration file of the upstream,
+ * so that the server is kept by the restart. the added server follows the zone directive,
+ * the removed server is deleted and the server upped or downed is rewritten.
+ * this is called out of the locks of the zone, and the workers are serialized by the lock
+ * of the file "name.lock". the file is replaced by the temporary file "name.tmp".
+ */
+void
+ngx_dynamic_upstream_persist(ngx_pool_t *pool, ngx_log_t *log, ngx_http_upstream_srv_conf_t *uscf,
+                             ngx_dynamic_upstream_op_t *op)
+{
+    u_char           *buf, *out, *p, *q, *next, *eol, *last, *lock, *tmp;
+    size_t            size;
+    ssize_t           n;
+    ngx_fd_t          lfd;
+    ngx_err_t         err;
+    ngx_str_t         name, directive, arg;
+    ngx_uint_t        found;
+    ngx_file_t        file;
+    ngx_file_info_t   fi;
+
+    if (uscf->file_name == NULL || !ngx_dynamic_upstream_persisted(op)) {
+        return;
+    }
+
+    name.data = uscf->file_name;
+    name.len = ngx_strlen(uscf->file_name);
+
+    lock = ngx_pnalloc(pool, name.len + sizeof(".lock"));
+    tmp = ngx_pnalloc(pool, name.len + sizeof(".tmp"));
+    if (lock == NULL || tmp == NULL) {
+        return;
+    }
+
+    ngx_sprintf(lock, "%V.lock%Z", &name);
+    ngx_sprintf(tmp, "%V.tmp%Z", &name);
+
+    lfd = ngx_open_file(lock, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+    if (lfd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", lock);
+        return;
+    }
+
+    err = ngx_lock_fd(lfd);
+    if (err != 0) {
+        ngx_log_error(NGX_LOG_ERR, log, err,
+                      ngx_lock_fd_n " \"%s\" failed", lock);
+        goto done;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = name;
+    file.log = log;
+
+    file.fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &name);
+        goto unlock;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &name);
+        ngx_close_file(file.fd);
+        goto unlock;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    /* the added line, or " down" and the separators of the line rewritten */
+    buf = ngx_pnalloc(pool, size + 1);
+    out = ngx_pnalloc(pool, size + op->server.len
+                            + sizeof("        server  weight= max_fails= fail_timeout= backup down;\n") - 1
+                            + 3 * NGX_INT_T_LEN);
+    if (buf == NULL || out == NULL) {
+        ngx_close_file(file.fd);
+        goto unlock;
+    }
+
+    n = ngx_read_file(&file, buf, size, 0);
+
+    ngx_close_file(file.fd);
+
+    if (n == NGX_ERROR || (size_t) n != size) {
+        goto unlock;
+    }
+
+    last = buf + size;
+    p = buf;
+    q = out;
+    found = 0;
+
+    while (p < last) {
+        eol = ngx_strlchr(p, last, '\n');
+        eol = (eol == NULL) ? last : eol + 1;
+
+        next = ngx_dynamic_upstream_persist_token(p, eol, &directive);
+        (void) ngx_dynamic_upstream_persist_token(next, eol, &arg);
+
+        if (op->op != NGX_DYNAMIC_UPSTEAM_OP_ADD
+            && ngx_dynamic_upstream_persist_is(&directive, "server")
+            && arg.len == op->server.len
+            && ngx_strncmp(arg.data, op->server.data, arg.len) == 0)
+        {
+            found = 1;
+
+            if (op->op == NGX_DYNAMIC_UPSTEAM_OP_PARAM) {
+                q = ngx_dynamic_upstream_persist_rewrite(op, q, &arg, p, eol);
+            }
+
+            p = eol;
+            continue;
+        }
+
+        q = ngx_cpymem(q, p, eol - p);
+        p = eol;
+
+        if (op->op == NGX_DYNAMIC_UPSTEAM_OP_ADD
+            && !found
+            && ngx_dynamic_upstream_persist_is(&directive, "zone")
+            && arg.len == uscf->shm_zone->shm.name.len
+            && ngx_strncmp(arg.data, uscf->shm_zone->shm.name.data, arg.len) == 0)
+        {
+            found = 1;
+
+            if (q[-1] != '\n') {
+                *q++ = '\n';
+            }
+
+            q = ngx_sprintf(q, "        server %V", &op->server);
+
+            if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
+                q = ngx_sprintf(q, " weight=%i", op->weight);
+            }
+
+            if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) {
+                q = ngx_sprintf(q, " max_fails=%i", op->max_fails);
+            }
+
+            if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) {
+                q = ngx_sprintf(q, " fail_timeout=%i", op->fail_timeout);
+            }
+
+            if (op->backup) {
+                q = ngx_cpymem(q, " backup", sizeof(" backup") - 1);
+            }
+
+            if (op->down) {
+                q = ngx_cpymem(q, " down", sizeof(" down") - 1);
+            }
+
+            *q++ = ';';
+            *q++ = '\n';
+        }
+    }
+
+    if (!found) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "%s of server %V in upstream \"%V\" is not written to \"%V\"",
+                      op->op == NGX_DYNAMIC_UPSTEAM_OP_ADD ? "add"
+                      : op->op == NGX_DYNAMIC_UPSTEAM_OP_REMOVE ? "remove" : "param",
+                      &op->server, &uscf->shm_zone->shm.name, &name);
+        goto unlock;
+    }
+
+    if (ngx_dynamic_upstream_persist_write(log, tmp, out, q - out, &fi) != NGX_OK) {
+        goto unlock;
+    }
+
+    if (ngx_rename_file(tmp, name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed", tmp, &name);
+
+        if (ngx_delete_file(tmp) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", tmp);
+        }
+    }
+
+ unlock:
+
+    err = ngx_unlock_fd(lfd);
+    if (err != 0) {
+        ngx_log_error(NGX_LOG_ERR, log, err,
+                      "fcntl(F_UNLCK) \"%s\" failed", lock);
+    }
+
+ done:
+
+    if (ngx_close_file(lfd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", lock);
+    }
+}
+
+
+/* the token of a directive, a directive line ends with ";", "#" or the end of the line */
+static u_char *
+ngx_dynamic_upstream_persist_token(u_char *p, u_char *last, ngx_str_t *token)
+{
+    while (p < last && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+
+    token->data = p;
+
+    while (p < last && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != ';' && *p != '#') {
+        p++;
+    }
+
+    token->len = p - token->data;
+
+    return p;
+}
+
+
+/* the server line with the parameters of the line and the down of op */
+static u_char *
+ngx_dynamic_upstream_persist_rewrite(ngx_dynamic_upstream_op_t *op, u_char *out, ngx_str_t *server,
+                                     u_char *p, u_char *last)
+{
+    ngx_str_t  token;
+
+    /* the indent of the line */
+    while (p < last && (*p == ' ' || *p == '\t')) {
+        *out++ = *p++;
+    }
+
+    out = ngx_sprintf(out, "server %V", server);
+
+    p = ngx_dynamic_upstream_persist_token(server->data + server->len, last, &token);
+
+    while (token.len) {
+        if (!ngx_dynamic_upstream_persist_is(&token, "down")) {
+            *out++ = ' ';
+            out = ngx_cpymem(out, token.data, token.len);
+        }
+
+        p = ngx_dynamic_upstream_persist_token(p, last, &token);
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
+        out = ngx_cpymem(out, " down", sizeof(" down") - 1);
+    }
+
+    *out++ = ';';
+    *out++ = '\n';
+
+    return out;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_persist_write(ngx_log_t *log, u_char *name, u_char *data, size_t len,
+                                   ngx_file_info_t *fi)
+{
+    ssize_t   n;
+    ngx_fd_t  fd;
+
+    fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, ngx_file_access(fi));
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        return NGX_ERROR;
+    }
+
+    while (len) {
+        n = ngx_write_fd(fd, data, len);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          ngx_write_fd_n " \"%s\" failed", name);
+            ngx_close_file(fd);
+            return NGX_ERROR;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,15 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_PERSIST_H
+#define NGX_DYNAMIC_UPSTREAM_PERSIST_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+void ngx_dynamic_upstream_persist(ngx_pool_t *pool, ngx_log_t *log, ngx_http_upstream_srv_conf_t *uscf,
+                                  ngx_dynamic_upstream_op_t *op);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_PERSIST_H */
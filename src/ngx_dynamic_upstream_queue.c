@@ -0,0 +1,735 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_queue.h"
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_persist.h"
+
+
+/* seq of the slot of the position p is p + state, p itself is free */
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_QUEUED    1
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_APPLYING  2
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_APPLIED   3
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_ABANDONED 4  /* the request is gone, applied and freed by the writer */
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_WITHDRAWN 5  /* not applied in time, skipped and freed by the writer */
+
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_MIN       8
+
+/* the request waiting longer for a slot or for the writer is answered with 503 */
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_TIMEOUT   1000
+
+
+typedef struct {
+    ngx_http_request_t            *request;
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_dynamic_upstream_op_t      op;
+    ngx_atomic_uint_t              pos;
+    ngx_msec_t                     deadline;
+    ngx_uint_t                     collected;  /* the slot is not of the request, or not reserved yet */
+    ngx_event_t                    event;
+} ngx_dynamic_upstream_queue_ctx_t;
+
+
+static ngx_int_t
+ngx_dynamic_upstream_queue_reserve(ngx_dynamic_upstream_queue_ctx_t *ctx);
+static void
+ngx_dynamic_upstream_queue_wait_handler(ngx_event_t *ev);
+static void
+ngx_dynamic_upstream_queue_cleanup(void *data);
+static void
+ngx_dynamic_upstream_queue_handler(ngx_event_t *ev);
+static void
+ngx_dynamic_upstream_queue_apply(ngx_http_upstream_srv_conf_t *uscf);
+static ngx_uint_t
+ngx_dynamic_upstream_queue_covers(ngx_dynamic_upstream_queued_t *q, ngx_dynamic_upstream_queued_t *next);
+static ngx_uint_t
+ngx_dynamic_upstream_queue_same_server(ngx_dynamic_upstream_queued_t *q, ngx_dynamic_upstream_queued_t *next);
+
+
+#define ngx_dynamic_upstream_queue_slot(dus, pos)  (&(dus)->sh->queue[(pos) % (dus)->queue])
+#define ngx_dynamic_upstream_queue_state(q, pos)   ((q)->seq - (pos))
+
+
+ngx_int_t
+ngx_dynamic_upstream_queue_init_zone(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                        i;
+    ngx_slab_pool_t                  *shpool;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    if (dus->queue == 0 || dus->sh == NULL) {
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+    dus->sh->queue = ngx_slab_calloc_locked(shpool, sizeof(ngx_dynamic_upstream_queued_t) * dus->queue);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (dus->sh->queue == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "failed to allocate the queue in upstream zone \"%V\"",
+                      &uscf->shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < dus->queue; i++) {
+        dus->sh->queue[i].seq = i;
+    }
+
+    return NGX_OK;
+}
+
+
+/* the ops of the zone are applied by the first worker only */
+void
+ngx_dynamic_upstream_queue_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_event_t                      *ev;
+    ngx_http_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    if (ngx_worker != 0) {
+        return;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL || uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+        if (dus->sh == NULL || dus->sh->queue == NULL) {
+            continue;
+        }
+
+        ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+        if (ev == NULL) {
+            continue;
+        }
+
+        ev->handler = ngx_dynamic_upstream_queue_handler;
+        ev->data = uscf;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, dus->queue_interval);
+    }
+}
+
+
+/*
+ * queues op for the writer and waits for the result, NGX_DECLINED is to apply op at once
+ * such as op is not a plain op of a server. the op waits for a slot when the ring is full.
+ */
+ngx_int_t
+ngx_dynamic_upstream_queue_push(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_pool_cleanup_t                *cln;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+    ngx_dynamic_upstream_queue_ctx_t  *ctx;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    if (dus->sh == NULL || dus->sh->queue == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (op->op != NGX_DYNAMIC_UPSTEAM_OP_ADD
+        && op->op != NGX_DYNAMIC_UPSTEAM_OP_REMOVE
+        && op->op != NGX_DYNAMIC_UPSTEAM_OP_PARAM)
+    {
+        return NGX_DECLINED;
+    }
+
+    /* If-Match is tested against the generation at once */
+    if (op->server_cidr != NULL
+        || op->server_prefix.len
+        || op->replicated
+        || op->server.len == 0
+        || op->server.len > NGX_DYNAMIC_UPSTREAM_QUEUE_SERVER
+        || r->headers_in.if_match != NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    /* the writer shutting down stops when the ring is empty */
+    if (ngx_exiting) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_dynamic_upstream_queue_ctx_t));
+    if (ctx == NULL) {
+        return NGX_DECLINED;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ctx->collected = 1;
+
+    cln->handler = ngx_dynamic_upstream_queue_cleanup;
+    cln->data = ctx;
+
+    ctx->request = r;
+    ctx->uscf = uscf;
+    ctx->op = *op;
+    ctx->deadline = ngx_current_msec + NGX_DYNAMIC_UPSTREAM_QUEUE_TIMEOUT;
+
+    ctx->event.handler = ngx_dynamic_upstream_queue_wait_handler;
+    ctx->event.data = ctx;
+    ctx->event.log = r->connection->log;
+
+    /* the ops are not applied at once not to take the locks in the burst filling the ring */
+    if (ngx_dynamic_upstream_queue_reserve(ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "queue of upstream is full, the op waits for a slot. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+    }
+
+    ngx_add_timer(&ctx->event, dus->queue_interval);
+
+    return NGX_OK;
+}
+
+
+/* the slot is reserved by moving the tail, NGX_BUSY is the ring full */
+static ngx_int_t
+ngx_dynamic_upstream_queue_reserve(ngx_dynamic_upstream_queue_ctx_t *ctx)
+{
+    ngx_http_request_t               *r;
+    ngx_atomic_uint_t                 pos;
+    ngx_dynamic_upstream_op_t        *op;
+    ngx_dynamic_upstream_queued_t    *q;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    r = ctx->request;
+    op = &ctx->op;
+
+    dus = ngx_http_conf_upstream_srv_conf(ctx->uscf, ngx_dynamic_upstream_module);
+
+    for ( ;; ) {
+        pos = dus->sh->queue_tail;
+        q = ngx_dynamic_upstream_queue_slot(dus, pos);
+
+        if (q->seq != pos) {
+            if ((ngx_atomic_int_t) (q->seq - pos) < 0) {
+                return NGX_BUSY;
+            }
+
+            continue;
+        }
+
+        if (ngx_atomic_cmp_set(&dus->sh->queue_tail, pos, pos + 1)) {
+            break;
+        }
+    }
+
+    q->op = op->op;
+    q->op_param = op->op_param;
+    q->backup = op->backup;
+    q->weight = op->weight;
+    q->max_fails = op->max_fails;
+    q->fail_timeout = op->fail_timeout;
+    q->up = op->up;
+    q->down = op->down;
+    q->slow_start = op->slow_start;
+    q->drain = op->drain;
+    q->warm = op->warm;
+    q->server_len = op->server.len;
+    ngx_memcpy(q->server, op->server.data, op->server.len);
+    q->addr_len = ngx_min(r->connection->addr_text.len, NGX_INET6_ADDRSTRLEN);
+    ngx_memcpy(q->addr, r->connection->addr_text.data, q->addr_len);
+
+    ngx_memory_barrier();
+
+    q->seq = pos + NGX_DYNAMIC_UPSTREAM_QUEUE_QUEUED;
+
+    ctx->pos = pos;
+    ctx->collected = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_queue_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t                          rc;
+    ngx_uint_t                         status, generation;
+    ngx_connection_t                  *c;
+    ngx_http_request_t                *r;
+    ngx_dynamic_upstream_queued_t     *q;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+    ngx_dynamic_upstream_queue_ctx_t  *ctx;
+
+    ctx = ev->data;
+    r = ctx->request;
+    c = r->connection;
+
+    dus = ngx_http_conf_upstream_srv_conf(ctx->uscf, ngx_dynamic_upstream_module);
+
+    /* the ring was full */
+    if (ctx->collected) {
+        if (ngx_dynamic_upstream_queue_reserve(ctx) == NGX_OK) {
+            ngx_add_timer(ev, dus->queue_interval);
+            return;
+        }
+
+        if ((ngx_msec_int_t) (ngx_current_msec - ctx->deadline) >= 0) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "queue of upstream is full for %ui msec. %s:%d",
+                          (ngx_uint_t) NGX_DYNAMIC_UPSTREAM_QUEUE_TIMEOUT,
+                          __FUNCTION__,
+                          __LINE__);
+
+            ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+            ngx_http_run_posted_requests(c);
+            return;
+        }
+
+        ngx_add_timer(ev, dus->queue_interval);
+        return;
+    }
+
+    q = ngx_dynamic_upstream_queue_slot(dus, ctx->pos);
+
+    if (ngx_dynamic_upstream_queue_state(q, ctx->pos) == NGX_DYNAMIC_UPSTREAM_QUEUE_APPLIED) {
+        ngx_memory_barrier();
+
+        status = q->status;
+        generation = q->generation;
+
+        ngx_memory_barrier();
+
+        q->seq = ctx->pos + dus->queue;
+        ctx->collected = 1;
+
+        if (status != NGX_HTTP_OK) {
+            rc = status;
+
+        } else {
+            rc = ngx_dynamic_upstream_respond(r, &ctx->op, ctx->uscf, generation);
+        }
+
+        ngx_http_finalize_request(r, rc);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    /* the op not taken by the writer yet is withdrawn, the op being applied is waited */
+    if ((ngx_msec_int_t) (ngx_current_msec - ctx->deadline) >= 0
+        && ngx_atomic_cmp_set(&q->seq, ctx->pos + NGX_DYNAMIC_UPSTREAM_QUEUE_QUEUED,
+                              ctx->pos + NGX_DYNAMIC_UPSTREAM_QUEUE_WITHDRAWN))
+    {
+        ctx->collected = 1;
+
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "queued op is not applied in %ui msec. %s:%d",
+                      (ngx_uint_t) NGX_DYNAMIC_UPSTREAM_QUEUE_TIMEOUT,
+                      __FUNCTION__,
+                      __LINE__);
+
+        ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    ngx_add_timer(ev, dus->queue_interval);
+}
+
+
+/* the op of the request closed is still applied, the writer frees the slot */
+static void
+ngx_dynamic_upstream_queue_cleanup(void *data)
+{
+    ngx_dynamic_upstream_queue_ctx_t  *ctx = data;
+
+    ngx_atomic_uint_t                  pos;
+    ngx_dynamic_upstream_queued_t     *q;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+
+    if (ctx->event.timer_set) {
+        ngx_del_timer(&ctx->event);
+    }
+
+    if (ctx->collected) {
+        return;
+    }
+
+    pos = ctx->pos;
+
+    dus = ngx_http_conf_upstream_srv_conf(ctx->uscf, ngx_dynamic_upstream_module);
+    q = ngx_dynamic_upstream_queue_slot(dus, pos);
+
+    if (ngx_atomic_cmp_set(&q->seq, pos + NGX_DYNAMIC_UPSTREAM_QUEUE_QUEUED, pos + NGX_DYNAMIC_UPSTREAM_QUEUE_ABANDONED)
+        || ngx_atomic_cmp_set(&q->seq, pos + NGX_DYNAMIC_UPSTREAM_QUEUE_APPLYING,
+                              pos + NGX_DYNAMIC_UPSTREAM_QUEUE_ABANDONED))
+    {
+        return;
+    }
+
+    /* applied */
+    q->seq = pos + dus->queue;
+}
+
+
+/*
+ * the writer shutting down by a reload keeps applying the ops queued by the workers
+ * shutting down until the ring is empty, so that the requests waiting are answered.
+ * the zone is created again for the new workers, and the ops reach only the conf file
+ * as the ops applied at once by the workers shutting down.
+ */
+static void
+ngx_dynamic_upstream_queue_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_srv_conf_t     *uscf;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    if (ngx_terminate) {
+        return;
+    }
+
+    uscf = ev->data;
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    ngx_dynamic_upstream_queue_apply(uscf);
+
+    if (ngx_exiting) {
+        if (dus->sh->queue_head == dus->sh->queue_tail) {
+            return;
+        }
+
+        /* the worker does not exit with the ring not empty */
+        ev->cancelable = 0;
+    }
+
+    ngx_add_timer(ev, dus->queue_interval);
+}
+
+
+/*
+ * applies the ops queued in a row as a batch in a critical section.
+ * an op of the parameters overridden by a later op of the same server is not applied,
+ * such as "weight=2" followed by "weight=3" or "down" followed by "up",
+ * and the request of the op is answered with the result of the later op.
+ */
+static void
+ngx_dynamic_upstream_queue_apply(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t                          rc;
+    ngx_uint_t                         i, j, n, *cover;
+    ngx_atomic_uint_t                  head, pos, state;
+    ngx_pool_t                        *pool;
+    ngx_array_t                        applied;
+    ngx_slab_pool_t                   *shpool;
+    ngx_connection_t                   c;
+    ngx_http_request_t                 r;
+    ngx_dynamic_upstream_op_t          op, *aop;
+    ngx_dynamic_upstream_queued_t     *q, *next;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_dynamic_upstream_shctx_t      *sh;
+    ngx_dynamic_upstream_srv_conf_t   *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    sh = dus->sh;
+    head = sh->queue_head;
+
+    /* the slots reserved and not filled yet end the batch */
+    for (n = 0; n < dus->queue; n++) {
+        pos = head + n;
+        q = ngx_dynamic_upstream_queue_slot(dus, pos);
+
+        if (ngx_atomic_cmp_set(&q->seq, pos + NGX_DYNAMIC_UPSTREAM_QUEUE_QUEUED,
+                               pos + NGX_DYNAMIC_UPSTREAM_QUEUE_APPLYING))
+        {
+            continue;
+        }
+
+        state = ngx_dynamic_upstream_queue_state(q, pos);
+
+        if (state != NGX_DYNAMIC_UPSTREAM_QUEUE_ABANDONED && state != NGX_DYNAMIC_UPSTREAM_QUEUE_WITHDRAWN) {
+            break;
+        }
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    ngx_memory_barrier();
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return;
+    }
+
+    cover = ngx_pcalloc(pool, sizeof(ngx_uint_t) * n);
+    if (cover == NULL) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    /* the ops applied are written to the conf file after the batch as the ops of the API */
+    if (ngx_array_init(&applied, pool, n, sizeof(ngx_dynamic_upstream_op_t)) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        q = ngx_dynamic_upstream_queue_slot(dus, head + i);
+
+        if (ngx_dynamic_upstream_queue_state(q, head + i) == NGX_DYNAMIC_UPSTREAM_QUEUE_WITHDRAWN) {
+            continue;
+        }
+
+        for (j = i + 1; j < n; j++) {
+            next = ngx_dynamic_upstream_queue_slot(dus, head + j);
+
+            if (ngx_dynamic_upstream_queue_state(next, head + j) == NGX_DYNAMIC_UPSTREAM_QUEUE_WITHDRAWN
+                || !ngx_dynamic_upstream_queue_same_server(q, next))
+            {
+                continue;
+            }
+
+            /* the server added or removed in between is not the same peer */
+            if (next->op != NGX_DYNAMIC_UPSTEAM_OP_PARAM) {
+                break;
+            }
+
+            if (ngx_dynamic_upstream_queue_covers(q, next)) {
+                cover[i] = j;
+                break;
+            }
+        }
+    }
+
+    /* the core functions log with the connection and allocate from the pool of the request */
+    ngx_memzero(&c, sizeof(ngx_connection_t));
+    ngx_memzero(&r, sizeof(ngx_http_request_t));
+
+    c.log = ngx_cycle->log;
+    r.connection = &c;
+    r.pool = pool;
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+    peers = uscf->peer.data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    for (i = 0; i < n; i++) {
+        q = ngx_dynamic_upstream_queue_slot(dus, head + i);
+
+        if (cover[i] || ngx_dynamic_upstream_queue_state(q, head + i) == NGX_DYNAMIC_UPSTREAM_QUEUE_WITHDRAWN) {
+            continue;
+        }
+
+        ngx_memzero(&op, sizeof(ngx_dynamic_upstream_op_t));
+
+        op.op = q->op;
+        op.op_param = q->op_param;
+        op.backup = q->backup;
+        op.weight = q->weight;
+        op.max_fails = q->max_fails;
+        op.fail_timeout = q->fail_timeout;
+        op.up = q->up;
+        op.down = q->down;
+        op.slow_start = q->slow_start;
+        op.drain = q->drain;
+        op.warm = q->warm;
+        op.upstream = uscf->shm_zone->shm.name;
+        op.queued = 1;
+        op.status = NGX_HTTP_OK;
+
+        op.server.len = q->server_len;
+        op.server.data = ngx_pnalloc(pool, q->server_len + 1);
+        if (op.server.data == NULL) {
+            q->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            q->generation = sh->generation;
+            continue;
+        }
+
+        ngx_cpystrn(op.server.data, q->server, q->server_len + 1);
+
+        /* the client of the op in the history */
+        c.addr_text.len = q->addr_len;
+        c.addr_text.data = q->addr;
+
+        ngx_dynamic_upstream_op_parse_addr(pool, &op);
+
+        rc = ngx_dynamic_upstream_op(&r, &op, shpool, uscf);
+
+        if (rc == NGX_OK) {
+            q->status = NGX_HTTP_OK;
+            sh->generation++;
+
+            aop = ngx_array_push(&applied);
+            if (aop != NULL) {
+                *aop = op;
+            }
+
+        } else {
+            q->status = (op.status == NGX_HTTP_OK) ? NGX_HTTP_INTERNAL_SERVER_ERROR : op.status;
+        }
+
+        q->generation = sh->generation;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    aop = applied.elts;
+
+    for (i = 0; i < applied.nelts; i++) {
+        ngx_dynamic_upstream_persist(pool, ngx_cycle->log, uscf, &aop[i]);
+    }
+
+    /* backwards, the op covering is answered before the op covered */
+    for (i = n; i-- > 0; /* void */) {
+        if (cover[i]) {
+            q = ngx_dynamic_upstream_queue_slot(dus, head + i);
+            next = ngx_dynamic_upstream_queue_slot(dus, head + cover[i]);
+
+            q->status = next->status;
+            q->generation = next->generation;
+        }
+    }
+
+    ngx_memory_barrier();
+
+    for (i = 0; i < n; i++) {
+        pos = head + i;
+        q = ngx_dynamic_upstream_queue_slot(dus, pos);
+
+        if (!ngx_atomic_cmp_set(&q->seq, pos + NGX_DYNAMIC_UPSTREAM_QUEUE_APPLYING,
+                                pos + NGX_DYNAMIC_UPSTREAM_QUEUE_APPLIED))
+        {
+            /* abandoned or withdrawn */
+            q->seq = pos + dus->queue;
+        }
+    }
+
+    sh->queue_head = head + n;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "dynamic upstream: %ui ops applied in upstream %V",
+                   n, &uscf->shm_zone->shm.name);
+
+    ngx_destroy_pool(pool);
+}
+
+
+/*
+ * tests whether the parameters of q are set by next again.
+ * up and down are the same state, the drain, the slow start and the warm-up are not overridden.
+ */
+static ngx_uint_t
+ngx_dynamic_upstream_queue_covers(ngx_dynamic_upstream_queued_t *q, ngx_dynamic_upstream_queued_t *next)
+{
+    ngx_int_t  bits, next_bits, state;
+
+    if (q->op != NGX_DYNAMIC_UPSTEAM_OP_PARAM
+        || q->backup != next->backup
+        || q->drain
+        || q->slow_start
+        || q->warm
+        || (q->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN))
+    {
+        return 0;
+    }
+
+    state = NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP|NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+
+    bits = q->op_param;
+    if (bits & state) {
+        bits |= state;
+    }
+
+    next_bits = next->op_param;
+    if (next_bits & state) {
+        next_bits |= state;
+    }
+
+    return (bits & ~next_bits) == 0;
+}
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_queue_same_server(ngx_dynamic_upstream_queued_t *q, ngx_dynamic_upstream_queued_t *next)
+{
+    return q->server_len == next->server_len && ngx_strncmp(q->server, next->server, q->server_len) == 0;
+}
+
+
+/* dynamic_upstream_queue [size=64] [interval=10ms]; */
+char *
+ngx_dynamic_upstream_queue_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t *dus = conf;
+
+    ngx_str_t   *value, s;
+    ngx_int_t    size;
+    ngx_uint_t   i;
+
+    if (dus->queue) {
+        return "is duplicate";
+    }
+
+    dus->queue = 64;
+    dus->queue_interval = 10;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            size = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (size == NGX_ERROR || size < NGX_DYNAMIC_UPSTREAM_QUEUE_MIN) {
+                goto invalid;
+            }
+
+            dus->queue = size;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            dus->queue_interval = ngx_parse_time(&s, 0);
+            if (dus->queue_interval == (ngx_msec_t) NGX_ERROR || dus->queue_interval == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+ invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -0,0 +1,18 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_QUEUE_H
+#define NGX_DYNAMIC_UPSTREAM_QUEUE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+ngx_int_t ngx_dynamic_upstream_queue_init_zone(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *uscf);
+void ngx_dynamic_upstream_queue_init_process(ngx_cycle_t *cycle);
+ngx_int_t ngx_dynamic_upstream_queue_push(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                          ngx_http_upstream_srv_conf_t *uscf);
+char *ngx_dynamic_upstream_queue_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_QUEUE_H */
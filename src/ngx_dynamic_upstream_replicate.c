@@ -0,0 +1,483 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_replicate.h"
+
+
+typedef struct {
+    ngx_dynamic_upstream_replica_conf_t  *conf;
+    ngx_uint_t                            tries;
+    ngx_uint_t                            status;  /* of the last try, 0 is running */
+} ngx_dynamic_upstream_replica_t;
+
+
+typedef struct {
+    ngx_chain_t                          *out;     /* the response of the op */
+    ngx_str_t                             args;    /* the args of the op with replicated= */
+    ngx_dynamic_upstream_replica_t       *replicas;
+    ngx_uint_t                            nreplicas;
+    ngx_uint_t                            running;
+    ngx_event_t                           retry;   /* the failed peers are tried again by the timer */
+} ngx_dynamic_upstream_replicate_ctx_t;
+
+
+static ngx_int_t
+ngx_dynamic_upstream_replicate_start(ngx_http_request_t *r, ngx_dynamic_upstream_replicate_ctx_t *ctx,
+                                     ngx_dynamic_upstream_replica_t *replica);
+static ngx_int_t
+ngx_dynamic_upstream_replicate_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
+static void
+ngx_dynamic_upstream_replicate_handler(ngx_http_request_t *r);
+static void
+ngx_dynamic_upstream_replicate_retry(ngx_event_t *ev);
+static void
+ngx_dynamic_upstream_replicate_cleanup(void *data);
+static ngx_int_t
+ngx_dynamic_upstream_replicate_send(ngx_http_request_t *r, ngx_dynamic_upstream_replicate_ctx_t *ctx);
+
+
+/*
+ * forwards the op committed as the generation to the peer nodes with the subrequests,
+ * the response of the op is sent with "replicated /uri status=200 tries=1;" of each peer
+ * when the subrequests are done.
+ */
+ngx_int_t
+ngx_dynamic_upstream_replicate(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf,
+                               ngx_uint_t generation, ngx_chain_t *out)
+{
+    u_char                                *p;
+    ngx_uint_t                             i;
+    ngx_chain_t                           *cl, **ll;
+    ngx_pool_cleanup_t                    *pcln;
+    ngx_dynamic_upstream_srv_conf_t       *dus;
+    ngx_dynamic_upstream_replica_conf_t   *conf;
+    ngx_dynamic_upstream_replicate_ctx_t  *ctx;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_dynamic_upstream_replicate_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the links of the response may be on the stack of the caller */
+    ll = &ctx->out;
+
+    for ( /* void */ ; out; out = out->next) {
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        cl->buf = out->buf;
+        cl->next = NULL;
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    ctx->args.data = ngx_pnalloc(r->pool, r->args.len + sizeof("&replicated=..") - 1 + NGX_TIME_T_LEN + NGX_INT_T_LEN
+                                          + dus->replicate_node.len);
+    if (ctx->args.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the generations of the nodes replicating to each other are told apart by the node */
+    p = ngx_cpymem(ctx->args.data, r->args.data, r->args.len);
+    p = ngx_sprintf(p, "&replicated=%T.%ui.%V", dus->sh->epoch, generation, &dus->replicate_node);
+    ctx->args.len = p - ctx->args.data;
+
+    conf = dus->replicate->elts;
+
+    ctx->nreplicas = dus->replicate->nelts;
+    ctx->replicas = ngx_pcalloc(r->pool, sizeof(ngx_dynamic_upstream_replica_t) * ctx->nreplicas);
+    if (ctx->replicas == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the timer of the retry is not left when the request is closed */
+    pcln = ngx_pool_cleanup_add(r->pool, 0);
+    if (pcln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    pcln->handler = ngx_dynamic_upstream_replicate_cleanup;
+    pcln->data = &ctx->retry;
+
+    ctx->retry.handler = ngx_dynamic_upstream_replicate_retry;
+    ctx->retry.data = r;
+    ctx->retry.log = r->connection->log;
+
+    ngx_http_set_ctx(r, ctx, ngx_dynamic_upstream_module);
+
+    for (i = 0; i < ctx->nreplicas; i++) {
+        ctx->replicas[i].conf = &conf[i];
+
+        if (ngx_dynamic_upstream_replicate_start(r, ctx, &ctx->replicas[i]) != NGX_OK) {
+            ctx->replicas[i].status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (ctx->running == 0) {
+        return ngx_dynamic_upstream_replicate_send(r, ctx);
+    }
+
+    r->write_event_handler = ngx_dynamic_upstream_replicate_handler;
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_replicate_start(ngx_http_request_t *r, ngx_dynamic_upstream_replicate_ctx_t *ctx,
+                                     ngx_dynamic_upstream_replica_t *replica)
+{
+    ngx_http_request_t          *sr;
+    ngx_http_post_subrequest_t  *ps;
+
+    /* a try failed to start is counted, so that the tries are bounded */
+    replica->tries++;
+
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if (ps == NULL) {
+        return NGX_ERROR;
+    }
+
+    ps->handler = ngx_dynamic_upstream_replicate_done;
+    ps->data = replica;
+
+    if (ngx_http_subrequest(r, &replica->conf->uri, &ctx->args, &sr, ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY|NGX_HTTP_SUBREQUEST_WAITED)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the servers of replace are in the body shared with the subrequest */
+    sr->method = r->method;
+    sr->method_name = r->method_name;
+
+    replica->status = 0;
+    ctx->running++;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_replicate_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
+{
+    ngx_dynamic_upstream_replica_t        *replica = data;
+    ngx_dynamic_upstream_replicate_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r->parent, ngx_dynamic_upstream_module);
+
+    if (rc == NGX_ERROR) {
+        replica->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    } else if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        replica->status = rc;
+
+    } else {
+        replica->status = r->headers_out.status ? r->headers_out.status : NGX_HTTP_BAD_GATEWAY;
+    }
+
+    ctx->running--;
+
+    if (replica->status != NGX_HTTP_OK) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "replication to %V failed with %ui, try %ui of %ui",
+                      &replica->conf->uri, replica->status, replica->tries, replica->conf->tries);
+    }
+
+    return rc;
+}
+
+
+/*
+ * the parent is posted when a subrequest is done. the peers down or restarting are tried again
+ * after the backoff of the peer, doubled by each try, and the ops refused are not.
+ */
+static void
+ngx_dynamic_upstream_replicate_handler(ngx_http_request_t *r)
+{
+    ngx_uint_t                             i;
+    ngx_msec_t                             delay, backoff;
+    ngx_dynamic_upstream_replica_t        *replica;
+    ngx_dynamic_upstream_replicate_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_dynamic_upstream_module);
+
+    if (ctx->running || ctx->retry.timer_set) {
+        return;
+    }
+
+    /* the peers failed are tried again together after the shortest backoff */
+    delay = NGX_TIMER_INFINITE;
+
+    for (i = 0; i < ctx->nreplicas; i++) {
+        replica = &ctx->replicas[i];
+
+        if (replica->status >= NGX_HTTP_INTERNAL_SERVER_ERROR
+            && replica->tries < replica->conf->tries)
+        {
+            backoff = replica->conf->backoff << ngx_min(replica->tries - 1, 10);
+            delay = ngx_min(delay, backoff);
+        }
+    }
+
+    if (delay != NGX_TIMER_INFINITE) {
+        ngx_add_timer(&ctx->retry, delay);
+        return;
+    }
+
+    ngx_http_finalize_request(r, ngx_dynamic_upstream_replicate_send(r, ctx));
+}
+
+
+static void
+ngx_dynamic_upstream_replicate_retry(ngx_event_t *ev)
+{
+    ngx_uint_t                             i;
+    ngx_connection_t                      *c;
+    ngx_http_request_t                    *r;
+    ngx_dynamic_upstream_replica_t        *replica;
+    ngx_dynamic_upstream_replicate_ctx_t  *ctx;
+
+    r = ev->data;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_dynamic_upstream_module);
+
+    for (i = 0; i < ctx->nreplicas; i++) {
+        replica = &ctx->replicas[i];
+
+        if (replica->status >= NGX_HTTP_INTERNAL_SERVER_ERROR
+            && replica->tries < replica->conf->tries
+            && ngx_dynamic_upstream_replicate_start(r, ctx, replica) != NGX_OK)
+        {
+            replica->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    /* the peers failed to start are tried again or the response is sent */
+    if (ctx->running == 0) {
+        ngx_dynamic_upstream_replicate_handler(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_dynamic_upstream_replicate_cleanup(void *data)
+{
+    ngx_event_t  *ev = data;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_replicate_send(ngx_http_request_t *r, ngx_dynamic_upstream_replicate_ctx_t *ctx)
+{
+    size_t                           size;
+    ngx_uint_t                       i;
+    ngx_buf_t                       *b;
+    ngx_chain_t                     *cl, **ll;
+    ngx_dynamic_upstream_replica_t  *replica;
+
+    size = 0;
+
+    for (i = 0; i < ctx->nreplicas; i++) {
+        size += sizeof("replicated  status=000 tries=;\n") - 1 + ctx->replicas[i].conf->uri.len + NGX_INT_T_LEN;
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    cl = ngx_alloc_chain_link(r->pool);
+    if (b == NULL || cl == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for (i = 0; i < ctx->nreplicas; i++) {
+        replica = &ctx->replicas[i];
+        b->last = ngx_sprintf(b->last, "replicated %V status=%ui tries=%ui;\n",
+                              &replica->conf->uri, replica->status, replica->tries);
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    for (ll = &ctx->out; *ll; ll = &(*ll)->next) { /* void */ }
+
+    *ll = cl;
+
+    return ngx_dynamic_upstream_send(r, ctx->out);
+}
+
+
+/* tests whether the op forwarded by the origin is applied, such as the retry of a lost response */
+ngx_uint_t
+ngx_dynamic_upstream_replicate_seen_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_op_t *op)
+{
+    ngx_uint_t                          i;
+    ngx_dynamic_upstream_replicated_t  *seen;
+
+    for (i = 0; i < NGX_DYNAMIC_UPSTREAM_REPLICATED; i++) {
+        seen = &sh->replicated[i];
+
+        if (seen->generation == op->replicated
+            && seen->epoch == op->epoch
+            && seen->node_len == op->node.len
+            && ngx_strncmp(seen->node, op->node.data, op->node.len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void
+ngx_dynamic_upstream_replicate_applied_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_op_t *op)
+{
+    ngx_dynamic_upstream_replicated_t  *seen;
+
+    seen = &sh->replicated[sh->replicated_n++ % NGX_DYNAMIC_UPSTREAM_REPLICATED];
+
+    seen->epoch = op->epoch;
+    seen->generation = op->replicated;
+    seen->node_len = op->node.len;
+    ngx_memcpy(seen->node, op->node.data, op->node.len);
+}
+
+
+/* dynamic_upstream_replicate /replica_b [tries=3] [backoff=100ms] [node=name]; */
+char *
+ngx_dynamic_upstream_replicate_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t *dus = conf;
+
+    u_char                               *p, c;
+    ngx_str_t                            *value, s, node;
+    ngx_int_t                             tries;
+    ngx_msec_t                            backoff;
+    ngx_uint_t                            i;
+    ngx_dynamic_upstream_replica_conf_t  *replica;
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0 || value[1].data[0] != '/') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid uri \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    tries = 3;
+    backoff = 100;
+    ngx_str_null(&node);
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "tries=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            tries = ngx_atoi(s.data, s.len);
+            if (tries == NGX_ERROR || tries == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "backoff=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            backoff = ngx_parse_time(&s, 0);
+            if (backoff == (ngx_msec_t) NGX_ERROR || backoff == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "node=", 5) == 0) {
+            node.len = value[i].len - 5;
+            node.data = value[i].data + 5;
+
+            /* the node is sent in the args as is */
+            for (p = node.data; p < node.data + node.len; p++) {
+                c = (u_char) (*p | 0x20);
+
+                if (!((c >= 'a' && c <= 'z') || (*p >= '0' && *p <= '9') || *p == '-' || *p == '.' || *p == '_')) {
+                    goto invalid;
+                }
+            }
+
+            if (node.len == 0 || node.len > NGX_DYNAMIC_UPSTREAM_NODE) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (node.len) {
+        if (dus->replicate_node.len
+            && (dus->replicate_node.len != node.len
+                || ngx_strncmp(dus->replicate_node.data, node.data, node.len) != 0))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "node \"%V\" is not the node \"%V\" of the upstream",
+                               &node, &dus->replicate_node);
+            return NGX_CONF_ERROR;
+        }
+
+        dus->replicate_node = node;
+
+    } else if (dus->replicate_node.len == 0) {
+        if (cf->cycle->hostname.len > NGX_DYNAMIC_UPSTREAM_NODE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "host name \"%V\" is longer than %d, node is needed",
+                               &cf->cycle->hostname, NGX_DYNAMIC_UPSTREAM_NODE);
+            return NGX_CONF_ERROR;
+        }
+
+        dus->replicate_node = cf->cycle->hostname;
+    }
+
+    if (dus->replicate == NULL) {
+        dus->replicate = ngx_array_create(cf->pool, 2, sizeof(ngx_dynamic_upstream_replica_conf_t));
+        if (dus->replicate == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    replica = ngx_array_push(dus->replicate);
+    if (replica == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    replica->uri = value[1];
+    replica->tries = tries;
+    replica->backoff = backoff;
+
+    return NGX_CONF_OK;
+
+ invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -0,0 +1,26 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_REPLICATE_H
+#define NGX_DYNAMIC_UPSTREAM_REPLICATE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+/* a peer node, the uri is of a location proxied to the API of the node */
+typedef struct {
+    ngx_str_t                     uri;
+    ngx_uint_t                    tries;
+    ngx_msec_t                    backoff;  /* before the second try, doubled for the next ones */
+} ngx_dynamic_upstream_replica_conf_t;
+
+
+ngx_int_t ngx_dynamic_upstream_replicate(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *uscf,
+                                         ngx_uint_t generation, ngx_chain_t *out);
+ngx_uint_t ngx_dynamic_upstream_replicate_seen_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_op_t *op);
+void ngx_dynamic_upstream_replicate_applied_locked(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_op_t *op);
+char *ngx_dynamic_upstream_replicate_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_REPLICATE_H */
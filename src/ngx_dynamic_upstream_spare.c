@@ -0,0 +1,485 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_spare.h"
+
+
+/* the names looked up by the variable in a worker, a slot is taken by the hash of the name */
+#define NGX_DYNAMIC_UPSTREAM_SPARE_CACHE  64
+
+
+typedef struct {
+    ngx_uint_t                     valid;
+    size_t                         len;
+    u_char                         name[NGX_DYNAMIC_UPSTREAM_SPARE_NAME];
+    ngx_http_upstream_srv_conf_t  *uscf;  /* NULL is not claimed */
+} ngx_dynamic_upstream_spare_cached_t;
+
+
+typedef struct {
+    ngx_http_complex_value_t       value;
+    ngx_http_complex_value_t      *default_value;  /* of the names not claimed, NULL is not found */
+} ngx_dynamic_upstream_spare_variable_t;
+
+
+static ngx_http_upstream_srv_conf_t *
+ngx_dynamic_upstream_spare_first(ngx_http_upstream_main_conf_t *umcf);
+static ngx_uint_t
+ngx_dynamic_upstream_spare_is_claimed(ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *name,
+                                      ngx_http_upstream_srv_conf_t *locked);
+static ngx_http_upstream_srv_conf_t *
+ngx_dynamic_upstream_spare_cached_zone(ngx_http_request_t *r, ngx_str_t *name);
+static ngx_int_t
+ngx_dynamic_upstream_spare_get_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+
+static ngx_uint_t                           ngx_dynamic_upstream_spare_cache_generation;
+static ngx_dynamic_upstream_spare_cached_t  ngx_dynamic_upstream_spare_cache[NGX_DYNAMIC_UPSTREAM_SPARE_CACHE];
+
+
+/*
+ * the first spare upstream, the claims are serialized by the lock of its zone
+ * and the claims and the releases are counted in its zone.
+ */
+static ngx_http_upstream_srv_conf_t *
+ngx_dynamic_upstream_spare_first(ngx_http_upstream_main_conf_t *umcf)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL || uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+        if (dus->spare && dus->sh != NULL) {
+            return uscf;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* tests whether the spare upstream is claimed as the name, the zone of locked is locked by the caller */
+static ngx_uint_t
+ngx_dynamic_upstream_spare_is_claimed(ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *name,
+                                      ngx_http_upstream_srv_conf_t *locked)
+{
+    ngx_uint_t                        claimed;
+    ngx_slab_pool_t                  *shpool;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    if (uscf->shm_zone == NULL || uscf->srv_conf == NULL) {
+        return 0;
+    }
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    if (!dus->spare || dus->sh == NULL) {
+        return 0;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    if (uscf != locked) {
+        ngx_shmtx_lock(&shpool->mutex);
+    }
+
+    claimed = (dus->sh->spare_len == name->len
+               && ngx_strncmp(dus->sh->spare, name->data, name->len) == 0);
+
+    if (uscf != locked) {
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    return claimed;
+}
+
+
+/* finds the spare upstream claimed as the name */
+ngx_http_upstream_srv_conf_t *
+ngx_dynamic_upstream_spare_get_zone(ngx_http_request_t *r, ngx_str_t *name)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if (name->len == 0 || name->len > NGX_DYNAMIC_UPSTREAM_SPARE_NAME) {
+        return NULL;
+    }
+
+    umcf  = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (ngx_dynamic_upstream_spare_is_claimed(uscfp[i], name, NULL)) {
+            return uscfp[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * finds the spare upstream claimed as the name with the cache of the worker,
+ * the cache is dropped when a spare is claimed or released in any worker.
+ */
+static ngx_http_upstream_srv_conf_t *
+ngx_dynamic_upstream_spare_cached_zone(ngx_http_request_t *r, ngx_str_t *name)
+{
+    ngx_uint_t                            generation;
+    ngx_http_upstream_srv_conf_t         *first;
+    ngx_http_upstream_main_conf_t        *umcf;
+    ngx_dynamic_upstream_srv_conf_t      *dus;
+    ngx_dynamic_upstream_spare_cached_t  *c;
+
+    if (name->len == 0 || name->len > NGX_DYNAMIC_UPSTREAM_SPARE_NAME) {
+        return NULL;
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    first = ngx_dynamic_upstream_spare_first(umcf);
+    if (first == NULL) {
+        return NULL;
+    }
+
+    dus = ngx_http_conf_upstream_srv_conf(first, ngx_dynamic_upstream_module);
+
+    /* read before the lookup, a change during the lookup drops the entry at the next request */
+    generation = dus->sh->spare_generation;
+
+    ngx_memory_barrier();
+
+    if (generation != ngx_dynamic_upstream_spare_cache_generation) {
+        ngx_memzero(ngx_dynamic_upstream_spare_cache, sizeof(ngx_dynamic_upstream_spare_cache));
+        ngx_dynamic_upstream_spare_cache_generation = generation;
+    }
+
+    c = &ngx_dynamic_upstream_spare_cache[ngx_hash_key(name->data, name->len) % NGX_DYNAMIC_UPSTREAM_SPARE_CACHE];
+
+    if (c->valid && c->len == name->len && ngx_strncmp(c->name, name->data, name->len) == 0) {
+        return c->uscf;
+    }
+
+    c->uscf = ngx_dynamic_upstream_spare_get_zone(r, name);
+    c->len = name->len;
+    ngx_memcpy(c->name, name->data, name->len);
+    c->valid = 1;
+
+    return c->uscf;
+}
+
+
+/*
+ * claims a free spare upstream, or the spare upstream of op->upstream, as op->claim.
+ * the response is "upstream zone_for_spare_1 claimed=svc_a;".
+ */
+ngx_int_t
+ngx_dynamic_upstream_spare_claim(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op, ngx_buf_t **bp)
+{
+    ngx_uint_t                        i, claimed;
+    ngx_buf_t                        *b;
+    ngx_str_t                        *name;
+    ngx_slab_pool_t                  *shpool, *lock;
+    ngx_http_upstream_srv_conf_t     *uscf, *first, **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    if (op->claim.len == 0 || op->claim.len > NGX_DYNAMIC_UPSTREAM_SPARE_NAME) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "claim is empty or longer than %d. %s:%d",
+                      NGX_DYNAMIC_UPSTREAM_SPARE_NAME,
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    umcf  = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    first = ngx_dynamic_upstream_spare_first(umcf);
+    if (first == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "no spare upstream is free. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_HTTP_CONFLICT;
+    }
+
+    /* the test of the name and the claim are not interleaved with another claim */
+    lock = (ngx_slab_pool_t *) first->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&lock->mutex);
+
+    /* a name is of a zone */
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        if ((uscf->shm_zone->shm.name.len == op->claim.len
+             && ngx_strncmp(uscf->shm_zone->shm.name.data, op->claim.data, op->claim.len) == 0)
+            || ngx_dynamic_upstream_spare_is_claimed(uscf, &op->claim, first))
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream %V already exists. %s:%d",
+                          &op->claim,
+                          __FUNCTION__,
+                          __LINE__);
+            goto done;
+        }
+    }
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL || uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+        if (!dus->spare || dus->sh == NULL) {
+            continue;
+        }
+
+        name = &uscf->shm_zone->shm.name;
+
+        if (op->upstream.len
+            && (name->len != op->upstream.len || ngx_strncmp(name->data, op->upstream.data, name->len) != 0))
+        {
+            continue;
+        }
+
+        shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+        if (uscf != first) {
+            ngx_shmtx_lock(&shpool->mutex);
+        }
+
+        claimed = (dus->sh->spare_len == 0);
+
+        if (claimed) {
+            ngx_memcpy(dus->sh->spare, op->claim.data, op->claim.len);
+            dus->sh->spare_len = op->claim.len;
+            dus->sh->generation++;
+        }
+
+        if (uscf != first) {
+            ngx_shmtx_unlock(&shpool->mutex);
+        }
+
+        if (!claimed) {
+            continue;
+        }
+
+        dus = ngx_http_conf_upstream_srv_conf(first, ngx_dynamic_upstream_module);
+        (void) ngx_atomic_fetch_add(&dus->sh->spare_generation, 1);
+
+        ngx_shmtx_unlock(&lock->mutex);
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "claimed upstream %V as %V", name, &op->claim);
+
+        b = ngx_create_temp_buf(r->pool, sizeof("upstream  claimed=;\n") - 1 + name->len + op->claim.len);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->last = ngx_sprintf(b->last, "upstream %V claimed=%V;\n", name, &op->claim);
+
+        *bp = b;
+
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "no spare upstream is free. %s:%d",
+                  __FUNCTION__,
+                  __LINE__);
+
+ done:
+
+    ngx_shmtx_unlock(&lock->mutex);
+
+    return NGX_HTTP_CONFLICT;
+}
+
+
+/*
+ * returns the spare upstream to the spares, the servers are left for the next claim to replace.
+ * the release is serialized with the claims by the lock of the first spare, taken before the lock of the spare.
+ */
+ngx_int_t
+ngx_dynamic_upstream_spare_release(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                   ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t *generation)
+{
+    ngx_uint_t                        released;
+    ngx_slab_pool_t                  *shpool, *lock;
+    ngx_http_upstream_srv_conf_t     *first;
+    ngx_dynamic_upstream_srv_conf_t  *dus, *fdus;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    first = ngx_dynamic_upstream_spare_first(ngx_http_get_module_main_conf(r, ngx_http_upstream_module));
+
+    released = 0;
+
+    if (dus->spare && dus->sh != NULL && first != NULL) {
+        fdus = ngx_http_conf_upstream_srv_conf(first, ngx_dynamic_upstream_module);
+
+        lock = (ngx_slab_pool_t *) first->shm_zone->shm.addr;
+        shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+        ngx_shmtx_lock(&lock->mutex);
+
+        if (uscf != first) {
+            ngx_shmtx_lock(&shpool->mutex);
+        }
+
+        released = (dus->sh->spare_len != 0);
+
+        if (released) {
+            dus->sh->spare_len = 0;
+            *generation = ++dus->sh->generation;
+            (void) ngx_atomic_fetch_add(&fdus->sh->spare_generation, 1);
+        }
+
+        if (uscf != first) {
+            ngx_shmtx_unlock(&shpool->mutex);
+        }
+
+        ngx_shmtx_unlock(&lock->mutex);
+    }
+
+    if (!released) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream %V is not a claimed spare. %s:%d",
+                      &op->upstream,
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "released upstream %V", &uscf->shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+/*
+ * dynamic_upstream_spare_variable $backend $host [default];
+ * $backend is the upstream claimed as the value of $host, or the default, or not found,
+ * so that "proxy_pass http://$backend;" uses the claimed upstream.
+ */
+char *
+ngx_dynamic_upstream_spare_variable(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                              *value, name;
+    ngx_http_variable_t                    *v;
+    ngx_http_compile_complex_value_t        ccv;
+    ngx_dynamic_upstream_spare_variable_t  *sv;
+
+    value = cf->args->elts;
+
+    if (value[1].len < 2 || value[1].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value[1].data + 1;
+    name.len = value[1].len - 1;
+
+    sv = ngx_pcalloc(cf->pool, sizeof(ngx_dynamic_upstream_spare_variable_t));
+    if (sv == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &sv->value;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 4) {
+        sv->default_value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+        if (sv->default_value == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[3];
+        ccv.complex_value = sv->default_value;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    v = ngx_http_add_variable(cf, &name, NGX_HTTP_VAR_NOCACHEABLE);
+    if (v == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    v->get_handler = ngx_dynamic_upstream_spare_get_variable;
+    v->data = (uintptr_t) sv;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_spare_get_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_dynamic_upstream_spare_variable_t *sv = (ngx_dynamic_upstream_spare_variable_t *) data;
+
+    ngx_str_t                      value;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (ngx_http_complex_value(r, &sv->value, &value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* the host of proxy_pass is matched with the name of the upstream block */
+    uscf = ngx_dynamic_upstream_spare_cached_zone(r, &value);
+
+    if (uscf != NULL) {
+        value = uscf->host;
+
+    } else if (sv->default_value == NULL) {
+        /* the name not claimed is not passed to proxy_pass as a host */
+        v->not_found = 1;
+        return NGX_OK;
+
+    } else if (ngx_http_complex_value(r, sv->default_value, &value) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    v->data = value.data;
+    v->len = value.len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
@@ -0,0 +1,18 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_SPARE_H
+#define NGX_DYNAMIC_UPSTREAM_SPARE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+ngx_http_upstream_srv_conf_t *ngx_dynamic_upstream_spare_get_zone(ngx_http_request_t *r, ngx_str_t *name);
+ngx_int_t ngx_dynamic_upstream_spare_claim(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op, ngx_buf_t **bp);
+ngx_int_t ngx_dynamic_upstream_spare_release(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                             ngx_http_upstream_srv_conf_t *uscf, ngx_uint_t *generation);
+char *ngx_dynamic_upstream_spare_variable(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_SPARE_H */
@@ -0,0 +1,493 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_state.h"
+
+
+/* weight of a new sample in the EWMA is 1/2^n */
+#define NGX_DYNAMIC_UPSTREAM_EWMA_SHIFT 3
+
+
+#define ngx_dynamic_upstream_state_addr_data(n)                                \
+    ((ngx_dynamic_upstream_peer_state_t *)                                     \
+         ((u_char *) (n) - offsetof(ngx_dynamic_upstream_peer_state_t, addr_node)))
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_state_ewma(ngx_uint_t avg, ngx_uint_t sample);
+static ngx_int_t
+ngx_dynamic_upstream_state_load(ngx_http_request_t *r, ngx_str_t *name);
+static ngx_rbtree_key_t
+ngx_dynamic_upstream_state_addr_key(struct sockaddr *sockaddr);
+static ngx_int_t
+ngx_dynamic_upstream_state_addr_cmp(struct sockaddr *one, struct sockaddr *two);
+static void
+ngx_dynamic_upstream_state_addr_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+                                       ngx_rbtree_node_t *sentinel);
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_state_ewma(ngx_uint_t avg, ngx_uint_t sample)
+{
+    if (sample > avg) {
+        return avg + ((sample - avg) >> NGX_DYNAMIC_UPSTREAM_EWMA_SHIFT);
+    }
+
+    return avg - ((avg - sample) >> NGX_DYNAMIC_UPSTREAM_EWMA_SHIFT);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_state_load(ngx_http_request_t *r, ngx_str_t *name)
+{
+    ngx_int_t         load;
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    part = &r->upstream->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash == 0
+            || h[i].key.len != name->len
+            || ngx_strncasecmp(h[i].key.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        /* "0.73" is 730, overloaded backends may report more than 1 */
+        load = ngx_atofp(h[i].value.data, h[i].value.len, 3);
+        if (load == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        return ngx_min(load, 1000);
+    }
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_state_init_zone(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_slab_pool_t                  *shpool;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_dynamic_upstream_shctx_t     *sh;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    sh = ngx_slab_calloc_locked(shpool, sizeof(ngx_dynamic_upstream_shctx_t));
+    if (sh == NULL) {
+        goto failed;
+    }
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_rbtree_insert_value);
+    ngx_rbtree_init(&sh->addrs, &sh->addrs_sentinel, ngx_dynamic_upstream_state_addr_insert);
+
+    sh->epoch = ngx_time();
+
+    /* the backup peers live in peers->next */
+    for (peers = uscf->peer.data; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+            if (ngx_dynamic_upstream_state_add_locked(shpool, sh, peer) != NGX_OK) {
+                goto failed;
+            }
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    dus->sh = sh;
+
+    return NGX_OK;
+
+ failed:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                  "failed to allocate peer states in upstream zone \"%V\"",
+                  &uscf->shm_zone->shm.name);
+
+    return NGX_ERROR;
+}
+
+
+ngx_dynamic_upstream_peer_state_t *
+ngx_dynamic_upstream_state_lookup(ngx_dynamic_upstream_shctx_t *sh, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_rbtree_key_t    key;
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    key = (ngx_rbtree_key_t) peer;
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        return (ngx_dynamic_upstream_peer_state_t *) node;
+    }
+
+    return NULL;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_state_add_locked(ngx_slab_pool_t *shpool, ngx_dynamic_upstream_shctx_t *sh,
+                                      ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    ps = ngx_slab_calloc_locked(shpool, sizeof(ngx_dynamic_upstream_peer_state_t));
+    if (ps == NULL) {
+        return NGX_ERROR;
+    }
+
+    ps->node.key = (ngx_rbtree_key_t) peer;
+    ps->peer = peer;
+    ps->weight = peer->weight;
+    ps->target = peer->weight;
+    ps->fail_timeout = peer->fail_timeout;
+
+    ngx_rbtree_insert(&sh->rbtree, &ps->node);
+
+    ps->addr_node.key = ngx_dynamic_upstream_state_addr_key(peer->sockaddr);
+
+    ngx_rbtree_insert(&sh->addrs, &ps->addr_node);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_dynamic_upstream_state_remove_locked(ngx_slab_pool_t *shpool, ngx_dynamic_upstream_shctx_t *sh,
+                                         ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    ps = ngx_dynamic_upstream_state_lookup(sh, peer);
+    if (ps == NULL) {
+        return;
+    }
+
+    if (ps->slow_start) {
+        sh->slow_start--;
+    }
+
+    if (ps->drain) {
+        sh->drain--;
+    }
+
+    ngx_rbtree_delete(&sh->rbtree, &ps->node);
+    ngx_rbtree_delete(&sh->addrs, &ps->addr_node);
+    ngx_slab_free_locked(shpool, ps);
+}
+
+
+/* finds the state of a peer of the address, the family, the address and the port are compared */
+ngx_dynamic_upstream_peer_state_t *
+ngx_dynamic_upstream_state_lookup_addr(ngx_dynamic_upstream_shctx_t *sh, struct sockaddr *sockaddr)
+{
+    ngx_int_t                           rc;
+    ngx_rbtree_key_t                    key;
+    ngx_rbtree_node_t                  *node, *sentinel;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    key = ngx_dynamic_upstream_state_addr_key(sockaddr);
+
+    node = sh->addrs.root;
+    sentinel = sh->addrs.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* key == node->key */
+
+        ps = ngx_dynamic_upstream_state_addr_data(node);
+
+        rc = ngx_dynamic_upstream_state_addr_cmp(sockaddr, ps->peer->sockaddr);
+
+        if (rc == 0) {
+            return ps;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/* the padding and the flow label of sockaddr are not a part of the key */
+static ngx_rbtree_key_t
+ngx_dynamic_upstream_state_addr_key(struct sockaddr *sockaddr)
+{
+    uint32_t              crc;
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin6;
+#endif
+#if (NGX_HAVE_UNIX_DOMAIN)
+    struct sockaddr_un   *saun;
+#endif
+
+    ngx_crc32_init(crc);
+
+    switch (sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) sockaddr;
+        ngx_crc32_update(&crc, (u_char *) &sin6->sin6_port, sizeof(in_port_t));
+        ngx_crc32_update(&crc, sin6->sin6_addr.s6_addr, 16);
+        break;
+#endif
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    case AF_UNIX:
+        saun = (struct sockaddr_un *) sockaddr;
+        ngx_crc32_update(&crc, (u_char *) saun->sun_path, ngx_strlen(saun->sun_path));
+        break;
+#endif
+
+    default: /* AF_INET */
+        sin = (struct sockaddr_in *) sockaddr;
+        ngx_crc32_update(&crc, (u_char *) &sin->sin_port, sizeof(in_port_t));
+        ngx_crc32_update(&crc, (u_char *) &sin->sin_addr.s_addr, sizeof(in_addr_t));
+        break;
+    }
+
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+
+/* orders the addresses of the same key */
+static ngx_int_t
+ngx_dynamic_upstream_state_addr_cmp(struct sockaddr *one, struct sockaddr *two)
+{
+    struct sockaddr_in   *sin1, *sin2;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin61, *sin62;
+#endif
+#if (NGX_HAVE_UNIX_DOMAIN)
+    struct sockaddr_un   *saun1, *saun2;
+#endif
+
+    if (one->sa_family != two->sa_family) {
+        return (ngx_int_t) one->sa_family - (ngx_int_t) two->sa_family;
+    }
+
+    switch (one->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin61 = (struct sockaddr_in6 *) one;
+        sin62 = (struct sockaddr_in6 *) two;
+
+        if (sin61->sin6_port != sin62->sin6_port) {
+            return (ngx_int_t) sin61->sin6_port - (ngx_int_t) sin62->sin6_port;
+        }
+
+        return ngx_memcmp(&sin61->sin6_addr, &sin62->sin6_addr, 16);
+#endif
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    case AF_UNIX:
+        saun1 = (struct sockaddr_un *) one;
+        saun2 = (struct sockaddr_un *) two;
+
+        return ngx_strcmp(saun1->sun_path, saun2->sun_path);
+#endif
+
+    default: /* AF_INET */
+        sin1 = (struct sockaddr_in *) one;
+        sin2 = (struct sockaddr_in *) two;
+
+        if (sin1->sin_port != sin2->sin_port) {
+            return (ngx_int_t) sin1->sin_port - (ngx_int_t) sin2->sin_port;
+        }
+
+        return ngx_memcmp(&sin1->sin_addr, &sin2->sin_addr, sizeof(struct in_addr));
+    }
+}
+
+
+static void
+ngx_dynamic_upstream_state_addr_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+                                       ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                  **p;
+    ngx_dynamic_upstream_peer_state_t   *ps, *pst;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            ps = ngx_dynamic_upstream_state_addr_data(node);
+            pst = ngx_dynamic_upstream_state_addr_data(temp);
+
+            p = (ngx_dynamic_upstream_state_addr_cmp(ps->peer->sockaddr, pst->peer->sockaddr) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_state_log_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                           load;
+    ngx_uint_t                          i, n;
+    ngx_msec_t                          sample;
+    ngx_http_upstream_state_t          *state;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_srv_conf_t       *uscf;
+    ngx_dynamic_upstream_srv_conf_t    *dus;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    if (r->upstream == NULL || r->upstream_states == NULL || r->upstream_states->nelts == 0) {
+        return NGX_OK;
+    }
+
+    uscf = r->upstream->upstream;
+    if (uscf == NULL || uscf->shm_zone == NULL || uscf->srv_conf == NULL) {
+        return NGX_OK;
+    }
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+    if (dus->sh == NULL || (!dus->stats && dus->load_header.len == 0)) {
+        return NGX_OK;
+    }
+
+    /* the response headers belong to the last tried peer */
+    load = NGX_ERROR;
+
+    if (dus->load_header.len) {
+        load = ngx_dynamic_upstream_state_load(r, &dus->load_header);
+    }
+
+    peers = uscf->peer.data;
+    state = r->upstream_states->elts;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+
+        if (state[i].peer == NULL) {
+            continue;
+        }
+
+        /*
+         * round robin based balancers point pc->name to peer->name,
+         * the peer is trusted only when it is found in the state tree.
+         */
+        peer = (ngx_http_upstream_rr_peer_t *)
+                   ((u_char *) state[i].peer - offsetof(ngx_http_upstream_rr_peer_t, name));
+
+        ps = ngx_dynamic_upstream_state_lookup(dus->sh, peer);
+        if (ps == NULL) {
+            continue;
+        }
+
+        ngx_http_upstream_rr_peer_lock(peers, peer);
+
+        if (load != NGX_ERROR && i == r->upstream_states->nelts - 1) {
+            ps->load = ngx_dynamic_upstream_state_ewma(ps->load, load);
+        }
+
+        if (dus->stats) {
+            sample = state[i].response_time * 1000;
+
+            ps->response_time = ps->requests ? ngx_dynamic_upstream_state_ewma(ps->response_time, sample) : sample;
+            ps->requests++;
+
+            if (state[i].response_length > 0) {
+                ps->bytes += state[i].response_length;
+            }
+
+            n = state[i].status / 100;
+            if (n >= 1 && n <= 5) {
+                ps->status[n - 1]++;
+            }
+        }
+
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+}
+
+
+u_char *
+ngx_dynamic_upstream_state_render(u_char *p, u_char *last, ngx_dynamic_upstream_peer_state_t *ps)
+{
+    return ngx_snprintf(p, last - p,
+                        " requests=%ui bytes=%O 1xx=%ui 2xx=%ui 3xx=%ui 4xx=%ui 5xx=%ui response_time=%M.%03M",
+                        ps->requests, ps->bytes,
+                        ps->status[0], ps->status[1], ps->status[2], ps->status[3], ps->status[4],
+                        ps->response_time / 1000000, ps->response_time / 1000 % 1000);
+}
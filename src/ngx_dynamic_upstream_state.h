@@ -0,0 +1,24 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_STATE_H
+#define NGX_DYNAMIC_UPSTREAM_STATE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+ngx_int_t ngx_dynamic_upstream_state_init_zone(ngx_cycle_t *cycle, ngx_http_upstream_srv_conf_t *uscf);
+ngx_dynamic_upstream_peer_state_t *ngx_dynamic_upstream_state_lookup(ngx_dynamic_upstream_shctx_t *sh,
+                                                                     ngx_http_upstream_rr_peer_t *peer);
+ngx_dynamic_upstream_peer_state_t *ngx_dynamic_upstream_state_lookup_addr(ngx_dynamic_upstream_shctx_t *sh,
+                                                                          struct sockaddr *sockaddr);
+ngx_int_t ngx_dynamic_upstream_state_add_locked(ngx_slab_pool_t *shpool, ngx_dynamic_upstream_shctx_t *sh,
+                                                ngx_http_upstream_rr_peer_t *peer);
+void ngx_dynamic_upstream_state_remove_locked(ngx_slab_pool_t *shpool, ngx_dynamic_upstream_shctx_t *sh,
+                                              ngx_http_upstream_rr_peer_t *peer);
+ngx_int_t ngx_dynamic_upstream_state_log_handler(ngx_http_request_t *r);
+u_char *ngx_dynamic_upstream_state_render(u_char *p, u_char *last, ngx_dynamic_upstream_peer_state_t *ps);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_STATE_H */
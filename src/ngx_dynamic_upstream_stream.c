@@ -0,0 +1,596 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+
+#include "ngx_dynamic_upstream_stream.h"
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_inet_slab.h"
+
+
+/* a removed peer still in use, released by the worker which removed it */
+typedef struct {
+    ngx_stream_upstream_srv_conf_t  *uscf;
+    ngx_stream_upstream_rr_peer_t   *peer;
+} ngx_dynamic_upstream_stream_retired_t;
+
+
+static ngx_stream_upstream_srv_conf_t *
+ngx_dynamic_upstream_stream_get_zone(ngx_dynamic_upstream_op_t *op);
+static ngx_stream_upstream_rr_peer_t *
+ngx_dynamic_upstream_stream_find_peer(ngx_dynamic_upstream_op_t *op, ngx_stream_upstream_rr_peers_t *peers,
+                                      ngx_stream_upstream_rr_peers_t **list, ngx_stream_upstream_rr_peer_t **prev);
+static ngx_int_t
+ngx_dynamic_upstream_stream_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                               ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf);
+static ngx_int_t
+ngx_dynamic_upstream_stream_op_add(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                   ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf);
+static ngx_int_t
+ngx_dynamic_upstream_stream_op_remove(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                      ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf);
+static ngx_int_t
+ngx_dynamic_upstream_stream_op_update_param(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                            ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf);
+static ngx_int_t
+ngx_dynamic_upstream_stream_retire(ngx_stream_upstream_srv_conf_t *uscf, ngx_stream_upstream_rr_peer_t *peer);
+static void
+ngx_dynamic_upstream_stream_free_peer(ngx_slab_pool_t *shpool, ngx_stream_upstream_rr_peer_t *peer);
+static void
+ngx_dynamic_upstream_stream_recalc_weight(ngx_stream_upstream_rr_peers_t *peers);
+static ngx_int_t
+ngx_dynamic_upstream_stream_create_response_buf(ngx_stream_upstream_srv_conf_t *uscf, ngx_buf_t *b,
+                                                size_t size, ngx_int_t verbose);
+
+
+static ngx_array_t  *ngx_dynamic_upstream_stream_retired;
+static ngx_cycle_t  *ngx_dynamic_upstream_stream_retired_cycle;
+
+
+static ngx_stream_upstream_srv_conf_t *
+ngx_dynamic_upstream_stream_get_zone(ngx_dynamic_upstream_op_t *op)
+{
+    ngx_uint_t                        i;
+    ngx_stream_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_stream_cycle_get_module_main_conf(ngx_cycle, ngx_stream_upstream_module);
+    if (umcf == NULL) {
+        return NULL;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+        if (uscf->shm_zone != NULL &&
+            uscf->shm_zone->shm.name.len == op->upstream.len &&
+            ngx_strncmp(uscf->shm_zone->shm.name.data, op->upstream.data, op->upstream.len) == 0)
+        {
+            return uscf;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_stream_upstream_rr_peer_t *
+ngx_dynamic_upstream_stream_find_peer(ngx_dynamic_upstream_op_t *op, ngx_stream_upstream_rr_peers_t *peers,
+                                      ngx_stream_upstream_rr_peers_t **list, ngx_stream_upstream_rr_peer_t **prev)
+{
+    ngx_stream_upstream_rr_peer_t   *peer, *p;
+    ngx_stream_upstream_rr_peers_t  *l;
+
+    for (l = op->backup ? peers->next : peers; l; l = l->next) {
+        p = NULL;
+
+        for (peer = l->peer; peer; peer = peer->next) {
+            if (ngx_dynamic_upstream_op_is_server(op, &peer->name, peer->sockaddr, peer->socklen)) {
+                *list = l;
+
+                if (prev) {
+                    *prev = p;
+                }
+
+                return peer;
+            }
+
+            p = peer;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_stream_op(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                               ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_int_t  rc;
+
+    switch (op->op) {
+    case NGX_DYNAMIC_UPSTEAM_OP_ADD:
+        rc = ngx_dynamic_upstream_stream_op_add(r, op, shpool, uscf);
+        break;
+    case NGX_DYNAMIC_UPSTEAM_OP_REMOVE:
+        rc = ngx_dynamic_upstream_stream_op_remove(r, op, shpool, uscf);
+        break;
+    case NGX_DYNAMIC_UPSTEAM_OP_PARAM:
+        rc = ngx_dynamic_upstream_stream_op_update_param(r, op, shpool, uscf);
+        break;
+    case NGX_DYNAMIC_UPSTEAM_OP_LIST:
+    default:
+        rc = NGX_OK;
+        break;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_stream_op_add(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                   ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_url_t                        u;
+    ngx_stream_upstream_rr_peer_t   *peer, *last;
+    ngx_stream_upstream_rr_peers_t  *peers, *list;
+
+    peers = uscf->peer.data;
+
+    for (list = peers; list; list = list->next) {
+        for (peer = list->peer; peer; peer = peer->next) {
+            if (ngx_dynamic_upstream_op_is_server(op, &peer->name, peer->sockaddr, peer->socklen)) {
+                op->status = NGX_HTTP_BAD_REQUEST;
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "server %V already exists in upstream. %s:%d",
+                              &op->server,
+                              __FUNCTION__,
+                              __LINE__);
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (op->backup && peers->next == NULL) {
+        peers->next = ngx_slab_calloc_locked(shpool, sizeof(ngx_stream_upstream_rr_peers_t));
+        if (peers->next == NULL) {
+            op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "failed to allocate memory from slab %s:%d",
+                          __FUNCTION__,
+                          __LINE__);
+            return NGX_ERROR;
+        }
+
+        peers->next->shpool = shpool;
+        peers->next->name   = peers->name;
+    }
+
+    list = op->backup ? peers->next : peers;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url.data = ngx_slab_alloc_locked(shpool, op->server.len + 1);
+    if (u.url.data == NULL) {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "failed to allocate memory from slab %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+    ngx_cpystrn(u.url.data, op->server.data, op->server.len + 1);
+    u.url.len = op->server.len;
+
+    if (ngx_parse_url_slab(shpool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "%s in upstream \"%V\"", u.err, &u.url);
+        }
+
+        ngx_slab_free_locked(shpool, u.url.data);
+        op->status = NGX_HTTP_BAD_REQUEST;
+        return NGX_ERROR;
+    }
+
+    /* stream servers have no default port */
+    if (u.no_port) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "no port in upstream \"%V\"", &u.url);
+        ngx_slab_free_locked(shpool, u.url.data);
+        op->status = NGX_HTTP_BAD_REQUEST;
+        return NGX_ERROR;
+    }
+
+    peer = ngx_slab_calloc_locked(shpool, sizeof(ngx_stream_upstream_rr_peer_t));
+    if (peer == NULL) {
+        ngx_slab_free_locked(shpool, u.url.data);
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "failed to allocate memory from slab %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+
+    peer->name     = u.url;
+    peer->server   = u.url;
+    peer->sockaddr = u.addrs[0].sockaddr;
+    peer->socklen  = u.addrs[0].socklen;
+
+    peer->weight           = (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) ? op->weight : 1;
+    peer->effective_weight = peer->weight;
+    peer->max_fails        = (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) ? op->max_fails : 1;
+    peer->fail_timeout     = (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) ? op->fail_timeout : 10;
+    peer->down             = op->down;
+
+    for (last = list->peer; last && last->next; last = last->next) { /* void */ }
+
+    if (last == NULL) {
+        list->peer = peer;
+    } else {
+        last->next = peer;
+    }
+
+    list->number++;
+    list->total_weight += peer->weight;
+#if (NGX_DYNAMIC_UPSTREAM_TRIES)
+    /* a backup list created by the API starts with no tries */
+    list->tries++;
+#endif
+    list->single = (list == peers && list->number == 1);
+    list->weighted = (list->total_weight != list->number);
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "added stream %sserver %V", op->backup ? "backup " : "", &op->server);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_stream_op_remove(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                      ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                       weight;
+    ngx_stream_upstream_rr_peer_t   *target, *prev;
+    ngx_stream_upstream_rr_peers_t  *peers, *list;
+
+    peers = uscf->peer.data;
+
+    prev = NULL;
+    target = ngx_dynamic_upstream_stream_find_peer(op, peers, &list, &prev);
+
+    if (target == NULL) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "server %V is not found. %s:%d",
+                      &op->server,
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+
+    /* the primary peers can not be empty */
+    if (list == peers && peers->number < 2) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        return NGX_ERROR;
+    }
+
+    weight = target->weight;
+
+    if (prev == NULL) {
+        list->peer = target->next;
+    } else {
+        prev->next = target->next;
+    }
+
+    list->number--;
+    list->total_weight -= weight;
+#if (NGX_DYNAMIC_UPSTREAM_TRIES)
+    /* the tries are not more than the servers left */
+    list->tries = ngx_min(list->tries, list->number);
+#endif
+    list->single = (list == peers && list->number == 1);
+    list->weighted = (list->total_weight != list->number);
+
+    /*
+     * the balancer releases the peer at the end of the session,
+     * so the peer in use is unlinked and released by the tick.
+     */
+    if (target->conns) {
+        target->down = 1;
+
+        if (ngx_dynamic_upstream_stream_retire(uscf, target) != NGX_OK) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "removed stream %sserver %V is not released",
+                          list != peers ? "backup " : "", &op->server);
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "removing stream %sserver %V after %ui connections",
+                      list != peers ? "backup " : "", &op->server, target->conns);
+
+        return NGX_OK;
+    }
+
+    ngx_dynamic_upstream_stream_free_peer(shpool, target);
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "removed stream %sserver %V", list != peers ? "backup " : "", &op->server);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_stream_retire(ngx_stream_upstream_srv_conf_t *uscf, ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_dynamic_upstream_stream_retired_t  *rt;
+
+    /* the peers of the previous cycle are gone with its zones */
+    if (ngx_dynamic_upstream_stream_retired == NULL
+        || ngx_dynamic_upstream_stream_retired_cycle != ngx_cycle)
+    {
+        ngx_dynamic_upstream_stream_retired = ngx_array_create(ngx_cycle->pool, 4,
+                                                               sizeof(ngx_dynamic_upstream_stream_retired_t));
+        if (ngx_dynamic_upstream_stream_retired == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_dynamic_upstream_stream_retired_cycle = (ngx_cycle_t *) ngx_cycle;
+    }
+
+    rt = ngx_array_push(ngx_dynamic_upstream_stream_retired);
+    if (rt == NULL) {
+        return NGX_ERROR;
+    }
+
+    rt->uscf = uscf;
+    rt->peer = peer;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_stream_free_peer(ngx_slab_pool_t *shpool, ngx_stream_upstream_rr_peer_t *peer)
+{
+    /* the peers of the configuration are not allocated in the slab */
+    if ((u_char *) peer->name.data >= shpool->start && (u_char *) peer->name.data <= shpool->end) {
+        ngx_slab_free_locked(shpool, peer->name.data);
+    }
+
+    if ((u_char *) peer->sockaddr >= shpool->start && (u_char *) peer->sockaddr <= shpool->end) {
+        ngx_slab_free_locked(shpool, peer->sockaddr);
+    }
+
+    ngx_slab_free_locked(shpool, peer);
+}
+
+
+/* releases the removed peers of the worker without the connections */
+void
+ngx_dynamic_upstream_stream_tick(void)
+{
+    ngx_uint_t                              i, n;
+    ngx_slab_pool_t                        *shpool;
+    ngx_stream_upstream_rr_peers_t         *peers;
+    ngx_dynamic_upstream_stream_retired_t  *rt;
+
+    if (ngx_dynamic_upstream_stream_retired == NULL
+        || ngx_dynamic_upstream_stream_retired_cycle != ngx_cycle)
+    {
+        return;
+    }
+
+    rt = ngx_dynamic_upstream_stream_retired->elts;
+    n = 0;
+
+    for (i = 0; i < ngx_dynamic_upstream_stream_retired->nelts; i++) {
+        shpool = (ngx_slab_pool_t *) rt[i].uscf->shm_zone->shm.addr;
+        peers = rt[i].uscf->peer.data;
+
+        if (!ngx_shmtx_trylock(&shpool->mutex)) {
+            rt[n++] = rt[i];
+            continue;
+        }
+
+        ngx_stream_upstream_rr_peers_wlock(peers);
+
+        if (rt[i].peer->conns) {
+            rt[n++] = rt[i];
+
+        } else {
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "removed stream server %V", &rt[i].peer->name);
+
+            ngx_dynamic_upstream_stream_free_peer(shpool, rt[i].peer);
+        }
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    ngx_dynamic_upstream_stream_retired->nelts = n;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_stream_op_update_param(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op,
+                                            ngx_slab_pool_t *shpool, ngx_stream_upstream_srv_conf_t *uscf)
+{
+    ngx_stream_upstream_rr_peer_t   *target;
+    ngx_stream_upstream_rr_peers_t  *peers, *list;
+
+    peers = uscf->peer.data;
+
+    target = ngx_dynamic_upstream_stream_find_peer(op, peers, &list, NULL);
+
+    if (target == NULL) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "server %V is not found. %s:%d",
+                      &op->server,
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_ERROR;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
+        target->weight = op->weight;
+        target->effective_weight = op->weight;
+        ngx_dynamic_upstream_stream_recalc_weight(list);
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS) {
+        target->max_fails = op->max_fails;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT) {
+        target->fail_timeout = op->fail_timeout;
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) {
+        target->down = 0;
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "upped stream server %V", &op->server);
+    }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
+        target->down = 1;
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "downed stream server %V", &op->server);
+    }
+
+    return NGX_OK;
+}
+
+
+/* same as ngx_dynamic_upstream_op_recalc_weight() */
+static void
+ngx_dynamic_upstream_stream_recalc_weight(ngx_stream_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                      w;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
+    w = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        peer->current_weight = 0;
+        w += peer->weight;
+    }
+
+    peers->total_weight = w;
+    peers->weighted = (peers->total_weight != peers->number);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_stream_create_response_buf(ngx_stream_upstream_srv_conf_t *uscf, ngx_buf_t *b,
+                                                size_t size, ngx_int_t verbose)
+{
+    ngx_stream_upstream_rr_peer_t   *peer;
+    ngx_stream_upstream_rr_peers_t  *peers, *list;
+    u_char                           namebuf[512], *last;
+
+    last = b->last + size;
+
+    peers = uscf->peer.data;
+
+    for (list = peers; list; list = list->next) {
+
+        for (peer = list->peer; peer; peer = peer->next) {
+
+            if (peer->name.len > 511) {
+                return NGX_ERROR;
+            }
+
+            ngx_cpystrn(namebuf, peer->name.data, peer->name.len + 1);
+
+            if (verbose) {
+                b->last = ngx_snprintf(b->last, last - b->last, "server %s weight=%d max_fails=%d fail_timeout=%d",
+                                       namebuf, peer->weight, peer->max_fails, peer->fail_timeout);
+
+            } else {
+                b->last = ngx_snprintf(b->last, last - b->last, "server %s", namebuf);
+            }
+
+            if (list != peers) {
+                b->last = ngx_snprintf(b->last, last - b->last, " backup");
+            }
+
+            b->last = peer->down ? ngx_snprintf(b->last, last - b->last, " down;\n") : ngx_snprintf(b->last, last - b->last, ";\n");
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_stream_handler(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op, ngx_buf_t **bp)
+{
+    size_t                           size;
+    ngx_int_t                        rc;
+    ngx_buf_t                       *b;
+    ngx_slab_pool_t                 *shpool;
+    ngx_stream_upstream_srv_conf_t  *uscf;
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    uscf = ngx_dynamic_upstream_stream_get_zone(op);
+    if (uscf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "stream upstream is not found. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+    peers = uscf->peer.data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+    ngx_stream_upstream_rr_peers_wlock(peers);
+
+    rc = ngx_dynamic_upstream_stream_op(r, op, shpool, uscf);
+
+    ngx_stream_upstream_rr_peers_unlock(peers);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (rc != NGX_OK) {
+        if (op->status == NGX_HTTP_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        return op->status;
+    }
+
+    size = uscf->shm_zone->shm.size;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+    rc = ngx_dynamic_upstream_stream_create_response_buf(uscf, b, size, op->verbose);
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "failed to create a response. %s:%d",
+                      __FUNCTION__,
+                      __LINE__);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    *bp = b;
+
+    return NGX_OK;
+}
@@ -0,0 +1,16 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_STREAM_H
+#define NGX_DYNAMIC_UPSTREAM_STREAM_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+/* returns NGX_OK with the list in *bp, or a HTTP status code */
+ngx_int_t ngx_dynamic_upstream_stream_handler(ngx_http_request_t *r, ngx_dynamic_upstream_op_t *op, ngx_buf_t **bp);
+void ngx_dynamic_upstream_stream_tick(void);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_STREAM_H */
@@ -0,0 +1,200 @@
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_state.h"
+#include "ngx_dynamic_upstream_weight.h"
+
+
+/* response times below 1ms are not distinguished (usec) */
+#define NGX_DYNAMIC_UPSTREAM_WEIGHT_MIN_RESPONSE_TIME 1000
+
+/* the weight scaled by the load is multiplied first, not to be rounded to the weight 1 */
+#define NGX_DYNAMIC_UPSTREAM_WEIGHT_LOAD_BASE         100
+
+
+static void
+ngx_dynamic_upstream_weight_adjust(ngx_dynamic_upstream_srv_conf_t *dus, ngx_http_upstream_rr_peers_t *peers,
+                                   ngx_uint_t full);
+
+
+/*
+ * recomputes the weights of peers with the full adjustment,
+ * or only ramps the weights of the peers in the slow start.
+ */
+static void
+ngx_dynamic_upstream_weight_adjust(ngx_dynamic_upstream_srv_conf_t *dus, ngx_http_upstream_rr_peers_t *peers,
+                                   ngx_uint_t full)
+{
+    ngx_int_t                           weight, factor;
+    ngx_uint_t                          changed;
+    ngx_msec_t                          fastest, rt;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_dynamic_upstream_peer_state_t  *ps;
+
+    fastest = 0;
+
+    for (peer = peers->peer; full && dus->latency_weight && peer; peer = peer->next) {
+        ps = ngx_dynamic_upstream_state_lookup(dus->sh, peer);
+        if (ps == NULL || ps->requests == 0) {
+            continue;
+        }
+
+        rt = ngx_max(ps->response_time, NGX_DYNAMIC_UPSTREAM_WEIGHT_MIN_RESPONSE_TIME);
+
+        if (fastest == 0 || rt < fastest) {
+            fastest = rt;
+        }
+    }
+
+    changed = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        ps = ngx_dynamic_upstream_state_lookup(dus->sh, peer);
+        if (ps == NULL || (!full && ps->slow_start == 0)) {
+            continue;
+        }
+
+        weight = full ? ps->weight : ps->target;
+
+        /* the configured weight is scaled, so that the ratios of the weights are kept */
+        if (fastest) {
+
+            /* peers without observations get the full factor to be observed */
+            if (ps->requests == 0) {
+                factor = dus->latency_weight_max;
+
+            } else {
+                rt = ngx_max(ps->response_time, NGX_DYNAMIC_UPSTREAM_WEIGHT_MIN_RESPONSE_TIME);
+                factor = (ngx_int_t) (dus->latency_weight_max * fastest / rt);
+            }
+
+            factor = ngx_max(factor, dus->latency_weight_min);
+            factor = ngx_min(factor, dus->latency_weight_max);
+
+            weight = ps->weight * factor;
+        }
+
+        if (full && dus->load_header.len) {
+            weight = weight * NGX_DYNAMIC_UPSTREAM_WEIGHT_LOAD_BASE * (ngx_int_t) (1000 - ps->load) / 1000;
+            weight = ngx_max(weight, 1);
+        }
+
+        ps->target = weight;
+
+        if (ps->slow_start) {
+            weight = ngx_dynamic_upstream_weight_ramp(dus->sh, ps, weight);
+        }
+
+        if (weight != peer->weight) {
+            ngx_dynamic_upstream_op_set_weight(peer, weight);
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        ngx_dynamic_upstream_op_recalc_weight(peers);
+    }
+}
+
+
+/* starts the ramp of the weight from 1, the caller recalculates the peers */
+void
+ngx_dynamic_upstream_weight_slow_start(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_peer_state_t *ps,
+                                       ngx_msec_t slow_start)
+{
+    if (ps->slow_start == 0) {
+        sh->slow_start++;
+    }
+
+    ps->slow_start = slow_start;
+    ps->slow_start_begin = ngx_current_msec;
+
+    ngx_dynamic_upstream_op_set_weight(ps->peer, 1);
+}
+
+
+/* returns the ramped weight, the slow start is finished when it is over */
+ngx_int_t
+ngx_dynamic_upstream_weight_ramp(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_peer_state_t *ps,
+                                 ngx_int_t weight)
+{
+    ngx_msec_t  elapsed;
+
+    elapsed = ngx_current_msec - ps->slow_start_begin;
+
+    if (elapsed >= ps->slow_start) {
+        ps->slow_start = 0;
+        sh->slow_start--;
+        return weight;
+    }
+
+    weight = (ngx_int_t) (weight * elapsed / ps->slow_start);
+
+    return ngx_max(weight, 1);
+}
+
+
+void
+ngx_dynamic_upstream_weight_tick(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                        full;
+    ngx_msec_t                        interval;
+    ngx_slab_pool_t                  *shpool;
+    ngx_http_upstream_rr_peers_t     *peers, *list;
+    ngx_dynamic_upstream_shctx_t     *sh;
+    ngx_dynamic_upstream_srv_conf_t  *dus;
+
+    dus = ngx_http_conf_upstream_srv_conf(uscf, ngx_dynamic_upstream_module);
+
+    interval = dus->latency_weight;
+
+    if (dus->load_weight && (interval == 0 || dus->load_weight < interval)) {
+        interval = dus->load_weight;
+    }
+
+    sh = dus->sh;
+
+    /*
+     * unlocked check, every worker ticks but one of them adjusts per interval.
+     * the weights in the slow start are ramped on every tick.
+     */
+    if (sh->slow_start == 0 && (interval == 0 || sh->weight_next > ngx_current_msec)) {
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    if (!ngx_shmtx_trylock(&shpool->mutex)) {
+        return;
+    }
+
+    full = 0;
+
+    if (interval && sh->weight_next <= ngx_current_msec) {
+
+        /* the first interval only collects observations */
+        full = (sh->weight_next != 0);
+
+        sh->weight_next = ngx_current_msec + interval;
+    }
+
+    if (!full && sh->slow_start == 0) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    peers = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    for (list = peers; list; list = list->next) {
+        ngx_dynamic_upstream_weight_adjust(dus, list, full);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+    ngx_shmtx_unlock(&shpool->mutex);
+}
@@ -0,0 +1,18 @@
+#ifndef NGX_DYNAMIC_UPSTREAM_WEIGHT_H
+#define NGX_DYNAMIC_UPSTREAM_WEIGHT_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+void ngx_dynamic_upstream_weight_tick(ngx_http_upstream_srv_conf_t *uscf);
+void ngx_dynamic_upstream_weight_slow_start(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_peer_state_t *ps,
+                                            ngx_msec_t slow_start);
+ngx_int_t ngx_dynamic_upstream_weight_ramp(ngx_dynamic_upstream_shctx_t *sh, ngx_dynamic_upstream_peer_state_t *ps,
+                                           ngx_int_t weight);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_WEIGHT_H */
@@ -3,7 +3,7 @@ use Test::Nginx::Socket;
 
 #repeat_each(2);
 
-plan tests => repeat_each() * 2 * blocks();
+plan tests => repeat_each() * (2 * blocks() + 16);
 
 run_tests();
 
@@ -141,3 +141,42 @@ server 127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=5;
     GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6003&fail_timeout=abc
 --- response_body_like: 400 Bad Request
 --- error_code: 400
+
+
+=== TEST 8: distribution after updating weight
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+
+    server {
+        listen 6001;
+
+        location / {
+            return 200 "6001";
+        }
+    }
+
+    server {
+        listen 6002;
+
+        location / {
+            return 200 "6002";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+--- request eval
+["GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&weight=3",
+ "GET /", "GET /", "GET /", "GET /", "GET /", "GET /", "GET /", "GET /"]
+--- response_body eval
+["server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;\nserver 127.0.0.1:6002 weight=3 max_fails=1 fail_timeout=10;\n",
+ "6002", "6001", "6002", "6002", "6002", "6001", "6002", "6002"]
@@ -0,0 +1,74 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: list verbose with stats
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_stats on;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&verbose=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 requests=0 bytes=0 1xx=0 2xx=0 3xx=0 4xx=0 5xx=0 response_time=0.000;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 requests=0 bytes=0 1xx=0 2xx=0 3xx=0 4xx=0 5xx=0 response_time=0.000;
+
+
+=== TEST 2: stats are collected in log phase
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_stats on;
+        server 127.0.0.1:6001;
+    }
+
+    server {
+        listen 6001;
+
+        location / {
+            return 200 "6001";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+--- request eval
+["GET /", "GET /dynamic?upstream=zone_for_backends&verbose="]
+--- response_body_like eval
+["^6001\$", "^server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 requests=1 bytes=\\d+ 1xx=0 2xx=1 3xx=0 4xx=0 5xx=0 response_time=\\d+\\.\\d{3};\\n\$"]
+
+
+=== TEST 3: stats of added server
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_stats on;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+["GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=", "GET /dynamic?upstream=zone_for_backends&verbose="]
+--- response_body eval
+["server 127.0.0.1:6001;\nserver 127.0.0.1:6002;\n", "server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 requests=0 bytes=0 1xx=0 2xx=0 3xx=0 4xx=0 5xx=0 response_time=0.000;\nserver 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 requests=0 bytes=0 1xx=0 2xx=0 3xx=0 4xx=0 5xx=0 response_time=0.000;\n"]
@@ -0,0 +1,107 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 10);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: latency weight collects stats
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_latency_weight interval=5s min=2 max=50;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&verbose=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 requests=0 bytes=0 1xx=0 2xx=0 3xx=0 4xx=0 5xx=0 response_time=0.000;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 requests=0 bytes=0 1xx=0 2xx=0 3xx=0 4xx=0 5xx=0 response_time=0.000;
+
+
+=== TEST 2: weights are kept until the first interval
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_stats on;
+        dynamic_upstream_latency_weight interval=1h;
+        server 127.0.0.1:6001 weight=3;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+
+
+=== TEST 3: the configured weights are scaled by the latency
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_latency_weight interval=1s min=2 max=50;
+        server 127.0.0.1:6001 weight=2;
+        server 127.0.0.1:6002;
+    }
+
+    server {
+        listen 6001;
+
+        location / {
+            return 200 "6001";
+        }
+    }
+
+    server {
+        listen 6002;
+
+        location / {
+            limit_rate 1k;
+            rewrite ^ /slow.txt break;
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+
+    location = /slow.txt {
+        limit_rate 1k;
+    }
+--- user_files eval
+">>> slow.txt\n" . ("x" x 2048)
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&down=",
+    "GET /",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&up=",
+    "GET /",
+    "GET /slow.txt",
+    "GET /dynamic?upstream=zone_for_backends&verbose=",
+]
+--- response_body_like eval
+[
+    "down",
+    "^x{2048}\$",
+    "127.0.0.1:6001",
+    "^6001\$",
+    "^x{2048}\$",
+    "^server 127.0.0.1:6001 weight=100 [^\\n]*\\nserver 127.0.0.1:6002 weight=2 ",
+]
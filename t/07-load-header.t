@@ -0,0 +1,109 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 12);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: list verbose with load
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_load_header X-Backend-Load interval=1h;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&verbose=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 load=0.000;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 load=0.000;
+
+
+=== TEST 2: load is smoothed from the response header
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_load_header X-Backend-Load interval=1h;
+        server 127.0.0.1:6001;
+    }
+
+    server {
+        listen 6001;
+
+        location / {
+            add_header X-Backend-Load 0.8;
+            return 200 "6001";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+--- request eval
+["GET /", "GET /dynamic?upstream=zone_for_backends&verbose="]
+--- response_body eval
+["6001", "server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 load=0.100;\n"]
+
+
+=== TEST 3: the weight of the loaded server drops
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_load_header X-Backend-Load interval=1s;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 down;
+    }
+
+    server {
+        listen 6001;
+
+        location / {
+            add_header X-Backend-Load 0.8;
+            return 200 "6001";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+
+    location = /slow.txt {
+        limit_rate 1k;
+    }
+--- user_files eval
+">>> slow.txt\n" . ("x" x 2048)
+--- request eval
+[
+    "GET /",
+    "GET /",
+    "GET /",
+    "GET /",
+    "GET /slow.txt",
+    "GET /dynamic?upstream=zone_for_backends&verbose=",
+]
+--- response_body_like eval
+[
+    "^6001\$",
+    "^6001\$",
+    "^6001\$",
+    "^6001\$",
+    "^x{2048}\$",
+    "^server 127.0.0.1:6001 weight=[1-9][0-9]? [^\\n]*\\nserver 127.0.0.1:6002 weight=100 ",
+]
@@ -0,0 +1,156 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: list backup
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+server 127.0.0.1:6003 backup;
+
+
+=== TEST 2: add backup
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6003&add=&backup=
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+server 127.0.0.1:6003 backup;
+
+
+=== TEST 3: add duplicated backup
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=
+--- response_body_like: 400 Bad Request
+--- error_code: 400
+
+
+=== TEST 4: remove backup
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&remove=
+--- response_body
+server 127.0.0.1:6001;
+
+
+=== TEST 5: update backup parameters
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&backup=&weight=5&down=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=5 max_fails=1 fail_timeout=10 backup down;
+
+
+=== TEST 6: fail over to added backup
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001 down;
+    }
+
+    server {
+        listen 6002;
+
+        location / {
+            return 200 "6002";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+--- request eval
+["GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=&backup=", "GET /"]
+--- response_body eval
+["server 127.0.0.1:6001 down;\nserver 127.0.0.1:6002 backup;\n", "6002"]
+
+
+=== TEST 7: fail over to added backup after the primary fails
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6003;
+    }
+
+    server {
+        listen 6002;
+
+        location / {
+            return 200 "6002";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+--- request eval
+["GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=&backup=", "GET /"]
+--- response_body eval
+["server 127.0.0.1:6003;\nserver 127.0.0.1:6002 backup;\n", "6002"]
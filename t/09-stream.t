@@ -0,0 +1,134 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: list stream
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&stream=
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+server 127.0.0.1:6003;
+
+
+=== TEST 2: add stream
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&stream=&server=127.0.0.1:6003&add=
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+server 127.0.0.1:6003;
+
+
+=== TEST 3: add stream without port
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&stream=&server=127.0.0.1&add=
+--- response_body_like: 400 Bad Request
+--- error_code: 400
+
+
+=== TEST 4: remove stream
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&stream=&server=127.0.0.1:6002&remove=
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6003;
+
+
+=== TEST 5: update parameters of stream
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&stream=&server=127.0.0.1:6002&weight=5&max_fails=3&fail_timeout=5&down=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=5 max_fails=3 fail_timeout=5 down;
+
+
+=== TEST 6: add stream backup
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&stream=&server=127.0.0.1:6002&add=&backup=
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002 backup;
+
+
+=== TEST 7: http upstream is not a stream upstream
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&stream=
+--- response_body_like: 404 Not Found
+--- error_code: 404
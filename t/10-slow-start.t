@@ -0,0 +1,80 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: add with slow_start
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6003&add=&weight=5&slow_start=10
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=10 slow_start=10;
+
+
+=== TEST 2: up with slow_start
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 weight=5 down;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&up=&slow_start=10
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 slow_start=10;
+
+
+=== TEST 3: up with slow_start for the server which is not down
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 weight=5;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&up=&slow_start=10
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=5 max_fails=1 fail_timeout=10;
+
+
+=== TEST 4: invalid slow_start
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&up=&slow_start=a
+--- response_body_like: 400 Bad Request
+--- error_code: 400
@@ -0,0 +1,88 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: drain
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&drain=30
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 drain down;
+
+
+=== TEST 2: drain the last primary server
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&drain=
+--- response_body_like: 400 Bad Request
+--- error_code: 400
+
+
+=== TEST 3: up cancels drain
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&drain=",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&up=",
+]
+--- response_body eval
+[
+    "server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 drain down;
+",
+    "server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+",
+]
+
+
+=== TEST 4: drain and up at once
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&drain=&up=
+--- response_body_like: 400 Bad Request
+--- error_code: 400
@@ -0,0 +1,123 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: list with tcp check
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        dynamic_upstream_check interval=10s timeout=1s rise=1 fall=1;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&verbose=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+
+
+=== TEST 2: list with http check
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+        dynamic_upstream_check interval=10s type=http uri=/health status=200;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&verbose=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 backup;
+
+
+=== TEST 3: a closed port is downed by the tcp check
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6003;
+        dynamic_upstream_check interval=1s timeout=1s rise=1 fall=1;
+    }
+
+    server {
+        listen 6001;
+
+        location / {
+            return 200 "6001";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location = /slow.txt {
+        limit_rate 1k;
+    }
+--- user_files eval
+">>> slow.txt\n" . ("x" x 3072)
+--- request eval
+[
+    "GET /slow.txt",
+    "GET /dynamic?upstream=zone_for_backends&verbose=",
+]
+--- response_body_like eval
+[
+    "^x{3072}\$",
+    "^server 127.0.0.1:6001 [^\\n]* check=ok checks=\\d+;\\nserver 127.0.0.1:6003 [^\\n]* check=failed checks=\\d+ down;\\n\$",
+]
+
+
+=== TEST 4: a closed port is not downed before fall
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6003;
+        dynamic_upstream_check interval=1s timeout=1s rise=1 fall=100;
+    }
+
+    server {
+        listen 6001;
+
+        location / {
+            return 200 "6001";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location = /slow.txt {
+        limit_rate 1k;
+    }
+--- user_files eval
+">>> slow.txt\n" . ("x" x 3072)
+--- request eval
+[
+    "GET /slow.txt",
+    "GET /dynamic?upstream=zone_for_backends&verbose=",
+]
+--- response_body_like eval
+[
+    "^x{3072}\$",
+    "^server 127.0.0.1:6001 [^\\n]* check=ok checks=\\d+;\\nserver 127.0.0.1:6003 [^\\n]* check=failed checks=\\d+;\\n\$",
+]
@@ -0,0 +1,101 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 12);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: list with backoff
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001 fail_timeout=5;
+        server 127.0.0.1:6002;
+        dynamic_upstream_backoff max=60s;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&verbose=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=5;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+
+
+=== TEST 2: update fail_timeout with backoff
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        dynamic_upstream_backoff;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&fail_timeout=3
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=3;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+
+
+=== TEST 3: fail_timeout grows by the failure windows of a closed port
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6003 fail_timeout=1;
+        dynamic_upstream_backoff max=60s;
+    }
+
+    server {
+        listen 6001;
+
+        location / {
+            return 200 "6001";
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+
+    location = /slow.txt {
+        limit_rate 1k;
+    }
+--- user_files eval
+">>> slow.txt\n" . ("x" x 3072)
+--- request eval
+[
+    "GET /",
+    "GET /",
+    "GET /slow.txt",
+    "GET /dynamic?upstream=zone_for_backends&verbose=",
+    "GET /",
+    "GET /",
+    "GET /slow.txt",
+    "GET /dynamic?upstream=zone_for_backends&verbose=",
+]
+--- response_body_like eval
+[
+    "^6001\$",
+    "^6001\$",
+    "^x{3072}\$",
+    "^server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;\\nserver 127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=1 backoff=1;\\n\$",
+    "^6001\$",
+    "^6001\$",
+    "^x{3072}\$",
+    "^server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;\\nserver 127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=2 backoff=2;\\n\$",
+]
@@ -0,0 +1,133 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 6);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: add with warm
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        keepalive 8;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=&warm=2
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+
+
+=== TEST 2: invalid warm
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        keepalive 8;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=&warm=a
+--- response_body_like: 400 Bad Request
+--- error_code: 400
+
+
+=== TEST 3: purge with remove
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6011;
+        server 127.0.0.1:6012;
+        keepalive 8;
+    }
+
+    server {
+        listen 6011;
+        return 200 "6011\n";
+    }
+
+    server {
+        listen 6012;
+        return 200 "6012\n";
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+        proxy_pass http://backends;
+    }
+--- request eval
+[
+    "GET /",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6011&remove=",
+]
+--- response_body eval
+[
+    "6011\n",
+    "server 127.0.0.1:6012;
+",
+]
+--- wait: 2
+--- error_log
+closed 1 keepalive connections to evicted servers in upstream "backends"
+
+
+=== TEST 4: purge with down
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6011;
+        server 127.0.0.1:6012;
+        keepalive 8;
+    }
+
+    server {
+        listen 6011;
+        return 200 "6011\n";
+    }
+
+    server {
+        listen 6012;
+        return 200 "6012\n";
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+        proxy_pass http://backends;
+    }
+--- request eval
+[
+    "GET /",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6011&down=",
+]
+--- response_body eval
+[
+    "6011\n",
+    "server 127.0.0.1:6011 weight=1 max_fails=1 fail_timeout=10 down;
+server 127.0.0.1:6012 weight=1 max_fails=1 fail_timeout=10;
+",
+]
+--- wait: 2
+--- error_log
+closed 1 keepalive connections to evicted servers in upstream "backends"
@@ -0,0 +1,65 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: add to consistent hash
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        hash $arg_key consistent;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6003&add=
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+server 127.0.0.1:6003;
+
+
+=== TEST 2: remove from consistent hash
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        hash $arg_key consistent;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&remove=
+--- response_body
+server 127.0.0.1:6002;
+
+
+=== TEST 3: no room for points
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        hash $arg_key consistent;
+        server 127.0.0.1:6001;
+        dynamic_upstream_hash_points 160;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=
+--- response_body_like: 500 Internal Server Error
+--- error_code: 500
@@ -0,0 +1,133 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * 2 * (5 + 5 + 72);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: least_conn with added and removed servers
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        least_conn;
+        server 127.0.0.1:6011;
+    }
+
+    server {
+        listen 6011;
+        return 200 "6011\n";
+    }
+
+    server {
+        listen 6012;
+        return 200 "6012\n";
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+--- request eval
+[
+    "GET /",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6012&add=",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6011&remove=",
+    "GET /",
+    "GET /",
+]
+--- response_body eval
+[
+    "6011\n",
+    "server 127.0.0.1:6011;
+server 127.0.0.1:6012;
+",
+    "server 127.0.0.1:6012;
+",
+    "6012\n",
+    "6012\n",
+]
+
+
+=== TEST 2: random refuses added and removed servers
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        random two;
+        server 127.0.0.1:6011;
+    }
+
+    server {
+        listen 6011;
+        return 200 "6011\n";
+    }
+
+    server {
+        listen 6012;
+        return 200 "6012\n";
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+--- request eval
+[
+    "GET /",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6012&add=",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6011&weight=2",
+    "GET /",
+    "GET /",
+]
+--- response_body_like eval
+[
+    "^6011\n\$",
+    "400 Bad Request",
+    "^server 127.0.0.1:6011;\n\$",
+    "^6011\n\$",
+    "^6011\n\$",
+]
+--- error_code eval
+[200, 400, 200, 200, 200]
+
+
+=== TEST 3: least_conn with more servers than a word of the tried bitmap
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        least_conn;
+        server 127.0.0.1:6011 down;
+    }
+
+    server {
+        listen 6011;
+        return 200 "6011\n";
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location / {
+        proxy_pass http://backends;
+    }
+--- request eval
+[
+    (map { "GET /dynamic?upstream=zone_for_backends&server=127.0.0.2:" . (7000 + $_) . "&add=&down=" } 1 .. 70),
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6011&up=",
+    "GET /",
+]
+--- response_body_like eval
+[
+    (map { qr/server 127\.0\.0\.2:/ } 1 .. 71),
+    qr/^6011$/,
+]
@@ -0,0 +1,141 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: replace
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+POST /dynamic?upstream=zone_for_backends&replace=
+server 127.0.0.1:6001 weight=2;
+server 127.0.0.1:6003;
+--- response_body
+updated server 127.0.0.1:6001;
+added server 127.0.0.1:6003;
+removed server 127.0.0.1:6002;
+
+
+=== TEST 2: replace and list
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "POST /dynamic?upstream=zone_for_backends&replace=
+127.0.0.1:6001
+127.0.0.1:6003 max_fails=3 fail_timeout=30s down
+127.0.0.1:6004 backup
+",
+    "GET /dynamic?upstream=zone_for_backends&verbose=",
+]
+--- response_body eval
+[
+    "added server 127.0.0.1:6003;
+added server 127.0.0.1:6004 backup;
+removed server 127.0.0.1:6002 backup;
+",
+    "server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6003 weight=1 max_fails=3 fail_timeout=30 down;
+server 127.0.0.1:6004 weight=1 max_fails=1 fail_timeout=10 backup;
+",
+]
+
+
+=== TEST 3: replace without changes
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+POST /dynamic?upstream=zone_for_backends&replace=
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+--- response_body
+
+
+=== TEST 4: replace without primary servers
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+POST /dynamic?upstream=zone_for_backends&replace=
+server 127.0.0.1:6002 backup;
+--- response_body_like: 400 Bad Request
+--- error_code: 400
+
+
+=== TEST 5: replace without body
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&replace=
+--- response_body_like: 400 Bad Request
+--- error_code: 400
+
+
+=== TEST 6: replace with an invalid server
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "POST /dynamic?upstream=zone_for_backends&replace=
+127.0.0.1:6002
+127.0.0.1:99999
+",
+    "GET /dynamic?upstream=zone_for_backends",
+]
+--- response_body_like eval
+[
+    "400 Bad Request",
+    "^server 127.0.0.1:6001;\n\$",
+]
+--- error_code eval
+[400, 200]
@@ -0,0 +1,85 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * 3 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: generation of list
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends
+--- response_headers
+ETag: "0"
+--- response_body
+server 127.0.0.1:6001;
+
+
+=== TEST 2: generation of add
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=
+--- response_headers
+ETag: "1"
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+
+
+=== TEST 3: If-Match
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- more_headers
+If-Match: "0"
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=
+--- response_headers
+ETag: "1"
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+
+
+=== TEST 4: stale If-Match
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- more_headers
+If-Match: "5"
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=
+--- response_body_like: 412 Precondition Failed
+--- error_code: 412
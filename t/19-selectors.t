@@ -0,0 +1,155 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 6);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: down by server_cidr
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.2:6002;
+        server 127.0.1.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server_cidr=127.0.0.0/24&down=",
+    "GET /dynamic?upstream=zone_for_backends",
+]
+--- response_body eval
+[
+    "updated server 127.0.0.1:6001;
+updated server 127.0.0.2:6002;
+",
+    "server 127.0.0.1:6001 down;
+server 127.0.0.2:6002 down;
+server 127.0.1.1:6003;
+",
+]
+
+
+=== TEST 2: weight by server_prefix
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:7003 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server_prefix=127.0.0.1:60&weight=3",
+    "GET /dynamic?upstream=zone_for_backends&verbose=",
+]
+--- response_body eval
+[
+    "updated server 127.0.0.1:6001;
+updated server 127.0.0.1:6002;
+",
+    "server 127.0.0.1:6001 weight=3 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=3 max_fails=1 fail_timeout=10;
+server 127.0.0.1:7003 weight=1 max_fails=1 fail_timeout=10 backup;
+",
+]
+
+
+=== TEST 3: remove by server_cidr
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.1.1:6002;
+        server 127.0.1.2:6003 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server_cidr=127.0.1.0/24&remove=",
+    "GET /dynamic?upstream=zone_for_backends",
+]
+--- response_body eval
+[
+    "removed server 127.0.1.1:6002;
+removed server 127.0.1.2:6003 backup;
+",
+    "server 127.0.0.1:6001;
+",
+]
+
+
+=== TEST 4: remove all the primary servers
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.2:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server_cidr=127.0.0.0/8&remove=
+--- error_code: 400
+
+
+=== TEST 5: no server selected
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server_cidr=10.0.0.0/8&down=
+--- response_body
+
+
+=== TEST 6: invalid server_cidr
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server_cidr=127.0.0.1/33&down=
+--- error_code: 400
+
+
+=== TEST 7: server_cidr with server
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server_cidr=127.0.0.0/8&server=127.0.0.1:6001&down=
+--- error_code: 400
@@ -0,0 +1,85 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: add the same address
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:80;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&add=&server=127.0.0.1
+--- error_code: 400
+
+
+=== TEST 2: down without the port
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:80;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1&down=
+--- response_body
+server 127.0.0.1:80 weight=1 max_fails=1 fail_timeout=10 down;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+
+
+=== TEST 3: remove by the address of IPv6
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server [::1]:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&remove=&server=[0:0::1]:6002",
+    "GET /dynamic?upstream=zone_for_backends&add=&server=[0::1]:6002",
+]
+--- response_body eval
+[
+    "server 127.0.0.1:6001;
+",
+    "server 127.0.0.1:6001;
+server [0::1]:6002;
+",
+]
+
+
+=== TEST 4: replace with the same address
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+POST /dynamic?upstream=zone_for_backends&replace=
+server 127.0.0.1:80;
+server 127.0.0.1;
+--- error_code: 400
@@ -0,0 +1,83 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: down in the upstreams of a list
+--- http_config
+    upstream backends_a {
+        zone zone_for_a 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    upstream backends_b {
+        zone zone_for_b 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream backends_c {
+        zone zone_for_c 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_a,zone_for_b&server=127.0.0.1:6001&down=",
+    "GET /dynamic?upstream=zone_for_b",
+]
+--- response_body eval
+[
+    "upstream zone_for_a status=200 generation=1;
+upstream zone_for_b status=200 generation=1;
+",
+    "server 127.0.0.1:6001 down;
+",
+]
+
+
+=== TEST 2: add to the upstreams of a wildcard
+--- http_config
+    upstream backends_a {
+        zone zone_for_a 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream backends_b {
+        zone zone_for_b 128k;
+        server 127.0.0.1:6002;
+    }
+    upstream backends_c {
+        zone zone_of_c 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_*&add=&server=127.0.0.1:6002
+--- response_body
+upstream zone_for_a status=200 generation=1;
+upstream zone_for_b status=400 generation=0;
+
+
+=== TEST 3: no upstream matched
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_of_*&server=127.0.0.1:6001&down=
+--- error_code: 404
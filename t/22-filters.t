@@ -0,0 +1,116 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks());
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: list a server
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002
+--- response_body
+server 127.0.0.1:6002;
+
+
+=== TEST 2: list by state
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 down;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&state=up
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6003 backup;
+
+
+=== TEST 3: list the backup servers
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 down;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&state=backup
+--- response_body
+server 127.0.0.1:6003 backup;
+
+
+=== TEST 4: list a page
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+        server 127.0.0.1:6004;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&offset=1&limit=2
+--- response_body
+server 127.0.0.1:6002;
+server 127.0.0.1:6003;
+
+
+=== TEST 5: down with quiet
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&down=&quiet=
+--- response_body
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 down;
+
+
+=== TEST 6: invalid state
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&state=drain
+--- error_code: 400
@@ -0,0 +1,134 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 12);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: claim and release a spare
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream spare_1 {
+        zone zone_for_spare_1 128k;
+        dynamic_upstream_spare on;
+        server 127.0.0.1:6002 down;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?claim=svc_a",
+    "GET /dynamic?upstream=svc_a",
+    "GET /dynamic?upstream=svc_a&release=",
+]
+--- response_body eval
+[
+    "upstream zone_for_spare_1 claimed=svc_a;
+",
+    "server 127.0.0.1:6002 down;
+",
+    "server 127.0.0.1:6002 down;
+",
+]
+
+
+=== TEST 2: claim the name of a zone
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream spare_1 {
+        zone zone_for_spare_1 128k;
+        dynamic_upstream_spare on;
+        server 127.0.0.1:6002 down;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?claim=zone_for_backends
+--- error_code: 409
+
+
+=== TEST 3: release an upstream not spare
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&release=
+--- error_code: 400
+
+
+=== TEST 4: the variable of a name claimed and released
+--- http_config
+    dynamic_upstream_spare_variable $backend $arg_name backends;
+
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+    upstream spare_1 {
+        zone zone_for_spare_1 128k;
+        dynamic_upstream_spare on;
+        server 127.0.0.1:6002 down;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location /backend {
+        return 200 "$backend\n";
+    }
+--- request eval
+[
+    "GET /backend?name=svc_a",
+    "GET /dynamic?claim=svc_a",
+    "GET /backend?name=svc_a",
+    "GET /dynamic?upstream=svc_a&release=",
+    "GET /backend?name=svc_a",
+]
+--- response_body eval
+[
+    "backends\n",
+    "upstream zone_for_spare_1 claimed=svc_a;\n",
+    "spare_1\n",
+    "server 127.0.0.1:6002 down;\n",
+    "backends\n",
+]
+
+
+=== TEST 5: the variable of a name not claimed is not found
+--- http_config
+    dynamic_upstream_spare_variable $backend $arg_name;
+
+    upstream spare_1 {
+        zone zone_for_spare_1 128k;
+        dynamic_upstream_spare on;
+        server 127.0.0.1:6002 down;
+    }
+--- config
+    location /backend {
+        return 200 "[$backend]\n";
+    }
+--- request
+    GET /backend?name=svc_a
+--- response_body
+[]
@@ -0,0 +1,80 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: export
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 weight=2 max_fails=3 fail_timeout=5;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&export=
+--- response_body
+# ngx_dynamic_upstream 1 generation=0
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=2 max_fails=3 fail_timeout=5;
+server 127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=10 backup;
+
+
+=== TEST 2: import and export
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "POST /dynamic?upstream=zone_for_backends&import=
+# ngx_dynamic_upstream 1 generation=12
+server 127.0.0.1:6001 weight=3 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6004 weight=1 max_fails=1 fail_timeout=10 down;
+",
+    "GET /dynamic?upstream=zone_for_backends&export=",
+]
+--- response_body eval
+[
+    "updated server 127.0.0.1:6001;
+added server 127.0.0.1:6004;
+removed server 127.0.0.1:6002;
+",
+    "# ngx_dynamic_upstream 1 generation=1
+server 127.0.0.1:6001 weight=3 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6004 weight=1 max_fails=1 fail_timeout=10 down;
+",
+]
+
+
+=== TEST 3: import of another version
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+POST /dynamic?upstream=zone_for_backends&import=
+# ngx_dynamic_upstream 2 generation=1
+server 127.0.0.1:6002;
+--- error_code: 400
@@ -0,0 +1,143 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 4);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: replicate to a node
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_replicate /replica_b;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+
+    server {
+        listen 6010;
+
+        location /dynamic {
+            dynamic_upstream;
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location /replica_b {
+        internal;
+        proxy_pass http://127.0.0.1:6010/dynamic;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&down=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 down;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+replicated /replica_b status=200 tries=1;
+
+
+=== TEST 2: retry a node down
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_replicate /replica_b tries=2;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location /replica_b {
+        internal;
+        proxy_pass http://127.0.0.1:6011/dynamic;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&down=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 down;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+replicated /replica_b status=502 tries=2;
+
+
+=== TEST 3: an op replicated twice is applied once
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=&replicated=1500000000.5.node_a",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=&replicated=1500000000.5.node_a",
+]
+--- response_body eval
+[
+    "server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+",
+    "server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+",
+]
+
+
+=== TEST 4: the ops of two nodes with the same generation are applied
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=&replicated=1500000000.5.node_a.example.com",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6003&add=&replicated=1500000000.5.node_b.example.com",
+]
+--- response_body eval
+[
+    "server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+",
+    "server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+server 127.0.0.1:6003;
+",
+]
+
+
+=== TEST 5: retry a node down after the backoff
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_replicate /replica_b tries=3 backoff=10ms node=node_a;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location /replica_b {
+        internal;
+        proxy_pass http://127.0.0.1:6011/dynamic;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&down=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 down;
+replicated /replica_b status=502 tries=3;
@@ -0,0 +1,182 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 8);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: down by the writer
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_queue;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&down=
+--- response_body
+server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 down;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+
+
+=== TEST 2: weights one after another
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_queue size=8 interval=5ms;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=2",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=3",
+]
+--- response_body eval
+[
+    "server 127.0.0.1:6001 weight=2 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+",
+    "server 127.0.0.1:6001 weight=3 max_fails=1 fail_timeout=10;
+server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;
+",
+]
+
+
+=== TEST 3: add by the writer
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_queue;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=
+--- response_body
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+
+
+=== TEST 4: the error of the writer
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_queue;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&add=
+--- response_body_like: 400 Bad Request
+--- error_code: 400
+
+
+=== TEST 5: down and up in a batch
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_queue interval=100ms;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location /batch {
+        ssi on;
+        ssi_types *;
+        return 200 '<!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&down=" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&up=" -->';
+    }
+--- request eval
+[
+    "GET /batch",
+    "GET /dynamic?upstream=zone_for_backends&history=",
+]
+--- response_body_like eval
+[
+    "^(server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10;\\nserver 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;\\n){2}\$",
+    "^\\d+ generation=1 client=127.0.0.1 param server 127.0.0.1:6001 [^\\n]*-> weight=1 max_fails=1 fail_timeout=10;\\n\$",
+]
+
+
+=== TEST 6: weights in a batch
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_queue interval=100ms;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location /batch {
+        ssi on;
+        ssi_types *;
+        return 200 '<!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=2" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=3" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=4" -->';
+    }
+--- request eval
+[
+    "GET /batch",
+    "GET /dynamic?upstream=zone_for_backends&history=",
+]
+--- response_body_like eval
+[
+    "^(server 127.0.0.1:6001 weight=4 max_fails=1 fail_timeout=10;\\nserver 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;\\n){3}\$",
+    "^\\d+ generation=1 client=127.0.0.1 param server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 -> weight=4 max_fails=1 fail_timeout=10;\\n\$",
+]
+
+
+=== TEST 7: the ops waiting for a slot of the full queue
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_upstream_queue size=8 interval=50ms;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+
+    location /batch {
+        ssi on;
+        ssi_types *;
+        return 200 '<!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=2" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=3" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=4" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=5" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=6" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=7" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=8" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=9" --><!--# include virtual="/dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=10" -->';
+    }
+--- request eval
+[
+    "GET /batch",
+    "GET /dynamic?upstream=zone_for_backends&history=",
+]
+--- response_body_like eval
+[
+    "server 127.0.0.1:6001 weight=10 ",
+    "^\\d+ generation=1 client=127.0.0.1 param server 127.0.0.1:6001 weight=1 [^\\n]*-> weight=9 [^\\n]*\\n"
+  . "\\d+ generation=2 client=127.0.0.1 param server 127.0.0.1:6001 weight=9 [^\\n]*-> weight=10 [^\\n]*\\n\$",
+]
@@ -0,0 +1,75 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (2 * blocks() + 8);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: history of the changes
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&weight=2&down=",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&add=&backup=",
+    "GET /dynamic?upstream=zone_for_backends&history=",
+]
+--- response_body_like eval
+[
+    "weight=2",
+    "^server 127.0.0.1:6001;\\nserver 127.0.0.1:6002 backup;\\n\$",
+    "^\\d+ generation=1 client=127.0.0.1 param server 127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 -> weight=2 max_fails=1 fail_timeout=10 down;\\n"
+  . "\\d+ generation=2 client=127.0.0.1 add server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 backup;\\n\$",
+]
+
+
+=== TEST 2: the last change
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request eval
+[
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&down=",
+    "GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6002&remove=",
+    "GET /dynamic?upstream=zone_for_backends&history=1",
+]
+--- response_body_like eval
+[
+    "down",
+    "^server 127.0.0.1:6001;\\n\$",
+    "^\\d+ generation=2 client=127.0.0.1 remove server 127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10;\\n\$",
+]
+
+
+=== TEST 3: history with an op
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=zone_for_backends&server=127.0.0.1:6001&down=&history=
+--- response_body_like: 400 Bad Request
+--- error_code: 400